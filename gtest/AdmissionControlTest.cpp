@@ -0,0 +1,151 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <gtest/gtest.h>
+
+#include "AdmissionControl.h"
+
+
+using namespace lb::httpd;
+
+
+namespace
+{
+
+
+Server::Config::AdmissionControl config()
+{
+  Server::Config::AdmissionControl c;
+  c.enabled = true;
+  c.initialLimit = 32;
+  c.minLimit = 4;
+  c.maxLimit = 1024;
+  c.tolerance = 1.5;
+  return c;
+}
+
+/** \brief Fill up to the limit then complete one request taking \a latency. */
+void releaseAtLimit( AdmissionControl& ac, std::chrono::microseconds latency )
+{
+  while ( ac.tryAcquire() )
+  {
+  }
+  ac.release( latency );
+}
+
+
+} // End of anonymous namespace
+
+
+TEST( AdmissionControl, RefusesOverLimit )
+{
+  AdmissionControl ac{ config() };
+
+  for ( int i = 0; i < 32; ++i )
+  {
+    EXPECT_TRUE( ac.tryAcquire() );
+  }
+  EXPECT_FALSE( ac.tryAcquire() );
+  EXPECT_EQ( ac.inFlight(), 32u );
+
+  ac.abandon();
+  EXPECT_TRUE( ac.tryAcquire() );
+}
+
+TEST( AdmissionControl, GrowsWhileLatencyHolds )
+{
+  AdmissionControl ac{ config() };
+
+  uint64_t previous{ ac.limit() };
+  for ( int i = 0; i < 100; ++i )
+  {
+    releaseAtLimit( ac, std::chrono::microseconds{ 1000 } );
+    EXPECT_GE( ac.limit(), previous );
+    previous = ac.limit();
+  }
+
+  EXPECT_GT( ac.limit(), 32u );
+  EXPECT_LE( ac.limit(), 1024u );
+}
+
+TEST( AdmissionControl, StopsAtMaxLimit )
+{
+  auto c{ config() };
+  c.maxLimit = 40;
+  AdmissionControl ac{ c };
+
+  for ( int i = 0; i < 1000; ++i )
+  {
+    releaseAtLimit( ac, std::chrono::microseconds{ 1000 } );
+  }
+
+  EXPECT_EQ( ac.limit(), 40u );
+}
+
+TEST( AdmissionControl, BacksOffWhenLatencyRises )
+{
+  AdmissionControl ac{ config() };
+
+  for ( int i = 0; i < 100; ++i )
+  {
+    releaseAtLimit( ac, std::chrono::microseconds{ 1000 } );
+  }
+  const uint64_t grown{ ac.limit() };
+
+  for ( int i = 0; i < 20; ++i )
+  {
+    releaseAtLimit( ac, std::chrono::microseconds{ 20000 } );
+  }
+
+  EXPECT_LT( ac.limit(), grown );
+  EXPECT_GE( ac.limit(), 4u );
+}
+
+TEST( AdmissionControl, StopsAtMinLimit )
+{
+  auto c{ config() };
+  c.minLimit = 8;
+  AdmissionControl ac{ c };
+
+  // Latency that keeps on rising keeps the gradient at its floor of 0.5, which
+  // on its own would settle the limit at 4.
+  double latency{ 1000 };
+  for ( int i = 0; i < 300; ++i )
+  {
+    releaseAtLimit( ac, std::chrono::microseconds{ int64_t( latency ) } );
+    latency *= 1.05;
+  }
+
+  EXPECT_EQ( ac.limit(), 8u );
+}
+
+TEST( AdmissionControl, HoldsWhenApplicationLimited )
+{
+  AdmissionControl ac{ config() };
+
+  // Never more than one request in flight says nothing about 32 or more.
+  for ( int i = 0; i < 1000; ++i )
+  {
+    ASSERT_TRUE( ac.tryAcquire() );
+    ac.release( std::chrono::microseconds{ 1000 } );
+  }
+
+  EXPECT_EQ( ac.limit(), 32u );
+  EXPECT_EQ( ac.inFlight(), 0u );
+}
@@ -0,0 +1,130 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <gtest/gtest.h>
+
+#include "FramePlan.h"
+
+
+using namespace lb::httpd;
+using OpCode = lb::encoding::websocket::Header::OpCode;
+
+
+namespace
+{
+
+
+/** \brief Total payload carried by the frames of \a plan. */
+size_t plannedPayload( const FramePlan& plan )
+{
+  size_t lastPayloadSize{ uint8_t( plan.last.bytes[1] ) & 0x7fu };
+  if ( lastPayloadSize == 126 )
+  {
+    lastPayloadSize = ( uint8_t( plan.last.bytes[2] ) << 8 ) | uint8_t( plan.last.bytes[3] );
+  }
+  return plan.numFragments * plan.fragmentPayloadSize + lastPayloadSize;
+}
+
+
+} // End of anonymous namespace
+
+
+TEST( FramePlan, ZeroPayload )
+{
+  const auto plan{ FramePlan::create( OpCode::eText, 0, 0 ) };
+  ASSERT_TRUE( plan );
+
+  EXPECT_EQ( plan->numFragments, 0u );
+  ASSERT_EQ( plan->last.size, 2u );
+  EXPECT_EQ( uint8_t( plan->last.bytes[0] ), 0x81 ); // fin, text
+  EXPECT_EQ( uint8_t( plan->last.bytes[1] ), 0x00 ); // unmasked, no payload
+
+  // A frame size limit makes no difference to an empty message.
+  const auto limited{ FramePlan::create( OpCode::eText, 0, 3 ) };
+  ASSERT_TRUE( limited );
+  EXPECT_EQ( limited->numFragments, 0u );
+  EXPECT_EQ( limited->last.view(), plan->last.view() );
+}
+
+TEST( FramePlan, NoLimitIsOneFrame )
+{
+  const auto plan{ FramePlan::create( OpCode::eBinary, 100000, 0 ) };
+  ASSERT_TRUE( plan );
+
+  EXPECT_EQ( plan->numFragments, 0u );
+  EXPECT_EQ( uint8_t( plan->last.bytes[0] ), 0x82 ); // fin, binary
+  EXPECT_EQ( plan->last.size, 10u );
+}
+
+TEST( FramePlan, PayloadFillingTheFrameIsOneFrame )
+{
+  // 2 byte header + 100 byte payload, exactly the frame size.
+  const auto plan{ FramePlan::create( OpCode::eText, 100, 102 ) };
+  ASSERT_TRUE( plan );
+
+  EXPECT_EQ( plan->numFragments, 0u );
+  EXPECT_EQ( plan->last.size + 100, 102u );
+  EXPECT_EQ( plannedPayload( *plan ), 100u );
+}
+
+TEST( FramePlan, PayloadEqualToFrameSizeIsTwoFrames )
+{
+  // The header does not fit alongside, so one byte spills into a second frame.
+  const auto plan{ FramePlan::create( OpCode::eText, 100, 100 ) };
+  ASSERT_TRUE( plan );
+
+  EXPECT_EQ( plan->numFragments, 1u );
+  EXPECT_EQ( plan->fragmentPayloadSize, 98u );
+  EXPECT_EQ( plan->first.size + plan->fragmentPayloadSize, 100u );
+  EXPECT_EQ( uint8_t( plan->first.bytes[0] ), 0x01 ); // not fin, text
+  EXPECT_EQ( uint8_t( plan->last.bytes[0] ), 0x80 );  // fin, continuation
+  EXPECT_EQ( plannedPayload( *plan ), 100u );
+}
+
+TEST( FramePlan, FragmentsAreContinuations )
+{
+  const auto plan{ FramePlan::create( OpCode::eBinary, 1000, 102 ) };
+  ASSERT_TRUE( plan );
+
+  EXPECT_EQ( plan->fragmentPayloadSize, 98u );
+  EXPECT_EQ( plan->numFragments, 10u );
+  EXPECT_EQ( uint8_t( plan->first.bytes[0] ), 0x02 );  // not fin, binary
+  EXPECT_EQ( uint8_t( plan->middle.bytes[0] ), 0x00 ); // not fin, continuation
+  EXPECT_EQ( plannedPayload( *plan ), 1000u );
+}
+
+TEST( FramePlan, FrameSizeAtHeaderMinimum )
+{
+  // No room for any payload alongside the 2 byte header.
+  EXPECT_FALSE( FramePlan::create( OpCode::eText, 100, 1 ) );
+  EXPECT_FALSE( FramePlan::create( OpCode::eText, 100, 2 ) );
+
+  // Room for a single byte of payload per frame.
+  const auto plan{ FramePlan::create( OpCode::eText, 100, 3 ) };
+  ASSERT_TRUE( plan );
+  EXPECT_EQ( plan->fragmentPayloadSize, 1u );
+  EXPECT_EQ( plan->numFragments, 99u );
+  EXPECT_EQ( plannedPayload( *plan ), 100u );
+
+  // A payload needing a 2 byte extended length needs a 4 byte header.
+  EXPECT_FALSE( FramePlan::create( OpCode::eText, 1000, 4 ) );
+  const auto extended{ FramePlan::create( OpCode::eText, 1000, 5 ) };
+  ASSERT_TRUE( extended );
+  EXPECT_EQ( extended->numFragments, 999u );
+}
@@ -0,0 +1,90 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <gtest/gtest.h>
+
+#include "ws/MessageImpl.h"
+
+#include <thread>
+#include <vector>
+
+
+using namespace lb::httpd;
+using OpCode = lb::encoding::websocket::Header::OpCode;
+
+
+namespace
+{
+
+
+const ws::Message::Impl& impl( const ws::Message& message )
+{
+  return *ws::Message::Impl::get( message );
+}
+
+
+} // End of anonymous namespace
+
+
+TEST( Message, FramePlanMatchesUncached )
+{
+  const ws::Message message{ std::string( 1000, 'x' ) };
+
+  // More combinations than are cached, the rest being planned afresh.
+  for ( int pass = 0; pass < 2; ++pass )
+  {
+    for ( size_t maxFrameSize : { 0, 100, 200, 300, 400, 500, 600 } )
+    {
+      for ( auto opCode : { OpCode::eText, OpCode::eBinary } )
+      {
+        const auto plan{ impl( message ).framePlan( opCode, maxFrameSize ) };
+        const auto expected{ FramePlan::create( opCode, 1000, maxFrameSize ) };
+        ASSERT_TRUE( plan );
+        EXPECT_EQ( plan->numFragments, expected->numFragments );
+        EXPECT_EQ( plan->fragmentPayloadSize, expected->fragmentPayloadSize );
+        EXPECT_EQ( plan->first.view(), expected->first.view() );
+        EXPECT_EQ( plan->last.view(), expected->last.view() );
+      }
+    }
+  }
+}
+
+TEST( Message, FramePlanConcurrent )
+{
+  const ws::Message message{ std::string( 1000, 'x' ) };
+
+  std::vector<std::thread> threads;
+  for ( size_t t = 0; t < 8; ++t )
+  {
+    threads.emplace_back( [&message, t]
+    {
+      for ( size_t i = 0; i < 1000; ++i )
+      {
+        const size_t maxFrameSize{ 100 + ( ( t + i ) % 8 ) * 10 };
+        const auto plan{ impl( message ).framePlan( OpCode::eBinary, maxFrameSize ) };
+        ASSERT_TRUE( plan );
+        ASSERT_EQ( plan->fragmentPayloadSize, maxFrameSize - 4 );
+      }
+    } );
+  }
+  for ( auto& thread : threads )
+  {
+    thread.join();
+  }
+}
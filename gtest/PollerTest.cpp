@@ -0,0 +1,52 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <gtest/gtest.h>
+
+#include "Poller.h"
+
+#include <unistd.h>
+
+
+TEST( Poller, HangUpIsDispatched )
+{
+  int fds[2];
+  ASSERT_EQ( pipe( fds ), 0 );
+
+  int numCalls{ 0 };
+  Poller poller;
+  poller.add( fds[0], [&]
+  {
+    ++numCalls;
+    char c;
+    return read( fds[0], &c, 1 ) > 0;
+  } );
+
+  // The read end of a pipe whose write end is closed polls as EPOLLHUP alone.
+  close( fds[1] );
+
+  EXPECT_EQ( poller( 1000 ), 1 );
+  EXPECT_EQ( numCalls, 1 );
+
+  // Removed on reading the EOF rather than reported on every poll.
+  EXPECT_EQ( poller( 0 ), 0 );
+  EXPECT_EQ( numCalls, 1 );
+
+  close( fds[0] );
+}
@@ -0,0 +1,188 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <gtest/gtest.h>
+
+#include "RateLimiter.h"
+
+#include <cstring>
+#include <netinet/in.h>
+
+
+using namespace lb::httpd;
+using namespace std::chrono_literals;
+
+
+namespace
+{
+
+
+constexpr auto eRequest{ RateLimiter::Kind::eRequest };
+constexpr auto eMessage{ RateLimiter::Kind::eMessage };
+
+RateLimiter::Address ipv4( uint32_t n )
+{
+  sockaddr_in in{};
+  in.sin_family = AF_INET;
+  in.sin_addr.s_addr = htonl( n );
+  return *RateLimiter::address( (const sockaddr*)&in );
+}
+
+RateLimiter::Address ipv6( const char* prefix, uint64_t interfaceID )
+{
+  sockaddr_in6 in6{};
+  in6.sin6_family = AF_INET6;
+  std::memcpy( &in6.sin6_addr, prefix, 8 );
+  for ( int i = 0; i < 8; ++i )
+  {
+    in6.sin6_addr.s6_addr[ 15 - i ] = uint8_t( interfaceID >> ( 8 * i ) );
+  }
+  return *RateLimiter::address( (const sockaddr*)&in6 );
+}
+
+
+} // End of anonymous namespace
+
+
+TEST( RateLimiter, NoAddressForUnixSockets )
+{
+  sockaddr un{};
+  un.sa_family = AF_UNIX;
+  EXPECT_FALSE( RateLimiter::address( &un ) );
+  EXPECT_FALSE( RateLimiter::address( nullptr ) );
+}
+
+TEST( RateLimiter, ZeroRateIsUnlimited )
+{
+  Server::Config::RateLimit c;
+  RateLimiter limiter{ c };
+
+  EXPECT_FALSE( limiter.enabled( eRequest ) );
+  for ( int i = 0; i < 1000; ++i )
+  {
+    EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eRequest ) );
+  }
+  EXPECT_EQ( limiter.numAddresses(), 0u );
+}
+
+TEST( RateLimiter, AllowsBurstThenRefuses )
+{
+  Server::Config::RateLimit c;
+  c.requestsPerSecond = 1;
+  c.requestBurst = 5;
+  RateLimiter limiter{ c };
+  const auto now{ std::chrono::steady_clock::now() };
+
+  for ( int i = 0; i < 5; ++i )
+  {
+    EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eRequest, now ) );
+  }
+  EXPECT_FALSE( limiter.tryAcquire( ipv4( 1 ), eRequest, now ) );
+
+  // Each address and each kind has its own bucket.
+  EXPECT_TRUE( limiter.tryAcquire( ipv4( 2 ), eRequest, now ) );
+  EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eMessage, now ) );
+}
+
+TEST( RateLimiter, RefillsAtRate )
+{
+  Server::Config::RateLimit c;
+  c.requestsPerSecond = 10;
+  c.requestBurst = 2;
+  RateLimiter limiter{ c };
+
+  const auto start{ std::chrono::steady_clock::now() };
+  EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eRequest, start ) );
+  EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eRequest, start ) );
+  EXPECT_FALSE( limiter.tryAcquire( ipv4( 1 ), eRequest, start ) );
+
+  // Enough for one token, not two.
+  const auto later{ start + 120ms };
+  EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eRequest, later ) );
+  EXPECT_FALSE( limiter.tryAcquire( ipv4( 1 ), eRequest, later ) );
+
+  // Never more than the burst however long it has been.
+  const auto muchLater{ later + 1h };
+  EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eRequest, muchLater ) );
+  EXPECT_TRUE( limiter.tryAcquire( ipv4( 1 ), eRequest, muchLater ) );
+  EXPECT_FALSE( limiter.tryAcquire( ipv4( 1 ), eRequest, muchLater ) );
+}
+
+TEST( RateLimiter, KeysIPv6OnTheSlash64 )
+{
+  Server::Config::RateLimit c;
+  c.requestsPerSecond = 1;
+  c.requestBurst = 2;
+  RateLimiter limiter{ c };
+  const auto now{ std::chrono::steady_clock::now() };
+
+  const char site[8]{ 0x20, 0x01, 0x0d, char( 0xb8 ), 0, 0, 0, 1 };
+  const char otherSite[8]{ 0x20, 0x01, 0x0d, char( 0xb8 ), 0, 0, 0, 2 };
+
+  EXPECT_EQ( ipv6( site, 1 ), ipv6( site, 0xffff ) );
+  EXPECT_NE( ipv6( site, 1 ), ipv6( otherSite, 1 ) );
+
+  // A fresh interface ID does not get a fresh bucket.
+  EXPECT_TRUE( limiter.tryAcquire( ipv6( site, 1 ), eRequest, now ) );
+  EXPECT_TRUE( limiter.tryAcquire( ipv6( site, 2 ), eRequest, now ) );
+  EXPECT_FALSE( limiter.tryAcquire( ipv6( site, 3 ), eRequest, now ) );
+  EXPECT_TRUE( limiter.tryAcquire( ipv6( otherSite, 1 ), eRequest, now ) );
+}
+
+TEST( RateLimiter, ForgetsIdleAddresses )
+{
+  Server::Config::RateLimit c;
+  c.requestsPerSecond = 100;
+  c.requestBurst = 1;
+  RateLimiter limiter{ c };
+
+  const auto start{ std::chrono::steady_clock::now() };
+  for ( uint32_t i = 0; i < 64; ++i )
+  {
+    limiter.tryAcquire( ipv4( i ), eRequest, start );
+  }
+  EXPECT_EQ( limiter.numAddresses(), 64u );
+
+  // Idle entries are kept for at least a second.
+  const auto later{ start + 1100ms };
+
+  // Lookups sweep a few hash buckets each, so enough of them cover every
+  // shard many times over.
+  for ( uint32_t i = 1000; i < 3000; ++i )
+  {
+    limiter.tryAcquire( ipv4( i ), eRequest, later );
+  }
+  EXPECT_EQ( limiter.numAddresses(), 2000u );
+}
+
+TEST( RateLimiter, CapsTrackedAddresses )
+{
+  Server::Config::RateLimit c;
+  c.requestsPerSecond = 1;
+  c.requestBurst = 1;
+  c.maxAddresses = 160;
+  RateLimiter limiter{ c };
+
+  for ( uint32_t i = 0; i < 10000; ++i )
+  {
+    // Even a full table takes new clients.
+    EXPECT_TRUE( limiter.tryAcquire( ipv4( i ), eRequest ) );
+  }
+  EXPECT_LE( limiter.numAddresses(), 160u );
+}
@@ -0,0 +1,168 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <gtest/gtest.h>
+
+#include "Metrics.h"
+#include "RateLimiter.h"
+#include "Tracer.h"
+#include "WebSocket.h"
+#include "ws/SendersImpl.h"
+
+#include <fcntl.h>
+#include <future>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+using namespace lb::httpd;
+using namespace std::chrono_literals;
+
+
+namespace
+{
+
+
+constexpr auto closeTimeout{ 1000ms };
+
+const auto goingAway
+{
+  lb::encoding::websocket::closestatus::toPayload(
+    lb::encoding::websocket::closestatus::ProtocolCode::eGoingAway )
+};
+
+/** \brief A WebSocket on one end of a socket pair, the test being the client. */
+struct Connection
+{
+  Connection()
+  {
+    socketpair( AF_UNIX, SOCK_STREAM, 0, fds );
+    webSocket = std::make_unique<WebSocket>( 1
+                                           , 1024
+                                           , closeTimeout
+                                           , false
+                                           , metrics
+                                           , tracer
+                                           , rateLimiter
+                                           , std::nullopt
+                                           , "/test"
+                                           , fds[0]
+                                           , nullptr
+                                           , [this]( ws::ConnectionID ){ ++numCloseCallbacks; } );
+  }
+
+  ~Connection()
+  {
+    webSocket.reset();
+    close( fds[1] );
+  }
+
+  /** \brief Send a masked close frame with an empty payload from the client. */
+  void replyToClose()
+  {
+    const char frame[]{ char( 0x88 ), char( 0x80 ), 0, 0, 0, 0 };
+    ASSERT_EQ( write( fds[1], frame, sizeof( frame ) ), ssize_t( sizeof( frame ) ) );
+  }
+
+  uint64_t numCloses( metrics::CloseReason reason ) const
+  {
+    return metrics.webSocketCloseReasons[ static_cast<size_t>( reason ) ].value();
+  }
+
+  int fds[2]{ -1, -1 };
+  metrics::Metrics metrics;
+  Tracer tracer{ 0, 0 };
+  RateLimiter rateLimiter{ Server::Config::RateLimit{} };
+  int numCloseCallbacks{ 0 };
+  std::unique_ptr<WebSocket> webSocket;
+};
+
+
+} // End of anonymous namespace
+
+
+TEST( WebSocket, ServerCloseHeldUntilTimeout )
+{
+  Connection c;
+  ASSERT_EQ( c.webSocket->sendClose( goingAway, "bye" ), ws::SendResult::eSuccess );
+  EXPECT_EQ( c.numCloseCallbacks, 1 );
+
+  const auto sent{ c.webSocket->cold->closeSentTimePoint };
+  EXPECT_FALSE( c.webSocket->canClose( sent ) );
+  EXPECT_FALSE( c.webSocket->canClose( sent + closeTimeout ) );
+  EXPECT_EQ( c.numCloses( metrics::CloseReason::eCloseTimeout ), 0u );
+
+  EXPECT_TRUE( c.webSocket->canClose( sent + closeTimeout + 1ms ) );
+
+  // Counted once, under the reason it was closed for.
+  EXPECT_EQ( c.numCloses( metrics::CloseReason::eServerClose ), 1u );
+  EXPECT_EQ( c.numCloses( metrics::CloseReason::eCloseTimeout ), 0u );
+  EXPECT_EQ( c.webSocket->cold->closeReason, metrics::CloseReason::eServerClose );
+}
+
+TEST( WebSocket, ServerCloseReleasedByReply )
+{
+  Connection c;
+  ASSERT_EQ( c.webSocket->sendClose( goingAway, "bye" ), ws::SendResult::eSuccess );
+
+  const auto sent{ c.webSocket->cold->closeSentTimePoint };
+  EXPECT_FALSE( c.webSocket->canClose( sent ) );
+
+  c.replyToClose();
+  EXPECT_FALSE( c.webSocket->receive() );
+  EXPECT_EQ( c.numCloseCallbacks, 2 );
+
+  EXPECT_TRUE( c.webSocket->canClose( sent ) );
+  EXPECT_EQ( c.numCloses( metrics::CloseReason::eCloseTimeout ), 0u );
+}
+
+TEST( WebSocket, ProtocolErrorClosesAtOnce )
+{
+  Connection c;
+
+  // Unmasked frames from a client are a protocol error.
+  const char frame[]{ char( 0x81 ), 0x00 };
+  ASSERT_EQ( write( c.fds[1], frame, sizeof( frame ) ), ssize_t( sizeof( frame ) ) );
+  EXPECT_FALSE( c.webSocket->receive() );
+
+  EXPECT_TRUE( c.webSocket->canClose( std::chrono::steady_clock::now() ) );
+  EXPECT_EQ( c.numCloses( metrics::CloseReason::eCloseTimeout ), 0u );
+}
+
+TEST( WebSocket, PongWaitsForSendInProgress )
+{
+  Connection c;
+
+  // As if an application thread were part way through writing a frame.
+  std::unique_lock sending{ ws::Senders::Impl::sendMutex( c.webSocket->cold->senders ) };
+
+  const char ping[]{ char( 0x89 ), char( 0x80 ), 0, 0, 0, 0 };
+  ASSERT_EQ( write( c.fds[1], ping, sizeof( ping ) ), ssize_t( sizeof( ping ) ) );
+  auto received{ std::async( std::launch::async, [&c]{ return c.webSocket->receive(); } ) };
+
+  EXPECT_EQ( received.wait_for( 100ms ), std::future_status::timeout );
+  fcntl( c.fds[1], F_SETFL, O_NONBLOCK );
+  char pong[2];
+  EXPECT_EQ( read( c.fds[1], pong, sizeof( pong ) ), -1 );
+
+  sending.unlock();
+  EXPECT_TRUE( received.get() );
+  ASSERT_EQ( read( c.fds[1], pong, sizeof( pong ) ), 2 );
+  EXPECT_EQ( pong[0] & 0x0f, 0x0a ); // pong
+}
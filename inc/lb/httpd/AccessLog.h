@@ -0,0 +1,119 @@
+#ifndef LIB_LB_HTTPD_ACCESSLOG_H
+#define LIB_LB_HTTPD_ACCESSLOG_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief The on-disk format of the binary access log.
+
+    Enabled by setting Server::Config::accessLogPath. The file is a
+    \a FileHeader followed by \a FileHeader::capacity fixed size \a Records
+    used as a ring: record n, counting from zero since the log was created, is
+    at slot n % capacity, and \a FileHeader::numWritten is the count written so
+    far. Once the ring has wrapped the oldest surviving record is therefore
+    numWritten - capacity.
+
+    All fields are in host byte order. The file is memory mapped by the Server
+    so may be read while it is being written, e.g. by the accessLogDecode tool.
+    A reader doing so loads numWritten (acquire), copies the records, then
+    loads \a FileHeader::numStarted (after an acquire fence) and discards any
+    copied record n below numStarted - capacity, as its slot may have been
+    overwritten meanwhile.
+ */
+namespace accesslog
+{
+
+
+constexpr uint32_t fileMagic{ 0x4c41424c }; // "LBAL" read as little endian
+constexpr uint32_t fileVersion{ 2 };
+
+
+struct FileHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;     //!< sizeof( Record ) when written
+  uint32_t reserved;
+  uint64_t capacity;       //!< Number of record slots
+  uint64_t numWritten;     //!< Updated after each record is complete
+  uint64_t numStarted;     //!< Updated before each record's slot is overwritten
+};
+static_assert( sizeof( FileHeader ) == 40 );
+
+
+enum class RecordType : uint8_t
+{
+  eHttpRequest,    //!< status is the HTTP status code
+  eWebSocketOpen,  //!< status is 101
+  eWebSocketClose  //!< status is the close reason, see \a closeReasonNames
+};
+
+
+/** \brief Why a WebSocket closed, indexed by \a Record::status. */
+constexpr const char* closeReasonNames[]
+{
+  "client_close",
+  "server_close",
+  "protocol_error",
+  "close_timeout",
+  "socket_closed",
+  "shutdown",
+  "policy_violation",
+  "migrated"
+};
+
+
+struct Record
+{
+  uint64_t timestamp;       //!< Nanoseconds since the Unix epoch
+  uint64_t connectionID;    //!< WebSocket connection ID, zero for plain HTTP
+  uint64_t bytesIn;         //!< Request body, or WebSocket bytes received
+  uint64_t bytesOut;        //!< Response body, or WebSocket bytes sent
+  uint64_t microseconds;    //!< Request latency, or WebSocket connection lifetime
+  uint16_t status;
+  RecordType type;
+  uint8_t method;           //!< Server::Method as a number
+  uint16_t urlSize;         //!< Full length, may be more than was stored
+  char url[ 82 ];           //!< Truncated, not null terminated
+
+  static constexpr size_t maxUrlSize{ sizeof( url ) };
+};
+static_assert( sizeof( Record ) == 128 );
+
+
+} // End of namespace accesslog
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_ACCESSLOG_H
@@ -0,0 +1,83 @@
+#ifndef LIB_LB_HTTPD_LOGGING_H
+#define LIB_LB_HTTPD_LOGGING_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <functional>
+#include <string_view>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace logging
+{
+
+
+enum class Level
+{
+  eDebug,
+  eInfo,
+  eWarning,
+  eError
+};
+
+const char* toString( Level );
+
+/** \brief Receives each log message, without a trailing newline. */
+using Logger = std::function< void( Level, std::string_view message ) >;
+
+/** \brief Replace the default logger, which writes to std::cerr.
+
+    The library never writes log messages from the thread that produced them.
+    Messages are queued in a fixed size lock-free ring buffer and the logger is
+    called from a single background thread, so a slow logger cannot stall the
+    HTTP or WebSocket threads. Should the buffer fill then further messages are
+    dropped, and counted, until there is space again.
+
+    Each log site is also rate limited to a handful of messages per second, the
+    number suppressed being appended to the next message from that site.
+
+    Pass an empty Logger to restore the default.
+ */
+void setLogger( Logger );
+
+/** \brief Messages below \a level are discarded at the log site. Default is eInfo. */
+void setLevel( Level level );
+
+Level level();
+
+/** \brief Block until all messages queued so far have been passed to the logger. */
+void flush();
+
+
+} // End of namespace logging
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_LOGGING_H
@@ -18,15 +18,21 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <lb/httpd/ws/ConnectionStats.h>
 #include <lb/httpd/ws/Handler.h>
+#include <lb/httpd/ws/Reactor.h>
 
 #include <microhttpd.h>
 
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 
 namespace lb
@@ -48,21 +54,6 @@ namespace httpd
 class Server
 {
 public:
-  struct Config
-  {
-    /** \brief The port on which the Server will listen for incoming connections.
-
-         As usual the valid port numbers are 1 through 65535.
-     */
-    int port{ -1 };
-
-    /** \brief The maximum number of bytes to read from the port's socket at a time.
-
-        Ultimately this is what is passed to recv(2).
-     */
-    size_t maxSocketBytesToReceive{ 1024 };
-  };
-
   enum class Method
   {
     eInvalid,
@@ -88,6 +79,365 @@ public:
     std::string content;
   };
 
+  struct Config
+  {
+    /** \brief The port on which the Server will listen for incoming connections.
+
+         As usual the valid port numbers are 1 through 65535.
+     */
+    int port{ -1 };
+
+    /** \brief The maximum number of bytes to read from the port's socket at a time.
+
+        Ultimately this is what is passed to recv(2).
+     */
+    size_t maxSocketBytesToReceive{ 1024 };
+
+    /** \brief How often the WebSocket loop samples each connection's TCP state.
+
+        Zero, the default, disables periodic sampling. See \a connectionStats.
+     */
+    std::chrono::milliseconds connectionStatsInterval{ 0 };
+
+    /** \brief URL path at which to serve \a stats() in Prometheus text format.
+
+        Empty, the default, disables this. Only GET requests are served, all
+        other requests for the path go to the request handler as usual.
+     */
+    std::string metricsPath;
+
+    /** \brief Time allowed for a single call into a ws::Receivers callback.
+
+        A call that takes longer holds up every other WebSocket connection so
+        is reported via \a slowReceiverCallback. Zero, the default, disables
+        the check. Receiver call times are recorded in \a stats() regardless.
+     */
+    std::chrono::microseconds receiverBudget{ 0 };
+
+    using SlowReceiverCallback = std::function< void( ws::ConnectionID
+                                                    , std::chrono::microseconds ) >;
+
+    /** \brief Called on the WebSocket loop thread with the connection and the
+               call duration when a receiver exceeds \a receiverBudget.
+
+        If not set then a warning is logged instead, see lb/httpd/Logging.h.
+     */
+    SlowReceiverCallback slowReceiverCallback;
+
+    /** \brief File to which to write the binary access log.
+
+        Empty, the default, disables access logging. See lb/httpd/AccessLog.h
+        for the format and servers/accessLogDecode for a reader.
+     */
+    std::string accessLogPath;
+
+    /** \brief Number of records the access log holds before wrapping. 128 bytes each. */
+    uint64_t accessLogCapacity{ 1u << 16 };
+
+    /** \brief Trace the stages of 1 in every \a traceSampleRate requests and
+               WebSocket messages. See \a traces().
+
+        Zero, the default, disables tracing.
+     */
+    unsigned int traceSampleRate{ 0 };
+
+    /** \brief How many of the most recent traces to keep. */
+    size_t traceBufferSize{ 1024 };
+
+    /** \brief Load shedding for HTTP requests.
+
+        When enabled the number of requests in flight, from headers received to
+        response sent, is limited. Requests over the limit are immediately
+        answered 503 Service Unavailable with a Retry-After header, so that the
+        server spends its time on requests it can complete in good time rather
+        than on ones whose clients will have given up.
+
+        The limit adapts, gradient style, to the observed request latency: it
+        grows while latency stays near its long term average and shrinks in
+        proportion as latency rises above that by more than \a tolerance.
+     */
+    struct AdmissionControl
+    {
+      bool enabled{ false };
+
+      size_t initialLimit{ 32 };
+      size_t minLimit{ 4 };
+      size_t maxLimit{ 1024 };
+
+      /** \brief Ratio of short to long term latency accepted before backing off. */
+      double tolerance{ 1.5 };
+
+      /** \brief Sent in the Retry-After header of rejected requests. */
+      std::chrono::seconds retryAfter{ 1 };
+
+      /** \brief URL paths, e.g. health checks, that are never rejected nor counted. */
+      std::vector<std::string> priorityPaths;
+    };
+    AdmissionControl admissionControl;
+
+    /** \brief Per client IP address limits.
+
+        Each client address gets a token bucket per kind of event, refilled at
+        the given rate up to the given burst. HTTP requests, WebSocket upgrades
+        included, over their rate are answered 429 Too Many Requests with a
+        Retry-After header. Upgrades are additionally limited by their own
+        bucket. A WebSocket receiving data messages faster than its client's
+        rate allows is closed with 1008 (policy violation).
+
+        A rate of zero means no limit. Clients connecting over a Unix socket
+        are never limited. IPv6 clients are keyed on their /64 prefix, the
+        smallest block normally assigned to one site.
+     */
+    struct RateLimit
+    {
+      double requestsPerSecond{ 0 };
+      double requestBurst{ 20 };
+
+      double upgradesPerSecond{ 0 };
+      double upgradeBurst{ 5 };
+
+      double messagesPerSecond{ 0 };
+      double messageBurst{ 100 };
+
+      /** \brief Sent in the Retry-After header of rejected requests. */
+      std::chrono::seconds retryAfter{ 1 };
+
+      /** \brief Maximum concurrent connections per client address, zero for no limit.
+
+          Enforced by MHD on accept, see MHD_OPTION_PER_IP_CONNECTION_LIMIT.
+          Upgraded WebSocket connections continue to count.
+       */
+      unsigned int connectionsPerAddress{ 0 };
+
+      /** \brief Most client addresses tracked at once, zero for no limit.
+
+          When full, the least recently seen of a few tracked addresses is
+          forgotten to make room, so it gets a full burst should it return.
+       */
+      size_t maxAddresses{ 65536 };
+    };
+    RateLimit rateLimit;
+
+    using PreBodyHook = std::function< std::optional<Response>( const std::string& // url
+                                                              , Method
+                                                              , const Headers&
+                                                              , std::optional<uint64_t> ) >; // Content-Length
+
+    /** \brief Called once the headers of a request have arrived but before
+               any of its body has been read.
+
+        Returning a Response, e.g. 413 Content Too Large for an upload that is
+        too big or 401 Unauthorized for one without credentials, sends it
+        straight away and the request handler is not called. A client that
+        sent "Expect: 100-continue" then never sends the body at all; for
+        others MHD closes the connection rather than read it. Returning empty
+        carries on as usual.
+
+        The Content-Length is empty if the header is missing or invalid, e.g.
+        for a chunked upload. Called on the server's thread so must not block.
+     */
+    PreBodyHook preBodyHook;
+
+    /** \brief Resource limits. Zero leaves a setting at libmicrohttpd's default. */
+    struct Tuning
+    {
+      /** \brief Maximum concurrent connections, see MHD_OPTION_CONNECTION_LIMIT. */
+      unsigned int connectionLimit{ 0 };
+
+      /** \brief Memory pool per connection for headers and buffers, in bytes.
+
+          See MHD_OPTION_CONNECTION_MEMORY_LIMIT. Requests whose headers do not
+          fit are rejected so raise this if clients send large cookies etc.
+       */
+      size_t connectionMemoryLimit{ 0 };
+
+      /** \brief Step by which the read buffer grows, see MHD_OPTION_CONNECTION_MEMORY_INCREMENT. */
+      size_t connectionMemoryIncrement{ 0 };
+
+      /** \brief Pending connection queue length passed to listen(2). */
+      unsigned int listenBacklog{ 0 };
+
+      /** \brief Idle time after which an HTTP connection is closed. Zero for never. */
+      std::chrono::seconds connectionTimeout{ 0 };
+
+      /** \brief Buffer size of the POST processor, which bounds a key or value chunk. */
+      size_t postProcessorBufferSize{ 32 * 1024 };
+
+      /** \brief How long to wait for the reply to our WebSocket close frame. */
+      std::chrono::milliseconds webSocketCloseTimeout{ 2000 };
+    };
+    Tuning tuning;
+
+    /** \brief Bind the port with SO_REUSEPORT.
+
+        Several Servers, in this process or others, may then listen on the same
+        port with the kernel spreading new connections between them. Each has
+        its own MHD thread and WebSocket loop so accepts, handshakes and
+        WebSocket traffic scale across cores without a shared accept queue.
+     */
+    bool reusePort{ false };
+
+    /** \brief With \a reusePort, steer each connection to the Server for the
+               CPU that received it.
+
+        Set to the number of Servers sharing the port, which must be created in
+        order so that the i th handles CPUs i, i + n, i + 2n etc. Pinning each
+        Server's threads to its CPUs is then up to the application. Zero, the
+        default, leaves the kernel to hash connections across the Servers.
+     */
+    unsigned int reusePortCpuShards{ 0 };
+
+    /** \brief An already bound and listening socket to use instead of \a port.
+
+        Typically inherited from a predecessor process, see
+        \a receiveListenSocket. The Server takes ownership of it.
+     */
+    MHD_socket listenSocket{ MHD_INVALID_SOCKET };
+
+    /** \brief Allow WebSocket connections to be migrated, see \a migrateWebSockets.
+
+        Each connection then keeps a copy of any partly received frame, and MHD
+        is run with MHD_USE_TURBO so that it does not shutdown(2) a socket we
+        have passed on when we let go of our end. HTTP only, not HTTPS.
+     */
+    bool webSocketMigration{ false };
+
+    /** \brief Listen on a Unix domain socket at this path instead of \a port.
+
+        For clients on the same host, e.g. a sidecar proxy, this skips the
+        TCP/IP stack. A path starting with '@' names a socket in the abstract
+        namespace, which needs no file. Otherwise any existing file is replaced
+        and is removed when the Server is destroyed. Per client address rate
+        limits do not apply to these connections.
+     */
+    std::string unixSocketPath;
+
+    /** \brief Start no threads of our own, see \a runOnce.
+
+        MHD is then run with MHD_USE_EPOLL rather than its internal polling
+        thread and the WebSocket loop is not given a thread either. The
+        application waits on \a eventFDs itself, for at most \a nextTimeout,
+        and calls \a runOnce from a single thread of its choosing. Cannot be
+        combined with a shared ws::Reactor.
+     */
+    bool externalEventLoop{ false };
+
+    /** \brief Threads for the Server's own ws::Reactor, when not given one.
+
+        By default a single thread, only started with the first WebSocket
+        connection and stopped again once they have all gone. Raising
+        maxThreads lets the Server use more cores under load, at the cost of
+        the ws::Handler's receivers for different connections being called
+        concurrently.
+     */
+    ws::Reactor::Scaling webSocketLoopScaling;
+  };
+
+  /** \brief A snapshot of the Server's metrics, see \a stats(). */
+  struct Stats
+  {
+    /** \brief A log-linear (HDR style) histogram with at most 12.5% bucket error. */
+    struct Histogram
+    {
+      uint64_t count{ 0 };
+      uint64_t sum{ 0 };
+
+      /** \brief Non-empty buckets as (inclusive upper bound, count), ascending. */
+      std::vector< std::pair< uint64_t, uint64_t > > buckets;
+
+      /** \brief Upper bound of the bucket containing the \a p th percentile. */
+      uint64_t percentile( double p ) const;
+    };
+
+    struct HttpRequests
+    {
+      Method method;
+      unsigned int statusClass; //!< 1 to 5 i.e. 1xx to 5xx
+      uint64_t count;
+    };
+    std::vector<HttpRequests> httpRequests; //!< Non-zero counts only
+
+    Histogram httpHandlerMicroseconds; //!< Time spent in the RequestHandler
+    Histogram httpRequestMicroseconds; //!< Headers received to response queued
+
+    unsigned int httpConnections{ 0 }; //!< Currently open, including upgraded
+
+    uint64_t httpRequestsShed{ 0 };    //!< Rejected by admission control
+    uint64_t httpConcurrencyLimit{ 0 }; //!< Current admission limit, zero if disabled
+    uint64_t httpRequestsInFlight{ 0 }; //!< Counted against the limit
+    uint64_t httpRequestsRateLimited{ 0 }; //!< Rejected by Config::rateLimit
+
+    uint64_t webSocketConnectionsOpened{ 0 };
+    int64_t  webSocketConnectionsActive{ 0 };
+
+    uint64_t webSocketFramesIn{ 0 };
+    uint64_t webSocketFramesOut{ 0 };
+    uint64_t webSocketBytesIn{ 0 };
+    uint64_t webSocketBytesOut{ 0 };
+    uint64_t webSocketMessagesIn{ 0 };
+    uint64_t webSocketMessagesOut{ 0 };
+
+    /** \brief Total unsent bytes across connections at the last stats sample.
+
+        Only updated when Config::connectionStatsInterval is non-zero.
+     */
+    int64_t webSocketSendQueueBytes{ 0 };
+
+    // WebSocket loop thread. Iteration time is from poll() returning to the
+    // start of the next poll(), so includes all receiver calls. Lag is how
+    // late the loop woke up after poll() timing out.
+    Histogram webSocketLoopIterationMicroseconds;
+    Histogram webSocketLoopLagMicroseconds;
+    Histogram webSocketLoopEventsPerWakeup; //!< Not a time, a count of ready sockets
+    Histogram webSocketReceiverMicroseconds; //!< Per ws::Receivers call
+    uint64_t webSocketSlowReceivers{ 0 }; //!< Calls exceeding Config::receiverBudget
+    uint64_t webSocketsRateLimited{ 0 };  //!< Closed for exceeding Config::rateLimit
+
+    /** \brief Count of WebSocket closes by reason.
+
+        Each connection is counted once, under the reason it was first closed
+        for, so one whose close handshake then times out stays under that.
+     */
+    std::vector< std::pair< std::string, uint64_t > > webSocketCloseReasons;
+  };
+
+  /** \brief Timestamps of the stages of one sampled request or message.
+
+      Only the stages actually reached are present, in order. For example a
+      request with no body has no eBodyComplete stage and a WebSocket message
+      has only the WebSocket stages.
+   */
+  struct Trace
+  {
+    enum class Stage
+    {
+      // HTTP
+      eAccepted,          //!< Connection accepted, earlier requests may have used it
+      eHeadersParsed,     //!< First call for the request with all headers
+      eBodyComplete,      //!< All POST data received and processed
+      eHandlerStart,
+      eHandlerEnd,
+      eResponseQueued,    //!< Handed to MHD
+      eResponseCompleted, //!< MHD has finished sending it
+
+      // WebSocket
+      eReceived,          //!< recv() returned the final bytes of the message
+      eDecoded,
+      eReceiverStart,
+      eReceiverEnd
+    };
+
+    static const char* toString( Stage );
+
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    bool webSocket{ false };
+    ws::ConnectionID connectionID{ 0 }; //!< WebSocket messages only
+    Method method{ Method::eInvalid };
+    std::string url;
+    std::vector< std::pair< Stage, TimePoint > > stages;
+  };
+
   using RequestHandler = std::function< Response( std::string, // url
                                                   Method,
                                                   Version,
@@ -100,6 +450,8 @@ public:
       \param config Server configuration, including the port number to listen on.
       \param rh A callback std::function for handling each URL request.
       \param wsh An optional std::function for handling WebSocket requests.
+      \param reactor Optional threads, shared with other Servers, to serve
+             WebSocket connections on. By default the Server starts its own.
       \throw std::runtime_error if the server could not be started or if no
              request handler was specified.
 
@@ -115,7 +467,8 @@ public:
    */
   Server( Config config
         , RequestHandler rh
-        , std::optional<ws::Handler> wsh = {} );
+        , std::optional<ws::Handler> wsh = {}
+        , std::shared_ptr<ws::Reactor> reactor = {} );
 
   /**
       \brief Constructor for HTTPS only. Starts the server.
@@ -124,6 +477,8 @@ public:
       \param httpsPrivateKey The contents of the server's private key.
       \param rh A callback std::function for handling each URL request.
       \param wsh An optional std::function for handling WebSocket requests.
+      \param reactor Optional threads, shared with other Servers, to serve
+             WebSocket connections on. By default the Server starts its own.
       \throw std::runtime_error if the server could not be started or if no
              request handler was specified.
 
@@ -141,13 +496,163 @@ public:
         , std::string httpsCert
         , std::string httpsPrivateKey
         , RequestHandler rh
-        , std::optional<ws::Handler> wsh = {} );
+        , std::optional<ws::Handler> wsh = {}
+        , std::shared_ptr<ws::Reactor> reactor = {} );
 
   /** \brief Destructor. Stops the server. */
   ~Server();
 
   Server( Server&& );
 
+  /**
+      \brief Sample the network state of a WebSocket connection now.
+      \return Empty if there is no such connection.
+
+      Safe to call from any thread.
+   */
+  std::optional<ws::ConnectionStats> sampleConnectionStats( ws::ConnectionID ) const;
+
+  /**
+      \brief The latest periodic sample of a WebSocket connection's network state.
+      \return Empty if there is no such connection or it has not been sampled
+              yet, e.g. because Config::connectionStatsInterval is zero.
+
+      Safe to call from any thread.
+   */
+  std::optional<ws::ConnectionStats> connectionStats( ws::ConnectionID ) const;
+
+  /**
+      \brief A snapshot of the Server's metrics.
+
+      Counters are kept per CPU and histograms in atomics so recording them
+      costs the Server no locking. Safe to call from any thread.
+   */
+  Stats stats() const;
+
+  /** \brief Format \a stats in the Prometheus text exposition format. */
+  static std::string formatPrometheus( const Stats& stats );
+
+  /**
+      \brief The most recent sampled traces, oldest first.
+
+      Empty unless Config::traceSampleRate is set. Safe to call from any thread.
+   */
+  std::vector<Trace> traces() const;
+
+  /**
+      \brief Pass the listening socket to a successor process and stop accepting.
+
+      Connects to the successor waiting in \a receiveListenSocket at
+      \a unixSocketPath and sends it the listening socket with SCM_RIGHTS.
+      Connections queued on the socket but not yet accepted are picked up by
+      the successor so none are refused. This Server carries on serving the
+      connections it already has, see \a drain.
+
+      \throw std::runtime_error on failure, including a successor not running
+             as our effective user and group. If the successor cannot be
+             reached this Server is left accepting as before.
+   */
+  void handOverListenSocket( const std::string& unixSocketPath );
+
+  /**
+      \brief Wait at \a unixSocketPath for a predecessor's \a handOverListenSocket.
+      \return The listening socket, for Config::listenSocket.
+      \throw std::runtime_error on failure or timeout, or if the predecessor is
+             not running as our effective user and group.
+
+      Anything already at \a unixSocketPath is replaced so keep it in a
+      directory only this user can write to, not somewhere shared like /tmp.
+   */
+  static MHD_socket receiveListenSocket( const std::string& unixSocketPath
+                                       , std::chrono::milliseconds timeout );
+
+  /**
+      \brief Wait for in-flight HTTP connections to finish.
+      \return True if they all finished within \a timeout.
+
+      WebSocket connections are not waited for. Those still open when the
+      Server is destroyed are closed with 1001 (going away). Idle keep-alive
+      connections are only closed by the client or by
+      Config::Tuning::connectionTimeout so set that for a prompt drain.
+      With Config::externalEventLoop this calls \a runOnce itself meanwhile.
+   */
+  bool drain( std::chrono::milliseconds timeout );
+
+  /**
+      \brief Hand the open WebSocket connections to a successor process.
+      \return The number migrated.
+      \throw std::runtime_error if Config::webSocketMigration is not set, this
+             is an HTTPS Server, or the successor cannot be reached or is not
+             running as our effective user and group.
+
+      Connects to the successor waiting in \a adoptWebSockets at
+      \a unixSocketPath and sends it, for each connection, its socket with
+      SCM_RIGHTS together with its connection ID, URL path, any partly
+      received message and any partly received frame. Bytes not yet read
+      from a socket simply stay in it for the successor. The connections are
+      then dropped here without a close frame, counted under the "migrated"
+      close reason, and their Senders fail from then on.
+
+      Connections that are closing, or that have a ws::StreamSender part way
+      through a message, stay here. The ws::Reactor loops, including those of
+      any other Servers sharing them, are held between polls meanwhile. Call
+      after \a handOverListenSocket so no new connections arrive meanwhile.
+   */
+  size_t migrateWebSockets( const std::string& unixSocketPath );
+
+  /**
+      \brief Take over the WebSocket connections of a predecessor's
+             \a migrateWebSockets.
+      \return The number adopted.
+      \throw std::runtime_error if there is no ws::Handler, or on failure or
+             timeout in accepting the predecessor's connection, or if the
+             predecessor is not running as our effective user and group.
+
+      Anything already at \a unixSocketPath is replaced so keep it in a
+      directory only this user can write to, not somewhere shared like /tmp.
+
+      Each connection is announced to the ws::Handler just as a new one is,
+      with the connection ID it had before. That is free as long as this
+      process got its listening socket from the same predecessor through
+      \a receiveListenSocket, which carries on the predecessor's numbering.
+      Otherwise a clashing connection is given a new ID.
+   */
+  size_t adoptWebSockets( const std::string& unixSocketPath
+                        , std::chrono::milliseconds timeout );
+
+  /**
+      \brief The file descriptors to wait on for readability in
+             Config::externalEventLoop mode.
+      \throw std::runtime_error if not in that mode.
+
+      MHD's epoll fd and, if there is a ws::Handler, the WebSocket poller's
+      epoll fd. Both are themselves epoll instances so may be added to the
+      application's own epoll set. They do not change for the life of the
+      Server.
+   */
+  std::vector<int> eventFDs() const;
+
+  /**
+      \brief The longest the application may wait on \a eventFDs before calling
+             \a runOnce in Config::externalEventLoop mode.
+      \throw std::runtime_error if not in that mode.
+
+      Changes as MHD's connection timeouts come and go, so fetch it each time
+      around the loop.
+   */
+  std::chrono::milliseconds nextTimeout() const;
+
+  /**
+      \brief Do whatever work is ready, without blocking, in
+             Config::externalEventLoop mode.
+      \throw std::runtime_error if not in that mode.
+
+      Runs MHD, so the request handler is called from here, then one pass of
+      the WebSocket loop, so ws::Handler receivers are too. Always call from
+      the same thread.
+   */
+  void runOnce();
+
 private:
   struct Private;
   std::unique_ptr<Private> d;
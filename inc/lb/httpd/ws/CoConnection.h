@@ -0,0 +1,145 @@
+#ifndef LIB_LB_HTTPD_WS_COCONNECTION_H
+#define LIB_LB_HTTPD_WS_COCONNECTION_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/ConnectionID.h>
+#include <lb/httpd/ws/Receivers.h>
+#include <lb/httpd/ws/Senders.h>
+
+#include <coroutine>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief A WebSocket connection as seen from a coroutine.
+
+    This is provided to you *by* the \a Handler as the argument of your
+    \a ConnectionTask coroutine. It is the coroutine alternative to the
+    \a Connection / \a Receivers callback pair: rather than registering
+    receivers you co_await \a receive() in a loop, and because the coroutine
+    frame lives as long as the connection any per-connection state can simply
+    be a local variable.
+
+    \code
+    lb::httpd::ws::Task echo( lb::httpd::ws::CoConnection conn )
+    {
+      while ( auto message = co_await conn.receive() )
+      {
+        co_await conn.send( message->payload );
+      }
+    }
+    \endcode
+
+    Received messages are queued in a pool of recycled slots so a coroutine
+    that is slower than the client does not lose messages and steady state
+    receiving does not allocate.
+ */
+class CoConnection
+{
+public:
+  struct Message
+  {
+    Receivers::DataOpCode opCode;
+    std::string payload;
+  };
+
+  struct Impl; //!< Opaque implementation detail.
+
+  /** \brief Awaitable returned by \a receive(). */
+  class ReceiveAwaitable
+  {
+  public:
+    explicit ReceiveAwaitable( Impl& impl ) : impl{ impl } {}
+
+    bool await_ready() const;
+    void await_suspend( std::coroutine_handle<> );
+    std::optional<Message> await_resume();
+
+  private:
+    Impl& impl;
+  };
+
+  /** \brief Awaitable returned by \a send(). Sends complete immediately. */
+  class SendAwaitable
+  {
+  public:
+    explicit SendAwaitable( SendResult result ) : result{ result } {}
+
+    bool await_ready() const noexcept { return true; }
+    void await_suspend( std::coroutine_handle<> ) const noexcept {}
+    SendResult await_resume() const noexcept { return result; }
+
+  private:
+    SendResult result;
+  };
+
+  ConnectionID id() const;
+  const std::string& url() const;
+
+  /** \brief The underlying \a Senders, e.g. for sending control frames. */
+  Senders& senders();
+
+  /**
+      \brief Suspend until the next complete data message arrives.
+      \return The message or, once the connection has been closed, an empty
+              optional. The coroutine should return at that point.
+
+      The coroutine is resumed on the WebSocket loop thread.
+   */
+  ReceiveAwaitable receive();
+
+  /**
+      \brief Send a text data message.
+      \param message The WebSocket frame payload.
+      \param maxFrameSize Maximum frame size. Zero implies unlimited.
+
+      See \a Senders::sendData. The send is performed immediately so the
+      coroutine does not actually suspend.
+   */
+  SendAwaitable send( std::string_view message, size_t maxFrameSize = 0 );
+
+private:
+  std::shared_ptr<Impl> d;
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_COCONNECTION_H
@@ -0,0 +1,78 @@
+#ifndef LIB_LB_HTTPD_WS_CONNECTIONSTATS_H
+#define LIB_LB_HTTPD_WS_CONNECTIONSTATS_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstddef>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief A sample of the network state of a WebSocket connection's socket.
+
+    Taken from TCP_INFO and SIOCOUTQ, see tcp(7). Useful for telling a slow
+    network apart from a slow server: a high round trip time, small congestion
+    window or climbing retransmit count point at the network whereas a growing
+    send queue on a healthy connection points at the client not reading.
+
+    For HTTPS servers libmicrohttpd hands us one end of a socket pair rather
+    than the TCP socket so only \a sendQueueBytes is available and
+    \a hasTcpInfo is false.
+ */
+struct ConnectionStats
+{
+  using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+
+  TimePoint sampleTime;
+
+  bool hasTcpInfo{ false };
+
+  std::chrono::microseconds roundTripTime{ 0 };         //!< Smoothed RTT
+  std::chrono::microseconds roundTripTimeVariance{ 0 };
+
+  unsigned int congestionWindow{ 0 };   //!< In segments
+  unsigned int sendMss{ 0 };            //!< Maximum segment size in bytes
+  size_t unackedBytes{ 0 };             //!< Unacknowledged segments times the MSS
+  unsigned int retransmits{ 0 };        //!< Total retransmitted segments
+  unsigned int lostSegments{ 0 };       //!< Segments currently considered lost
+
+  size_t sendQueueBytes{ 0 };           //!< Bytes written but not yet acknowledged or sent
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_CONNECTIONSTATS_H
@@ -21,9 +21,11 @@
 
 #include <memory>
 
+#include <lb/httpd/ws/CoConnection.h>
 #include <lb/httpd/ws/ConnectionID.h>
 #include <lb/httpd/ws/Receivers.h>
 #include <lb/httpd/ws/Senders.h>
+#include <lb/httpd/ws/Task.h>
 
 
 namespace lb
@@ -59,7 +61,15 @@ namespace ws
   called to provide you with a \a Connection object containing a \a Senders
   object with which you can send data on the connection. The return value of
   \a ConnectionEstablished is a \a Receivers object that you create so that
-  Handler can pass received data back to you.
+  Handler can pass received data back to you. Attach your per-connection state
+  to it with \a Receivers::withContext and it is handed back to you, along with
+  the \a Senders, on every receive.
+
+  Alternatively pass a \a ConnectionTask coroutine instead of
+  \a ConnectionEstablished. One coroutine is started per connection and it
+  services that connection through the \a CoConnection it is given, see
+  \a CoConnection for an example. Any per-connection state can then live in
+  the coroutine frame instead of in a lookup keyed on the \a ConnectionID.
 
   Once you are no longer able to handle requests, typically on destruction of
   your function objects, then you should call \a stopHandling to ensure they
@@ -78,8 +88,13 @@ struct Handler
   };
   using ConnectionEstablished = std::function< Receivers( Connection ) >;
 
+  using ConnectionTask = std::function< Task( CoConnection ) >;
+
   Handler( IsHandled, ConnectionEstablished );
 
+  /** \brief Construct a Handler that services each connection with a coroutine. */
+  Handler( IsHandled, ConnectionTask );
+
   Handler( Handler&& ) = default;
   Handler& operator=( Handler&& ) = default;
   Handler( const Handler& ) = default;
@@ -0,0 +1,84 @@
+#ifndef LIB_LB_HTTPD_WS_MESSAGE_H
+#define LIB_LB_HTTPD_WS_MESSAGE_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief An immutable, reference counted data message payload.
+
+    Intended for sending the same data to many connections, or to the same
+    connection repeatedly, via \a Senders::sendData. Copies of a Message share
+    the one payload buffer so, since sends write straight from that buffer to
+    the socket, the only allocation is the one made here on construction.
+
+    The encoded frame headers are also cached, per opcode and maximum frame
+    size, the first time the Message is sent with them. Only the first few
+    such combinations are cached, which covers the usual one or two.
+
+    Copies may be used concurrently from different threads.
+ */
+class Message
+{
+public:
+  /** \brief Create an empty message. */
+  Message() = default;
+
+  explicit Message( std::string payload );
+
+  Message( Message&& ) = default;
+  Message& operator=( Message&& ) = default;
+  Message( const Message& ) = default;
+  Message& operator=( const Message& ) = default;
+
+  std::string_view payload() const;
+
+  size_t size() const;
+
+  struct Impl; //!< Opaque implementation detail.
+
+private:
+  std::shared_ptr<const Impl> d;
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_MESSAGE_H
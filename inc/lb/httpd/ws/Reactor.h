@@ -0,0 +1,123 @@
+#ifndef LIB_LB_HTTPD_WS_REACTOR_H
+#define LIB_LB_HTTPD_WS_REACTOR_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief The threads that wait on WebSocket connections for incoming data.
+
+    Each Server with a ws::Handler has one of its own unless it is given one
+    to share. Several Servers, such as the HTTP and HTTPS Servers for the same
+    site, may share a Reactor so that their connections are served by the same
+    threads rather than one per Server.
+
+    With more than one thread each new connection is given to the thread
+    watching the fewest connections. A connection is only ever served by one
+    thread at a time so its messages are always delivered in order, but
+    different connections' receivers may be called concurrently.
+
+    The number of threads may be fixed or, see \a Scaling, vary with load.
+    An elastic Reactor starts threads as connections and measured loop
+    utilisation grow, stops them again as they fall and moves connections
+    between threads to keep them evenly loaded.
+
+    Servers keep the Reactor they are given alive for as long as they need it.
+ */
+class Reactor
+{
+public:
+  /** \brief Limits and triggers for an elastic Reactor. */
+  struct Scaling
+  {
+    /** \brief Threads kept running however quiet it is. With zero the first
+               thread is only started for the first connection.
+     */
+    unsigned int minThreads{ 0 };
+
+    unsigned int maxThreads{ 1 };
+
+    /** \brief Add a thread once they average more connections than this.
+               Zero to scale on utilisation alone.
+     */
+    size_t connectionsPerThread{ 0 };
+
+    /** \brief Add a thread once they average more than this fraction of the
+               time busy, rather than waiting for data.
+     */
+    double growUtilisation{ 0.75 };
+
+    /** \brief Stop a thread once the rest would average less than this. */
+    double shrinkUtilisation{ 0.25 };
+
+    /** \brief How often utilisation is measured and threads added, stopped
+               or rebalanced.
+     */
+    std::chrono::milliseconds interval{ 1000 };
+  };
+
+  /** \brief Start a fixed \a numThreads loop threads, at least one. */
+  explicit Reactor( unsigned int numThreads = 1 );
+
+  /** \brief An elastic Reactor, starting Scaling::minThreads threads.
+      \throw std::runtime_error if \a scaling is inconsistent.
+   */
+  explicit Reactor( Scaling scaling );
+
+  ~Reactor();
+
+  Reactor( const Reactor& ) = delete;
+  Reactor& operator=( const Reactor& ) = delete;
+
+  /** \brief The number of loop threads currently running. */
+  unsigned int numThreads() const;
+
+  struct Impl; //!< Opaque implementation detail.
+
+private:
+  explicit Reactor( std::unique_ptr<Impl> );
+
+  std::unique_ptr<Impl> d;
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_REACTOR_H
@@ -23,6 +23,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <type_traits>
 
 
 namespace lb
@@ -37,6 +38,9 @@ namespace ws
 {
 
 
+class Senders;
+
+
 /** \brief The means of receiving from the WebSocket.
 
     This is provided *to* the \a Handler via the return value of your
@@ -51,7 +55,14 @@ namespace ws
     are for your information only and do not need replied to as they will be
     handled for you appropriately. Indeed in the case of a connection close
     control frame you will not be able to send anything back as the \a Senders
-    will have been closed off to further sends.
+    will have been closed off to further sends. A connection dropped without a
+    close frame gets no \a receiveControl call at all, its \a Senders are
+    simply closed and the connection removed.
+
+    Optionally a per-connection context object can be attached, see
+    \a withContext. Your receivers are then handed that context and the
+    connection's \a Senders directly so there is no need to look either up by
+    \a ConnectionID.
  */
 class Receivers
 {
@@ -70,11 +81,68 @@ public:
   };
   using ControlReceiver = std::function< void( ConnectionID, ControlOpCode, std::string ) >;
 
+  using ContextDataReceiver    = std::function< void( void* context, Senders&, DataOpCode, std::string ) >;
+  using ContextControlReceiver = std::function< void( void* context, Senders&, ControlOpCode, std::string ) >;
+
   /** \brief Create an invalid object. Both receive methods will immediately return false. */
   Receivers() = default;
 
   Receivers( DataReceiver, ControlReceiver );
 
+  /**
+      \brief Create receivers that are passed an opaque per-connection context.
+      \param context Owned by the receivers and destroyed, using the deleter of
+                     the shared_ptr, once the connection has gone away.
+
+      Prefer the type safe \a withContext.
+   */
+  Receivers( std::shared_ptr<void> context, ContextDataReceiver, ContextControlReceiver = {} );
+
+  /**
+      \brief Create receivers that are passed a typed per-connection context.
+
+      Return this from your \a ConnectionEstablished callback, e.g.
+
+      \code
+      struct MyState { std::string url; };
+
+      return lb::httpd::ws::Receivers::withContext(
+        std::make_shared<MyState>( MyState{ connection.url } ),
+        []( MyState& state, lb::httpd::ws::Senders& senders,
+            lb::httpd::ws::Receivers::DataOpCode, std::string data )
+        {
+          senders.sendData( data, 0 );
+        } );
+      \endcode
+   */
+  template< typename Context >
+  static Receivers withContext( std::shared_ptr<Context> context
+                              , std::function< void( std::type_identity_t<Context>&, Senders&, DataOpCode, std::string ) > dr
+                              , std::function< void( std::type_identity_t<Context>&, Senders&, ControlOpCode, std::string ) > cr = {} )
+  {
+    ContextDataReceiver contextDataReceiver;
+    if ( dr )
+    {
+      contextDataReceiver = [dr = std::move( dr )]( void* c, Senders& s, DataOpCode o, std::string m )
+      {
+        dr( *static_cast<Context*>( c ), s, o, std::move( m ) );
+      };
+    }
+
+    ContextControlReceiver contextControlReceiver;
+    if ( cr )
+    {
+      contextControlReceiver = [cr = std::move( cr )]( void* c, Senders& s, ControlOpCode o, std::string m )
+      {
+        cr( *static_cast<Context*>( c ), s, o, std::move( m ) );
+      };
+    }
+
+    return { std::static_pointer_cast<void>( std::move( context ) )
+           , std::move( contextDataReceiver )
+           , std::move( contextControlReceiver ) };
+  }
+
   Receivers( Receivers&& ) = default;
   Receivers& operator=( Receivers&& ) = default;
   Receivers( const Receivers& ) = default;
@@ -87,7 +155,7 @@ public:
       Once \a stopReceiving() is called this becomes a no-op (which still
       returns true).
    */
-  bool receiveData( ConnectionID, DataOpCode, std::string );
+  bool receiveData( ConnectionID, DataOpCode, std::string, Senders& );
 
   /**
       \brief Server calls this to invoke the ControlReceiver.
@@ -96,7 +164,7 @@ public:
       Once \a stopReceiving() is called this becomes a no-op (which still
       returns true).
    */
-  bool receiveControl( ConnectionID, ControlOpCode, std::string );
+  bool receiveControl( ConnectionID, ControlOpCode, std::string, Senders& );
 
   /**
       \brief Call this to ensure your \a DataReceiver and/or \a ControlReceiver
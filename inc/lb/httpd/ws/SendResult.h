@@ -44,7 +44,16 @@ enum class SendResult
   eClosed,
 
   /** \brief The \a Senders object has been default constructed and not upgraded. */
-  eNoImplementation
+  eNoImplementation,
+
+  /** \brief Not sent as another thread has a \a StreamSender part way through
+             a message on this connection.
+
+      Only returned to a Receivers callback, which runs on a WebSocket loop
+      thread and so must not wait for the stream to finish. Other threads
+      wait instead. Try again later, e.g. from the thread that is streaming.
+   */
+  eBusy
 };
 
 
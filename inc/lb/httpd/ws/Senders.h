@@ -18,12 +18,19 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <lb/httpd/ws/Message.h>
+#include <lb/httpd/ws/Receivers.h>
 #include <lb/httpd/ws/SendResult.h>
+#include <lb/httpd/ws/StreamSender.h>
 
 #include <lb/encoding/websocket.h>
 
+#include <functional>
+#include <limits>
 #include <memory>
+#include <sys/types.h>
 #include <string>
+#include <string_view>
 
 
 namespace lb
@@ -53,15 +60,82 @@ public:
   Senders( const Senders& ) = default;
   Senders& operator=( const Senders& ) = default;
 
+  /**
+      \brief Pass as the \a maxFrameSize of any send method to fragment adaptively.
+
+      Each frame is then sized to what the socket can take without queueing
+      behind a backlog, based on the free space in its send buffer and its
+      congestion window. A message that fits goes out as a single frame, a
+      large one is fragmented so that it does not monopolise the connection and
+      control frames can be sent in between its frames.
+   */
+  static constexpr size_t adaptiveFrameSize{ std::numeric_limits<size_t>::max() };
+
   /**
       \brief Send text data to the WebSocket. Binary not yet supported.
-      \param message The WebSocket frame payload.
-      \param maxFrameSize Maximum frame size. Zero implies unlimited.
+      \param message The WebSocket frame payload. Borrowed for the duration of
+                     the call, it is written to the socket without copying.
+      \param maxFrameSize Maximum frame size. Zero implies unlimited, see also
+                          \a adaptiveFrameSize.
 
       If a frame's size exceeds \a maxFrameSize then the server will split the
       frame up into multiple frames and send a fragmented message.
    */
-  SendResult sendData( std::string message, size_t maxFrameSize );
+  SendResult sendData( std::string_view message, size_t maxFrameSize );
+
+  /**
+      \brief Send a shared, immutable message as text or binary data.
+      \param message Written to the socket straight from its shared buffer.
+      \param maxFrameSize Maximum frame size. Zero implies unlimited, see also
+                          \a adaptiveFrameSize.
+
+      Prefer this when sending the same data to many connections: the payload
+      is neither copied nor re-framed per send as the frame headers are cached
+      in \a message (other than when fragmenting adaptively).
+   */
+  SendResult sendData( const Message& message
+                     , size_t maxFrameSize
+                     , Receivers::DataOpCode = Receivers::DataOpCode::eText );
+
+  /**
+      \brief Start sending a data message whose content is supplied in chunks.
+      \param maxFrameSize Maximum frame size. Zero implies one frame per chunk.
+
+      See \a StreamSender. The returned object is invalid if this one is.
+   */
+  StreamSender openStream( size_t maxFrameSize
+                         , Receivers::DataOpCode = Receivers::DataOpCode::eText );
+
+  /**
+      \brief Producer of streamed message content for \a sendStream.
+
+      Fill in at most \a bufferSize bytes of \a buffer and return the number
+      written, zero at the end of the message or negative on error. It has the
+      same contract as read(2).
+   */
+  using Producer = std::function< ssize_t( char* buffer, size_t bufferSize ) >;
+
+  /** \brief Buffer size used by \a sendStream when \a maxFrameSize is zero or adaptive. */
+  static constexpr size_t defaultStreamBufferSize{ 64 * 1024 };
+
+  /**
+      \brief Send a data message pulled from \a producer until it is exhausted.
+      \param maxFrameSize Maximum frame size. Zero implies one frame per
+                          \a defaultStreamBufferSize bytes.
+
+      Only one frame's worth of data is held in memory at a time so this is
+      suitable for messages of any size. Blocks until the whole message has
+      been sent. If \a producer fails part way through then the connection
+      is closed with status 1011 (internal error), see \a StreamSender.
+   */
+  SendResult sendStream( const Producer& producer
+                       , size_t maxFrameSize
+                       , Receivers::DataOpCode = Receivers::DataOpCode::eText );
+
+  /** \brief As above but reading the message from \a fd until end of file. */
+  SendResult sendStream( int fd
+                       , size_t maxFrameSize
+                       , Receivers::DataOpCode = Receivers::DataOpCode::eText );
 
   /**
       \brief Send a close control frame with close code and optional reason.
@@ -69,17 +143,17 @@ public:
             automatically respond with a matching close frame. This method is
             intended for when the server wants to intiate the close.
    */
-  SendResult sendClose( encoding::websocket::closestatus::PayloadCode, std::string reason = {} );
+  SendResult sendClose( encoding::websocket::closestatus::PayloadCode, std::string_view reason = {} );
 
   /** \brief Send a ping control frame. */
-  SendResult sendPing( std::string payload ) const;
+  SendResult sendPing( std::string_view payload ) const;
 
   /**
       \brief Send a pong control frame.
       \note The server automatically sends a pong frame in response to a ping
             so generally this should not be needed.
    */
-  SendResult sendPong( std::string payload ) const;
+  SendResult sendPong( std::string_view payload ) const;
 
   struct Impl; //!< Opaque implementation detail.
 
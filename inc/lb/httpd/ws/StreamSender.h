@@ -0,0 +1,90 @@
+#ifndef LIB_LB_HTTPD_WS_STREAMSENDER_H
+#define LIB_LB_HTTPD_WS_STREAMSENDER_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/SendResult.h>
+
+#include <memory>
+#include <string_view>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief Sends a single data message incrementally, as a series of frames.
+
+    Obtained from \a Senders::openStream. Each \a send writes the chunk it is
+    given straight away as one or more non-final frames so only the chunk in
+    hand needs to be held in memory however large the message is. \a finish
+    writes the final frame.
+
+    From the first frame to the last the stream owns the connection's data
+    channel: data messages sent through the \a Senders from other threads wait
+    until the stream is finished, so they cannot be interleaved with it. The
+    exception is a Receivers callback, which runs on a WebSocket loop thread
+    that must not wait, and gets SendResult::eBusy instead. Sending a regular
+    data message from the thread that has a stream open fails. Control frames
+    are not held up, as permitted by RFC 6455.
+
+    If destroyed, or assigned to, after a chunk was sent but before \a finish
+    is called then the message cannot be completed and the connection is
+    closed with status 1011 (internal error). Sending a final frame instead
+    would have the peer take the truncated message for the whole.
+ */
+class StreamSender
+{
+public:
+  /** \brief Create an invalid object. All send methods will immediately return eNoImplementation. */
+  StreamSender();
+  StreamSender( StreamSender&& );
+  StreamSender& operator=( StreamSender&& );
+  ~StreamSender();
+
+  /** \brief Send the next part of the message. Empty chunks are ignored. */
+  SendResult send( std::string_view chunk );
+
+  /** \brief Send the last part of the message, possibly empty. */
+  SendResult finish( std::string_view lastChunk = {} );
+
+  struct Impl; //!< Opaque implementation detail.
+
+private:
+  std::unique_ptr<Impl> d;
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_STREAMSENDER_H
@@ -0,0 +1,126 @@
+#ifndef LIB_LB_HTTPD_WS_TASK_H
+#define LIB_LB_HTTPD_WS_TASK_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief The return type of a coroutine that services one WebSocket connection.
+
+    See \a Handler::ConnectionTask. The coroutine starts running immediately
+    and runs until its first suspension, typically the first
+    co_await CoConnection::receive(). From then on it is resumed on the
+    WebSocket loop thread whenever there is something for it to receive.
+
+    The coroutine frame is owned by this object and destroyed with it. The
+    \a Handler keeps hold of it until the connection is gone so you just need
+    to return it from your \a ConnectionTask function.
+ */
+class Task
+{
+public:
+  struct promise_type
+  {
+    Task get_return_object()
+    {
+      return Task{ std::coroutine_handle<promise_type>::from_promise( *this ) };
+    }
+
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+
+    void return_void() {}
+
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    std::exception_ptr exception;
+  };
+
+  /** \brief Create an invalid object that does not own a coroutine. */
+  Task() = default;
+
+  Task( Task&& other ) noexcept
+    : handle{ std::exchange( other.handle, {} ) }
+  {
+  }
+
+  Task& operator=( Task&& other ) noexcept
+  {
+    if ( this != &other )
+    {
+      reset();
+      handle = std::exchange( other.handle, {} );
+    }
+    return *this;
+  }
+
+  Task( const Task& ) = delete;
+  Task& operator=( const Task& ) = delete;
+
+  ~Task() { reset(); }
+
+  /** \brief True if the coroutine has run to completion (or never existed). */
+  bool done() const { return !handle || handle.done(); }
+
+  /** \brief The exception that escaped the coroutine body, if any. */
+  std::exception_ptr exception() const
+  {
+    return handle ? handle.promise().exception : std::exception_ptr{};
+  }
+
+private:
+  explicit Task( std::coroutine_handle<promise_type> h ) : handle{ h } {}
+
+  void reset()
+  {
+    if ( handle )
+    {
+      handle.destroy();
+      handle = {};
+    }
+  }
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_TASK_H
@@ -0,0 +1,165 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <lb/httpd/AccessLog.h>
+
+
+using namespace lb::httpd::accesslog;
+
+
+const char* methodName( uint8_t method )
+{
+  // Server::Method
+  static const char* names[]{ "INVALID", "GET", "HEAD", "POST", "PUT", "DELETE" };
+  return ( method < std::size( names ) ) ? names[ method ] : "UNKNOWN";
+}
+
+void printTimestamp( uint64_t nanoseconds )
+{
+  const time_t seconds( nanoseconds / 1000000000 );
+  tm utc{};
+  gmtime_r( &seconds, &utc );
+
+  char buffer[ 32 ];
+  strftime( buffer, sizeof( buffer ), "%Y-%m-%dT%H:%M:%S", &utc );
+  std::cout << buffer << '.' << std::setw( 6 ) << std::setfill( '0' )
+            << ( nanoseconds % 1000000000 ) / 1000 << std::setfill( ' ' ) << 'Z';
+}
+
+void printRecord( const Record& record )
+{
+  printTimestamp( record.timestamp );
+
+  switch ( record.type )
+  {
+  case RecordType::eHttpRequest:
+    std::cout << " http " << methodName( record.method ) << ' ' << record.status;
+    break;
+  case RecordType::eWebSocketOpen:
+    std::cout << " ws-open " << record.connectionID;
+    break;
+  case RecordType::eWebSocketClose:
+    std::cout << " ws-close " << record.connectionID << ' '
+              << ( ( record.status < std::size( closeReasonNames ) )
+                     ? closeReasonNames[ record.status ]
+                     : "unknown" );
+    break;
+  default:
+    std::cout << " type-" << int( record.type );
+    break;
+  }
+
+  const size_t urlSize{ std::min<size_t>( record.urlSize, Record::maxUrlSize ) };
+  std::cout << ' ' << record.microseconds << "us"
+            << " in=" << record.bytesIn
+            << " out=" << record.bytesOut
+            << ' ' << std::string( record.url, urlSize )
+            << ( ( record.urlSize > urlSize ) ? "..." : "" )
+            << '\n';
+}
+
+
+int main( int argc, char** argv )
+{
+  if ( argc != 2 )
+  {
+    std::cerr << "Usage: " << argv[0] << " <access log file>" << std::endl;
+    return 1;
+  }
+
+  const int fd{ open( argv[1], O_RDONLY ) };
+  if ( fd < 0 )
+  {
+    std::cerr << "Failed to open " << argv[1] << ": " << strerror( errno ) << std::endl;
+    return 1;
+  }
+
+  struct stat st{};
+  if ( ( fstat( fd, &st ) != 0 ) || ( size_t( st.st_size ) < sizeof( FileHeader ) ) )
+  {
+    std::cerr << argv[1] << " is not an access log" << std::endl;
+    return 1;
+  }
+
+  void*const map{ mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) };
+  if ( map == MAP_FAILED )
+  {
+    std::cerr << "Failed to map " << argv[1] << ": " << strerror( errno ) << std::endl;
+    return 1;
+  }
+
+  const FileHeader& header{ *static_cast<const FileHeader*>( map ) };
+  if ( ( header.magic != fileMagic )
+    || ( header.version != fileVersion )
+    || ( header.recordSize != sizeof( Record ) )
+    || ( header.capacity == 0 )
+    || ( size_t( st.st_size ) < sizeof( FileHeader ) + header.capacity * sizeof( Record ) ) )
+  {
+    std::cerr << argv[1] << " is not an access log of a supported version" << std::endl;
+    return 1;
+  }
+
+  const Record*const records{ reinterpret_cast<const Record*>( &header + 1 ) };
+
+  // The Server may still be writing so copy what has been written, then drop
+  // any record whose slot it may have started overwriting meanwhile.
+  const uint64_t numWritten
+  {
+    std::atomic_ref<uint64_t>( const_cast<uint64_t&>( header.numWritten ) )
+      .load( std::memory_order_acquire )
+  };
+  const uint64_t first{ ( numWritten > header.capacity ) ? numWritten - header.capacity : 0 };
+
+  std::vector<Record> copied;
+  copied.reserve( numWritten - first );
+  for ( uint64_t n = first; n < numWritten; ++n )
+  {
+    copied.push_back( records[ n % header.capacity ] );
+  }
+
+  std::atomic_thread_fence( std::memory_order_acquire );
+  const uint64_t numStarted
+  {
+    std::atomic_ref<uint64_t>( const_cast<uint64_t&>( header.numStarted ) )
+      .load( std::memory_order_relaxed )
+  };
+  const uint64_t firstIntact{ ( numStarted > header.capacity ) ? numStarted - header.capacity : 0 };
+
+  for ( uint64_t n = std::max( first, firstIntact ); n < numWritten; ++n )
+  {
+    printRecord( copied[ n - first ] );
+  }
+
+  munmap( map, st.st_size );
+  close( fd );
+
+  return 0;
+}
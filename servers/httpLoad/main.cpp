@@ -0,0 +1,462 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <netdb.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+
+// A closed loop load generator for the servers here, needing only the C++
+// library. Each connection sends a request, waits for the whole response and
+// records how long that took before sending the next.
+
+
+struct Options
+{
+  bool webSocket{ false };
+  std::string host{ "127.0.0.1" };
+  std::string port{ "2345" };
+  std::string unixSocketPath; //!< Used instead of host and port if set
+  std::string url{ "/" };
+  unsigned int numConnections{ 16 };
+  std::chrono::seconds duration{ 10 };
+  size_t messageSize{ 32 };
+};
+
+struct Result
+{
+  uint64_t numErrors{ 0 };
+  std::vector<uint32_t> microseconds; //!< One per completed request or echo
+};
+
+std::atomic<bool> running{ true };
+
+
+int connectUnix( const std::string& path )
+{
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if ( path.size() >= sizeof( address.sun_path ) )
+  {
+    return -1;
+  }
+  std::memcpy( address.sun_path, path.c_str(), path.size() );
+
+  socklen_t addressSize{ sizeof( address ) };
+  if ( path[0] == '@' )
+  {
+    // Abstract, as Server::Config::unixSocketPath.
+    address.sun_path[0] = '\0';
+    addressSize = offsetof( sockaddr_un, sun_path ) + path.size();
+  }
+
+  const int fd{ socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) };
+  if ( ( fd >= 0 ) && ( connect( fd, (const sockaddr*)&address, addressSize ) != 0 ) )
+  {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+int connectTo( const Options& options )
+{
+  if ( !options.unixSocketPath.empty() )
+  {
+    return connectUnix( options.unixSocketPath );
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo* addresses{ nullptr };
+  if ( getaddrinfo( options.host.c_str(), options.port.c_str(), &hints, &addresses ) != 0 )
+  {
+    return -1;
+  }
+
+  int fd{ -1 };
+  for ( addrinfo* a = addresses; a && ( fd < 0 ); a = a->ai_next )
+  {
+    fd = socket( a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol );
+    if ( ( fd >= 0 ) && ( connect( fd, a->ai_addr, a->ai_addrlen ) != 0 ) )
+    {
+      close( fd );
+      fd = -1;
+    }
+  }
+  freeaddrinfo( addresses );
+
+  return fd;
+}
+
+bool sendAll( int fd, std::string_view data )
+{
+  while ( !data.empty() )
+  {
+    const ssize_t n{ send( fd, data.data(), data.size(), MSG_NOSIGNAL ) };
+    if ( n <= 0 )
+    {
+      return false;
+    }
+    data.remove_prefix( n );
+  }
+  return true;
+}
+
+/** \brief Read until \a buffer holds at least \a size bytes. */
+bool receiveAtLeast( int fd, std::string& buffer, size_t size )
+{
+  char chunk[ 16 * 1024 ];
+  while ( buffer.size() < size )
+  {
+    const ssize_t n{ recv( fd, chunk, sizeof( chunk ), 0 ) };
+    if ( n <= 0 )
+    {
+      return false;
+    }
+    buffer.append( chunk, n );
+  }
+  return true;
+}
+
+/** \brief Read one HTTP response's header block, leaving anything after it in \a buffer.
+    \return The header block, empty on failure.
+ */
+std::string receiveHeaders( int fd, std::string& buffer )
+{
+  size_t end;
+  while ( ( end = buffer.find( "\r\n\r\n" ) ) == std::string::npos )
+  {
+    if ( !receiveAtLeast( fd, buffer, buffer.size() + 1 ) )
+    {
+      return {};
+    }
+  }
+
+  std::string headers{ buffer.substr( 0, end + 4 ) };
+  buffer.erase( 0, end + 4 );
+  return headers;
+}
+
+std::string lowerCase( std::string s )
+{
+  std::transform( s.begin(), s.end(), s.begin(), []( unsigned char c ){ return std::tolower( c ); } );
+  return s;
+}
+
+void runHttp( const Options& options, Result& result )
+{
+  const std::string request
+  {
+    "GET " + options.url + " HTTP/1.1\r\nHost: " + options.host + "\r\n\r\n"
+  };
+
+  int fd{ -1 };
+  std::string buffer;
+  while ( running )
+  {
+    if ( fd < 0 )
+    {
+      buffer.clear();
+      fd = connectTo( options );
+      if ( fd < 0 )
+      {
+        ++result.numErrors;
+        std::this_thread::sleep_for( std::chrono::milliseconds{ 10 } );
+        continue;
+      }
+    }
+
+    const auto start{ std::chrono::steady_clock::now() };
+
+    bool ok{ sendAll( fd, request ) };
+    std::string headers;
+    if ( ok )
+    {
+      headers = lowerCase( receiveHeaders( fd, buffer ) );
+      ok = !headers.empty();
+    }
+
+    size_t contentLength{ 0 };
+    if ( ok )
+    {
+      const size_t i{ headers.find( "\r\ncontent-length:" ) };
+      if ( i != std::string::npos )
+      {
+        contentLength = std::stoul( headers.substr( i + 17 ) );
+      }
+      ok = receiveAtLeast( fd, buffer, contentLength );
+    }
+
+    if ( !ok )
+    {
+      ++result.numErrors;
+      close( fd );
+      fd = -1;
+      continue;
+    }
+
+    buffer.erase( 0, contentLength );
+    result.microseconds.push_back(
+      std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count() );
+
+    if ( headers.find( "\r\nconnection: close" ) != std::string::npos )
+    {
+      close( fd );
+      fd = -1;
+    }
+  }
+
+  if ( fd >= 0 )
+  {
+    close( fd );
+  }
+}
+
+/** \brief A masked text frame carrying \a payload, as a client must send. */
+std::string encodeFrame( std::string_view payload )
+{
+  std::string frame{ char( 0x81 ) };
+  if ( payload.size() < 126 )
+  {
+    frame += char( 0x80 | payload.size() );
+  }
+  else if ( payload.size() <= UINT16_MAX )
+  {
+    frame += char( 0x80 | 126 );
+    frame += char( payload.size() >> 8 );
+    frame += char( payload.size() );
+  }
+  else
+  {
+    frame += char( 0x80 | 127 );
+    for ( int shift = 56; shift >= 0; shift -= 8 )
+    {
+      frame += char( uint64_t( payload.size() ) >> shift );
+    }
+  }
+
+  const char mask[4]{ 0x12, 0x34, 0x56, 0x78 };
+  frame.append( mask, 4 );
+  for ( size_t i = 0; i < payload.size(); ++i )
+  {
+    frame += char( payload[i] ^ mask[ i % 4 ] );
+  }
+  return frame;
+}
+
+/** \brief Read one unmasked frame from the server, leaving anything after it in \a buffer. */
+bool receiveFrame( int fd, std::string& buffer )
+{
+  if ( !receiveAtLeast( fd, buffer, 2 ) )
+  {
+    return false;
+  }
+
+  const uint8_t sizeCode( buffer[1] & 0x7f );
+  const size_t numSizeBytes{ sizeCode == 127 ? 8u : sizeCode == 126 ? 2u : 0u };
+  if ( !receiveAtLeast( fd, buffer, 2 + numSizeBytes ) )
+  {
+    return false;
+  }
+
+  uint64_t payloadSize{ sizeCode };
+  if ( numSizeBytes > 0 )
+  {
+    payloadSize = 0;
+    for ( size_t i = 0; i < numSizeBytes; ++i )
+    {
+      payloadSize = ( payloadSize << 8 ) | uint8_t( buffer[ 2 + i ] );
+    }
+  }
+
+  const size_t frameSize{ 2 + numSizeBytes + payloadSize };
+  if ( !receiveAtLeast( fd, buffer, frameSize ) )
+  {
+    return false;
+  }
+  buffer.erase( 0, frameSize );
+  return true;
+}
+
+void runWebSocket( const Options& options, Result& result )
+{
+  const int fd{ connectTo( options ) };
+  if ( fd < 0 )
+  {
+    ++result.numErrors;
+    return;
+  }
+
+  std::string buffer;
+  const bool upgraded
+  {
+    sendAll( fd, "GET " + options.url + " HTTP/1.1\r\n"
+                 "Host: " + options.host + "\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                 "Sec-WebSocket-Version: 13\r\n\r\n" )
+    && ( receiveHeaders( fd, buffer ).rfind( "HTTP/1.1 101", 0 ) == 0 )
+  };
+  if ( !upgraded )
+  {
+    ++result.numErrors;
+    close( fd );
+    return;
+  }
+
+  const std::string frame{ encodeFrame( std::string( options.messageSize, 'x' ) ) };
+  while ( running )
+  {
+    const auto start{ std::chrono::steady_clock::now() };
+    if ( !sendAll( fd, frame ) || !receiveFrame( fd, buffer ) )
+    {
+      ++result.numErrors;
+      break;
+    }
+    result.microseconds.push_back(
+      std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count() );
+  }
+
+  close( fd );
+}
+
+uint32_t percentile( std::vector<uint32_t>& sorted, double p )
+{
+  if ( sorted.empty() )
+  {
+    return 0;
+  }
+  return sorted[ std::min( sorted.size() - 1, size_t( p / 100.0 * sorted.size() ) ) ];
+}
+
+int usage( const char* name )
+{
+  std::cerr << "Usage: " << name << " [options] http|ws [host:port|unix socket path]\n"
+               "  -c <n>     Connections, default 16\n"
+               "  -d <s>     Duration in seconds, default 10\n"
+               "  -u <path>  URL path, default /\n"
+               "  -s <n>     WebSocket message size in bytes, default 32\n"
+               "The target defaults to 127.0.0.1:2345, wsEcho's default. A Unix\n"
+               "socket path contains a '/', or starts with '@' if abstract.\n";
+  return 1;
+}
+
+
+int main( int argc, char** argv )
+{
+  Options options;
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "c:d:u:s:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+    case 'c': options.numConnections = std::stoul( optarg ); break;
+    case 'd': options.duration = std::chrono::seconds{ std::stoul( optarg ) }; break;
+    case 'u': options.url = optarg; break;
+    case 's': options.messageSize = std::stoul( optarg ); break;
+    default: return usage( argv[0] );
+    }
+  }
+
+  if ( ( optind >= argc ) || ( argc - optind > 2 ) )
+  {
+    return usage( argv[0] );
+  }
+
+  const std::string mode{ argv[ optind ] };
+  if ( ( mode != "http" ) && ( mode != "ws" ) )
+  {
+    return usage( argv[0] );
+  }
+  options.webSocket = ( mode == "ws" );
+
+  if ( optind + 1 < argc )
+  {
+    const std::string target{ argv[ optind + 1 ] };
+    const size_t colon{ target.rfind( ':' ) };
+    if ( ( target[0] == '@' ) || ( target.find( '/' ) != std::string::npos ) )
+    {
+      options.unixSocketPath = target;
+      options.host = "localhost";
+    }
+    else if ( colon == std::string::npos )
+    {
+      return usage( argv[0] );
+    }
+    else
+    {
+      options.host = target.substr( 0, colon );
+      options.port = target.substr( colon + 1 );
+    }
+  }
+
+  std::vector<Result> results( options.numConnections );
+  std::vector<std::thread> threads;
+  for ( auto& result : results )
+  {
+    threads.emplace_back( options.webSocket ? runWebSocket : runHttp, std::cref( options ), std::ref( result ) );
+  }
+
+  std::this_thread::sleep_for( options.duration );
+  running = false;
+  for ( auto& thread : threads )
+  {
+    thread.join();
+  }
+
+  uint64_t numErrors{ 0 };
+  std::vector<uint32_t> microseconds;
+  for ( const auto& result : results )
+  {
+    numErrors += result.numErrors;
+    microseconds.insert( microseconds.end(), result.microseconds.begin(), result.microseconds.end() );
+  }
+  std::sort( microseconds.begin(), microseconds.end() );
+
+  const double seconds( options.duration.count() );
+  std::cout << mode << ' '
+            << ( options.unixSocketPath.empty() ? options.host + ':' + options.port : options.unixSocketPath )
+            << " c=" << options.numConnections
+            << std::fixed << std::setprecision( 0 )
+            << ' ' << ( microseconds.size() / seconds ) << "/s"
+            << " p50=" << percentile( microseconds, 50 ) << "us"
+            << " p99=" << percentile( microseconds, 99 ) << "us"
+            << " p99.9=" << percentile( microseconds, 99.9 ) << "us"
+            << " errors=" << numErrors
+            << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Runs httpLoad against wsEcho for each Server::Config::Tuning setting below
+# and prints a Markdown table of the results. Run from the top of the tree
+# after "make".
+#
+# Usage: servers/httpLoad/tuning.sh [connections] [seconds]
+
+CONNECTIONS=${1:-256}
+DURATION=${2:-10}
+PORT=2346
+
+echo "| wsEcho options | HTTP | WebSocket echo |"
+echo "|---|---|---|"
+
+while read -r OPTIONS
+do
+  LD_LIBRARY_PATH=. ./wsEcho -p $PORT $OPTIONS &
+  SERVER=$!
+  sleep 1
+
+  HTTP=$(./httpLoad -c "$CONNECTIONS" -d "$DURATION" http 127.0.0.1:$PORT | cut -d' ' -f4-)
+  WS=$(./httpLoad -c "$CONNECTIONS" -d "$DURATION" ws 127.0.0.1:$PORT | cut -d' ' -f4-)
+
+  kill $SERVER
+  wait $SERVER 2>/dev/null
+
+  echo "| ${OPTIONS:-(defaults)} | $HTTP | $WS |"
+done <<SETTINGS
+
+-l 64
+-m 8192
+-m 131072
+-m 131072 -i 16384
+-b 16
+-b 4096
+-t 5
+SETTINGS
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Compares wsEcho over 127.0.0.1 with wsEcho over a Unix socket, see
+# Server::Config::unixSocketPath: HTTP requests a second and WebSocket echo
+# round trip times, printed as a Markdown table. Run from the top of the tree
+# after "make".
+#
+# Usage: servers/httpLoad/unixVsTcp.sh [connections] [seconds]
+
+CONNECTIONS=${1:-16}
+DURATION=${2:-10}
+PORT=2346
+SOCKET=@lbhttpd-unixVsTcp
+
+echo "| Transport | HTTP | WebSocket echo |"
+echo "|---|---|---|"
+
+for TARGET in 127.0.0.1:$PORT $SOCKET
+do
+  case $TARGET in
+    @*) LD_LIBRARY_PATH=. ./wsEcho -U $TARGET & ;;
+    *)  LD_LIBRARY_PATH=. ./wsEcho -p $PORT & ;;
+  esac
+  SERVER=$!
+  sleep 1
+
+  HTTP=$(./httpLoad -c "$CONNECTIONS" -d "$DURATION" http $TARGET | cut -d' ' -f4-)
+  WS=$(./httpLoad -c "$CONNECTIONS" -d "$DURATION" ws $TARGET | cut -d' ' -f4-)
+
+  kill $SERVER
+  wait $SERVER 2>/dev/null
+
+  echo "| $TARGET | $HTTP | $WS |"
+done
@@ -18,13 +18,15 @@
 #include <atomic>
 #include <iostream>
 #include <csignal>
+#include <string>
+#include <unistd.h>
 
 #include <lb/httpd/Server.h>
 
 
 std::atomic<bool> running{ true };
 
-void signalHander( int s )
+void signalHander( int )
 {
   running = false;
 }
@@ -41,11 +43,11 @@ void installSignalHandlers()
            , NULL );
 }
 
-lb::httpd::Server::Response requestHandler( std::string url,
-                                            lb::httpd::Server::Method method,
-                                            lb::httpd::Server::Version version,
-                                            lb::httpd::Server::Headers headers,
-                                            std::string payload,
+lb::httpd::Server::Response requestHandler( std::string,
+                                            lb::httpd::Server::Method,
+                                            lb::httpd::Server::Version,
+                                            lb::httpd::Server::Headers,
+                                            std::string,
                                             lb::httpd::Server::PostKeyValues )
 {
   return { 404, "This is a websocket echo server only. Regular http ignored." };
@@ -55,13 +57,11 @@ lb::httpd::Server::Response requestHandler( std::string url,
 struct WSInfo
 {
   std::string url;
-  lb::httpd::ws::Senders dataSender;
 };
-using WSInfoLookup = std::unordered_map< lb::httpd::ws::ConnectionID, WSInfo >;
-WSInfoLookup wsInfoLookup;
 
 
-void dataReceiver( lb::httpd::ws::ConnectionID id
+void dataReceiver( WSInfo&
+                 , lb::httpd::ws::Senders& senders
                  , lb::httpd::ws::Receivers::DataOpCode dataOpCode
                  , std::string data )
 {
@@ -71,32 +71,21 @@ void dataReceiver( lb::httpd::ws::ConnectionID id
     return;
   }
 
-  const auto I{ wsInfoLookup.find( id ) };
-  if ( I != wsInfoLookup.end() )
+  const lb::httpd::ws::SendResult result{ senders.sendData( data, 0 ) };
+  switch ( result )
   {
-    WSInfo& wsInfo{ I->second };
-
-    const lb::httpd::ws::SendResult result{ wsInfo.dataSender.sendData( std::move( data ), 0 ) };
-    switch ( result )
-    {
-    case lb::httpd::ws::SendResult::eSuccess:
-      break;
-    default:
-      std::cerr << "Failed to send data frame!" << std::endl;
-      break;
-    }
-  }
-  else
-  {
-    // Can't send response as we have no DataSender.
-    std::cerr << "Unrecognised WebSocket connection ID" << std::endl;
+  case lb::httpd::ws::SendResult::eSuccess:
+    break;
+  default:
+    std::cerr << "Failed to send data frame!" << std::endl;
+    break;
   }
 }
 
 lb::httpd::ws::Receivers connectionEstablished( lb::httpd::ws::Handler::Connection connection )
 {
-  wsInfoLookup[ connection.id ] = { connection.url, connection.senders };
-  return { dataReceiver, {} };
+  return lb::httpd::ws::Receivers::withContext( std::make_shared<WSInfo>( WSInfo{ connection.url } )
+                                              , dataReceiver );
 }
 
 
@@ -104,11 +93,47 @@ lb::httpd::ws::Handler wsHandler( []( const std::string& ) { return true; }
                                 , connectionEstablished );
 
 
+int usage( const char* name )
+{
+  std::cerr << "Usage: " << name << " [options]\n"
+               "  -p <port>   Listen port, default 2345\n"
+               "  -U <path>   Listen on this Unix socket instead, abstract if it\n"
+               "              starts with '@'\n"
+               "Server::Config::Tuning, zero leaving libmicrohttpd's default:\n"
+               "  -l <n>      connectionLimit\n"
+               "  -m <bytes>  connectionMemoryLimit\n"
+               "  -i <bytes>  connectionMemoryIncrement\n"
+               "  -b <n>      listenBacklog\n"
+               "  -t <s>      connectionTimeout\n";
+  return 1;
+}
+
 int main( int argc, char** argv )
 {
   installSignalHandlers();
 
-  lb::httpd::Server server( { { 2345 } }
+  lb::httpd::Server::Config config;
+  config.port = 2345;
+
+  // So that servers/httpLoad can be run against each setting, and over a
+  // Unix socket.
+  int opt;
+  while ( ( opt = getopt( argc, argv, "p:U:l:m:i:b:t:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+    case 'p': config.port = std::stoi( optarg ); break;
+    case 'U': config.unixSocketPath = optarg; break;
+    case 'l': config.tuning.connectionLimit = std::stoul( optarg ); break;
+    case 'm': config.tuning.connectionMemoryLimit = std::stoul( optarg ); break;
+    case 'i': config.tuning.connectionMemoryIncrement = std::stoul( optarg ); break;
+    case 'b': config.tuning.listenBacklog = std::stoul( optarg ); break;
+    case 't': config.tuning.connectionTimeout = std::chrono::seconds{ std::stoul( optarg ) }; break;
+    default: return usage( argv[0] );
+    }
+  }
+
+  lb::httpd::Server server( config
                           , requestHandler
                           , wsHandler );
 
@@ -0,0 +1,195 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "AccessLogWriter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+AccessLogWriter::AccessLogWriter( const std::string& path, uint64_t capacity )
+{
+  if ( capacity == 0 )
+  {
+    throw std::runtime_error{ "Access log capacity needs to be greater than zero." };
+  }
+
+  fd = open( path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+  if ( fd < 0 )
+  {
+    throw std::runtime_error{ "Failed to open access log " + path };
+  }
+
+  mapSize = sizeof( accesslog::FileHeader ) + capacity * sizeof( accesslog::Record );
+
+  struct stat st{};
+  const bool sameSize{ ( fstat( fd, &st ) == 0 ) && ( size_t( st.st_size ) == mapSize ) };
+
+  if ( !sameSize && ( ftruncate( fd, mapSize ) != 0 ) )
+  {
+    close( fd );
+    throw std::runtime_error{ "Failed to size access log " + path };
+  }
+
+  map = mmap( nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if ( map == MAP_FAILED )
+  {
+    close( fd );
+    throw std::runtime_error{ "Failed to map access log " + path };
+  }
+
+  header = static_cast<accesslog::FileHeader*>( map );
+  records = reinterpret_cast<accesslog::Record*>( header + 1 );
+
+  const bool sameFormat
+  {
+    sameSize
+    && ( header->magic == accesslog::fileMagic )
+    && ( header->version == accesslog::fileVersion )
+    && ( header->recordSize == sizeof( accesslog::Record ) )
+    && ( header->capacity == capacity )
+  };
+  if ( !sameFormat )
+  {
+    memset( header, 0, sizeof( accesslog::FileHeader ) );
+    header->magic = accesslog::fileMagic;
+    header->version = accesslog::fileVersion;
+    header->recordSize = sizeof( accesslog::Record );
+    header->capacity = capacity;
+  }
+
+  thread = std::thread{ &AccessLogWriter::run, this };
+}
+
+AccessLogWriter::~AccessLogWriter()
+{
+  running = false;
+  thread.join();
+
+  munmap( map, mapSize );
+  close( fd );
+}
+
+void AccessLogWriter::write( accesslog::RecordType type
+                           , uint64_t connectionID
+                           , uint8_t method
+                           , uint16_t status
+                           , std::string_view url
+                           , uint64_t bytesIn
+                           , uint64_t bytesOut
+                           , uint64_t microseconds )
+{
+  const auto timestamp
+  {
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch() ).count()
+  };
+
+  const bool pushed
+  {
+    queue.push( [&]( accesslog::Record& record )
+                {
+                  record.timestamp = timestamp;
+                  record.connectionID = connectionID;
+                  record.bytesIn = bytesIn;
+                  record.bytesOut = bytesOut;
+                  record.microseconds = microseconds;
+                  record.status = status;
+                  record.type = type;
+                  record.method = method;
+                  record.urlSize = std::min<size_t>( url.size(), UINT16_MAX );
+                  const size_t n{ std::min( url.size(), accesslog::Record::maxUrlSize ) };
+                  memcpy( record.url, url.data(), n );
+                  memset( record.url + n, 0, accesslog::Record::maxUrlSize - n );
+                } )
+  };
+  if ( !pushed )
+  {
+    dropped.fetch_add( 1, std::memory_order_relaxed );
+  }
+}
+
+void AccessLogWriter::run()
+{
+  // Polling rather than waking on each record keeps write() free of system
+  // calls. The queue is sized for far more than one interval's worth, and the
+  // interval stretches while there is nothing to write.
+  std::chrono::milliseconds interval{ minInterval };
+  while ( running )
+  {
+    if ( drain() )
+    {
+      interval = minInterval;
+    }
+    else
+    {
+      std::this_thread::sleep_for( interval );
+      interval = std::min( interval * 2, maxInterval );
+    }
+  }
+
+  drain();
+}
+
+bool AccessLogWriter::drain()
+{
+  std::atomic_ref<uint64_t> numWritten{ header->numWritten };
+  std::atomic_ref<uint64_t> numStarted{ header->numStarted };
+  uint64_t n{ numWritten.load( std::memory_order_relaxed ) };
+  const uint64_t first{ n };
+
+  while ( queue.pop( [&]( const accesslog::Record& record )
+                     {
+                       // Readers of the mapping learn the slot's old record
+                       // may be torn before any of it is.
+                       numStarted.store( n + 1, std::memory_order_relaxed );
+                       std::atomic_thread_fence( std::memory_order_release );
+                       records[ n % header->capacity ] = record;
+                       ++n;
+                     } ) )
+  {
+  }
+
+  if ( n == first )
+  {
+    return false;
+  }
+
+  // Readers of the mapping see the count only once the records are in place.
+  numWritten.store( n, std::memory_order_release );
+  return true;
+}
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
@@ -0,0 +1,106 @@
+#ifndef LIB_LB_HTTPD_ACCESSLOGWRITER_H
+#define LIB_LB_HTTPD_ACCESSLOGWRITER_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/AccessLog.h>
+
+#include "MpscRing.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief Writes \a accesslog::Records to a memory mapped ring file.
+
+    \a write only copies the record into an in-memory queue so the HTTP and
+    WebSocket threads never make a system call or wait on the file. A
+    background thread moves queued records into the mapped file every few
+    milliseconds, backing off to \a maxInterval while idle, leaving the kernel
+    to write the pages back. If the queue is full the record is dropped and
+    counted.
+
+    An existing file of the same format and capacity is appended to, anything
+    else at \a path is overwritten.
+ */
+class AccessLogWriter
+{
+public:
+  /** \brief Throws a runtime error if the file cannot be created or mapped. */
+  AccessLogWriter( const std::string& path, uint64_t capacity );
+  ~AccessLogWriter();
+
+  AccessLogWriter( const AccessLogWriter& ) = delete;
+  AccessLogWriter& operator=( const AccessLogWriter& ) = delete;
+
+  /** \brief Queue a record, timestamped now. Thread safe and never blocks. */
+  void write( accesslog::RecordType type
+            , uint64_t connectionID
+            , uint8_t method
+            , uint16_t status
+            , std::string_view url
+            , uint64_t bytesIn
+            , uint64_t bytesOut
+            , uint64_t microseconds );
+
+  uint64_t numDropped() const { return dropped.load( std::memory_order_relaxed ); }
+
+private:
+  void run();
+  bool drain();
+
+  static constexpr std::chrono::milliseconds minInterval{ 5 };
+  static constexpr std::chrono::milliseconds maxInterval{ 40 };
+
+  // 100k records a second is 500 per 5 ms flush so there is plenty of slack,
+  // and 4000 arriving during the longest idle sleep still fit.
+  static constexpr size_t queueSize{ 8192 };
+
+  int fd{ -1 };
+  size_t mapSize{ 0 };
+  void* map{ nullptr };
+  accesslog::FileHeader* header{ nullptr };
+  accesslog::Record* records{ nullptr };
+
+  MpscRing<accesslog::Record, queueSize> queue;
+
+  std::atomic<uint64_t> dropped{ 0 };
+  std::atomic<bool> running{ true };
+  std::thread thread;
+};
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_ACCESSLOGWRITER_H
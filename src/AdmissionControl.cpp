@@ -0,0 +1,118 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "AdmissionControl.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+// Weights of the latest sample in the short and long term averages. The long
+// term one covers a few hundred requests.
+static constexpr double shortAlpha{ 0.2 };
+static constexpr double longAlpha{ 0.005 };
+
+// How far to move the limit towards each new estimate.
+static constexpr double smoothing{ 0.2 };
+
+
+AdmissionControl::AdmissionControl( const Server::Config::AdmissionControl& config )
+  : config{ config }
+  , priorityPaths{ config.priorityPaths.begin(), config.priorityPaths.end() }
+  , estimatedLimit( config.initialLimit )
+  , currentLimit{ config.initialLimit }
+{
+}
+
+bool AdmissionControl::isPriorityPath( const char* url ) const
+{
+  return !priorityPaths.empty() && ( priorityPaths.count( url ) > 0 );
+}
+
+bool AdmissionControl::tryAcquire()
+{
+  if ( numInFlight.load( std::memory_order_relaxed ) >= currentLimit.load( std::memory_order_relaxed ) )
+  {
+    return false;
+  }
+
+  numInFlight.fetch_add( 1, std::memory_order_relaxed );
+  return true;
+}
+
+void AdmissionControl::abandon()
+{
+  numInFlight.fetch_sub( 1, std::memory_order_relaxed );
+}
+
+void AdmissionControl::release( std::chrono::steady_clock::duration latency )
+{
+  const uint64_t inFlightBefore{ numInFlight.fetch_sub( 1, std::memory_order_relaxed ) };
+
+  const double sample
+  {
+    std::max( 1.0, double( std::chrono::duration_cast<std::chrono::microseconds>( latency ).count() ) )
+  };
+
+  if ( longLatency == 0 )
+  {
+    shortLatency = longLatency = sample;
+    return;
+  }
+
+  shortLatency += shortAlpha * ( sample - shortLatency );
+  longLatency  += longAlpha  * ( sample - longLatency );
+
+  // After a sustained rise the long term average lags well behind, decay it
+  // so that the limit can recover once the load has passed.
+  if ( longLatency / shortLatency > 2 )
+  {
+    longLatency *= 0.95;
+  }
+
+  const double gradient
+  {
+    std::clamp( config.tolerance * longLatency / shortLatency, 0.5, 1.0 )
+  };
+
+  // Application limited, no evidence that more concurrency would be fine.
+  if ( ( gradient >= 1.0 ) && ( inFlightBefore < estimatedLimit / 2 ) )
+  {
+    return;
+  }
+
+  const double newLimit{ estimatedLimit * gradient + std::sqrt( estimatedLimit ) };
+  estimatedLimit = std::clamp( estimatedLimit * ( 1 - smoothing ) + newLimit * smoothing
+                             , double( config.minLimit )
+                             , double( config.maxLimit ) );
+
+  currentLimit.store( uint64_t( estimatedLimit ), std::memory_order_relaxed );
+}
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
@@ -0,0 +1,95 @@
+#ifndef LIB_LB_HTTPD_ADMISSIONCONTROL_H
+#define LIB_LB_HTTPD_ADMISSIONCONTROL_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/Server.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief Adaptive concurrency limit for HTTP requests.
+
+    Implements a gradient limiter: a short and a long term exponentially
+    weighted average of request latency are kept and on each completed request
+
+      gradient = clamp( tolerance * long / short, 0.5, 1 )
+      limit    = limit * gradient + sqrt( limit )
+
+    smoothed and clamped to the configured bounds. So, while latency holds
+    steady, the limit creeps up by roughly its square root, allowing some
+    queueing, and as soon as latency rises it is cut back towards what the
+    server can actually sustain. The limit is not raised while under half of it
+    is in use as nothing has been learnt about higher concurrency.
+
+    \a tryAcquire, \a release and \a abandon are only called from the MHD thread.
+    The accessors may be called from any thread.
+ */
+class AdmissionControl
+{
+public:
+  explicit AdmissionControl( const Server::Config::AdmissionControl& );
+
+  bool enabled() const { return config.enabled; }
+
+  bool isPriorityPath( const char* url ) const;
+
+  /** \brief Count a request in if under the limit. */
+  bool tryAcquire();
+
+  /** \brief A request counted in has completed, taking \a latency. */
+  void release( std::chrono::steady_clock::duration latency );
+
+  /** \brief A request counted in went away without completing. */
+  void abandon();
+
+  uint64_t limit() const { return currentLimit.load( std::memory_order_relaxed ); }
+  uint64_t inFlight() const { return numInFlight.load( std::memory_order_relaxed ); }
+
+private:
+  const Server::Config::AdmissionControl config;
+  const std::unordered_set<std::string> priorityPaths;
+
+  double estimatedLimit;
+  double shortLatency{ 0 };
+  double longLatency{ 0 };
+
+  std::atomic<uint64_t> currentLimit;
+  std::atomic<uint64_t> numInFlight{ 0 };
+};
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_ADMISSIONCONTROL_H
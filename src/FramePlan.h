@@ -0,0 +1,130 @@
+#ifndef LIB_LB_HTTPD_FRAMEPLAN_H
+#define LIB_LB_HTTPD_FRAMEPLAN_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/encoding/websocket.h>
+
+#include <optional>
+#include <string_view>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief A frame header encoded ready to be written to the socket. */
+struct EncodedHeader
+{
+  /** \brief Largest possible encoded frame header: 2 + 8 byte length + 4 byte mask. */
+  static constexpr size_t maxSize{ 14 };
+
+  explicit EncodedHeader( const encoding::websocket::Header& header )
+    : size{ header.encodedSizeInBytes() }
+  {
+    header.encode( bytes );
+  }
+
+  EncodedHeader() = default;
+
+  std::string_view view() const { return { bytes, size }; }
+
+  char bytes[ maxSize ];
+  size_t size{ 0 };
+};
+
+
+/** \brief The encoded headers of the frames needed to send a data message.
+
+    A message of a given size split at a given maximum frame size always
+    produces the same sequence of frames: zero or more non-final frames of
+    identical size, the first of which carries the opcode and the rest of which
+    are continuations, followed by one final frame. Only three distinct headers
+    are therefore needed however many frames there are, which makes the plan
+    cheap to cache, see \a ws::Message.
+ */
+struct FramePlan
+{
+  /**
+      \brief Plan the frames for a message.
+      \return Empty if \a maxFrameSize is non-zero but too small to hold even
+              the frame header.
+   */
+  static std::optional<FramePlan> create( encoding::websocket::Header::OpCode opCode
+                                        , size_t payloadSize
+                                        , size_t maxFrameSize )
+  {
+    const auto encodedHeaderSize
+    {
+      encoding::websocket::Header::encodedSizeInBytes( payloadSize, false )
+    };
+    if ( ( maxFrameSize != 0 ) && ( maxFrameSize <= encodedHeaderSize ) )
+    {
+      return {};
+    }
+
+    FramePlan plan;
+    plan.payloadSize = payloadSize;
+
+    // Note that the server never masks the payload, only the client does.
+    encoding::websocket::Header header;
+    header.opCode = opCode;
+
+    if ( ( maxFrameSize > 0 ) && ( payloadSize + encodedHeaderSize > maxFrameSize ) )
+    {
+      // The header size for the whole payload is used throughout which is
+      // conservative as the fragments' headers may well be smaller.
+      plan.fragmentPayloadSize = maxFrameSize - encodedHeaderSize;
+      plan.numFragments = ( payloadSize - 1 ) / plan.fragmentPayloadSize;
+
+      header.payloadSize = plan.fragmentPayloadSize;
+      plan.first = EncodedHeader{ header };
+
+      header.opCode = encoding::websocket::Header::OpCode::eContinuation;
+      plan.middle = EncodedHeader{ header };
+    }
+
+    // Final (maybe only) frame i.e. "fin"
+    header.fin = true;
+    header.payloadSize = payloadSize - plan.numFragments * plan.fragmentPayloadSize;
+    plan.last = EncodedHeader{ header };
+
+    return plan;
+  }
+
+  size_t payloadSize{ 0 };
+  size_t fragmentPayloadSize{ 0 }; //!< Payload bytes in each non-final frame.
+  size_t numFragments{ 0 };        //!< Number of non-final frames.
+
+  EncodedHeader first;  //!< Header of the first non-final frame, if any.
+  EncodedHeader middle; //!< Header of subsequent non-final frames, if any.
+  EncodedHeader last;   //!< Header of the final frame.
+};
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_FRAMEPLAN_H
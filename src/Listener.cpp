@@ -0,0 +1,409 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Listener.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <linux/filter.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace listener
+{
+
+
+static
+std::runtime_error systemError( const std::string& what )
+{
+  return std::runtime_error{ what + ": " + std::strerror( errno ) };
+}
+
+static
+sockaddr_un unixAddress( const std::string& path )
+{
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if ( path.size() >= sizeof( address.sun_path ) )
+  {
+    throw std::runtime_error{ "Unix socket path too long: " + path };
+  }
+  std::memcpy( address.sun_path, path.c_str(), path.size() );
+  return address;
+}
+
+static
+bool isAbstract( const std::string& path )
+{
+  return !path.empty() && ( path[0] == '@' );
+}
+
+/** \brief Wait for \a fd to become readable. */
+static
+void awaitReadable( int fd, std::chrono::milliseconds timeout, const char* what )
+{
+  pollfd pfd{ fd, POLLIN, 0 };
+  const int n{ poll( &pfd, 1, static_cast<int>( timeout.count() ) ) };
+  if ( n < 0 )
+  {
+    throw systemError( what );
+  }
+  if ( n == 0 )
+  {
+    throw std::runtime_error{ std::string{ what } + ": timed out" };
+  }
+}
+
+/** \brief Throw unless the other end of \a fd runs as our user and group.
+
+    Anyone able to reach the path could otherwise hand us connections, or take
+    ours.
+ */
+static
+void checkPeer( int fd, const std::string& path )
+{
+  ucred peer{};
+  socklen_t peerSize{ sizeof( peer ) };
+  if ( getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerSize ) != 0 )
+  {
+    throw systemError( "Failed to get peer credentials at " + path );
+  }
+
+  if ( ( peer.uid != geteuid() ) || ( peer.gid != getegid() ) )
+  {
+    throw std::runtime_error{ "Rejected peer at " + path + " running as uid "
+                              + std::to_string( peer.uid ) + " gid "
+                              + std::to_string( peer.gid ) };
+  }
+}
+
+
+void attachCpuSteering( MHD_socket socket, unsigned int numShards )
+{
+  sock_filter code[]
+  {
+    // A = current CPU
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<__u32>( SKF_AD_OFF + SKF_AD_CPU ) },
+    // A = A % numShards
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, numShards },
+    // Return A as the index into the reuseport group
+    { BPF_RET | BPF_A, 0, 0, 0 }
+  };
+
+  sock_fprog program
+  {
+    static_cast<unsigned short>( std::size( code ) ),
+    code
+  };
+
+  if ( setsockopt( socket
+                 , SOL_SOCKET
+                 , SO_ATTACH_REUSEPORT_CBPF
+                 , &program
+                 , sizeof( program ) ) != 0 )
+  {
+    throw systemError( "Failed to attach reuseport CPU steering" );
+  }
+}
+
+int connectUnix( const std::string& path )
+{
+  const sockaddr_un address{ unixAddress( path ) };
+
+  const int fd{ socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) };
+  if ( fd < 0 )
+  {
+    throw systemError( "Failed to create Unix socket" );
+  }
+
+  if ( connect( fd, (const sockaddr*)&address, sizeof( address ) ) != 0 )
+  {
+    const auto error{ systemError( "Failed to connect to " + path ) };
+    close( fd );
+    throw error;
+  }
+
+  try
+  {
+    checkPeer( fd, path );
+  }
+  catch ( ... )
+  {
+    close( fd );
+    throw;
+  }
+
+  return fd;
+}
+
+MHD_socket listenUnix( const std::string& path, unsigned int backlog )
+{
+  sockaddr_un address{ unixAddress( path ) };
+  socklen_t addressSize{ sizeof( address ) };
+  if ( isAbstract( path ) )
+  {
+    // Abstract names start with a nul and are exactly as long as given.
+    address.sun_path[0] = '\0';
+    addressSize = offsetof( sockaddr_un, sun_path ) + path.size();
+  }
+  else
+  {
+    unlink( path.c_str() );
+  }
+
+  const int fd{ socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0 ) };
+  if ( fd < 0 )
+  {
+    throw systemError( "Failed to create Unix socket" );
+  }
+
+  if ( ( bind( fd, (const sockaddr*)&address, addressSize ) != 0 )
+    || ( listen( fd, ( backlog > 0 ) ? static_cast<int>( backlog ) : SOMAXCONN ) != 0 ) )
+  {
+    const auto error{ systemError( "Failed to listen at " + path ) };
+    close( fd );
+    throw error;
+  }
+
+  return fd;
+}
+
+int acceptUnix( const std::string& path, std::chrono::milliseconds timeout )
+{
+  const sockaddr_un address{ unixAddress( path ) };
+
+  const int listener{ socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) };
+  if ( listener < 0 )
+  {
+    throw systemError( "Failed to create Unix socket" );
+  }
+
+  try
+  {
+    unlink( path.c_str() );
+    if ( ( bind( listener, (const sockaddr*)&address, sizeof( address ) ) != 0 )
+      || ( listen( listener, 1 ) != 0 ) )
+    {
+      throw systemError( "Failed to listen at " + path );
+    }
+
+    awaitReadable( listener, timeout, "Failed to accept on Unix socket" );
+    const int channel{ accept4( listener, nullptr, nullptr, SOCK_CLOEXEC ) };
+    if ( channel < 0 )
+    {
+      throw systemError( "Failed to accept on Unix socket" );
+    }
+
+    close( listener );
+    unlink( path.c_str() );
+
+    try
+    {
+      checkPeer( channel, path );
+    }
+    catch ( ... )
+    {
+      close( channel );
+      throw;
+    }
+
+    return channel;
+  }
+  catch ( ... )
+  {
+    close( listener );
+    unlink( path.c_str() );
+    throw;
+  }
+}
+
+// Each socket goes as a 32 bit length then that many bytes of data, the
+// descriptor riding on the first byte of the length.
+
+void sendSocket( int channel, MHD_socket socket, std::string_view data )
+{
+  const uint32_t size{ static_cast<uint32_t>( data.size() ) };
+
+  iovec iov[2]
+  {
+    { (void*)&size, sizeof( size ) },
+    { (void*)data.data(), data.size() }
+  };
+
+  alignas( cmsghdr ) char control[ CMSG_SPACE( sizeof( int ) ) ]{};
+
+  msghdr msg{};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = data.empty() ? 1 : 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof( control );
+
+  cmsghdr*const cmsg{ CMSG_FIRSTHDR( &msg ) };
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+  std::memcpy( CMSG_DATA( cmsg ), &socket, sizeof( int ) );
+
+  ssize_t numSent{ sendmsg( channel, &msg, MSG_NOSIGNAL ) };
+  if ( numSent < 0 )
+  {
+    throw systemError( "Failed to send socket" );
+  }
+
+  // The rest, if the channel's buffer filled up, goes without the descriptor.
+  size_t offset{ static_cast<size_t>( numSent ) };
+  const size_t total{ sizeof( size ) + data.size() };
+  while ( offset < total )
+  {
+    const char* p;
+    size_t n;
+    if ( offset < sizeof( size ) )
+    {
+      p = reinterpret_cast<const char*>( &size ) + offset;
+      n = sizeof( size ) - offset;
+    }
+    else
+    {
+      p = data.data() + ( offset - sizeof( size ) );
+      n = total - offset;
+    }
+
+    numSent = send( channel, p, n, MSG_NOSIGNAL );
+    if ( numSent < 0 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      throw systemError( "Failed to send socket data" );
+    }
+    offset += numSent;
+  }
+}
+
+/** \brief Read exactly \a size bytes. False if the channel closed first. */
+static
+bool receiveAll( int channel, char* p, size_t size, std::chrono::milliseconds timeout )
+{
+  while ( size > 0 )
+  {
+    awaitReadable( channel, timeout, "Failed to receive socket data" );
+    const ssize_t n{ recv( channel, p, size, 0 ) };
+    if ( n < 0 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      throw systemError( "Failed to receive socket data" );
+    }
+    if ( n == 0 )
+    {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+std::optional<ReceivedSocket> receiveSocket( int channel, std::chrono::milliseconds timeout )
+{
+  uint32_t size;
+
+  iovec iov{ &size, sizeof( size ) };
+
+  alignas( cmsghdr ) char control[ CMSG_SPACE( sizeof( int ) ) ]{};
+
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof( control );
+
+  awaitReadable( channel, timeout, "Failed to receive socket" );
+  const ssize_t n{ recvmsg( channel, &msg, MSG_CMSG_CLOEXEC ) };
+  if ( n < 0 )
+  {
+    throw systemError( "Failed to receive socket" );
+  }
+  if ( n == 0 )
+  {
+    return std::nullopt;
+  }
+
+  const cmsghdr*const cmsg{ CMSG_FIRSTHDR( &msg ) };
+  if ( !cmsg
+    || ( cmsg->cmsg_level != SOL_SOCKET )
+    || ( cmsg->cmsg_type != SCM_RIGHTS )
+    || ( cmsg->cmsg_len != CMSG_LEN( sizeof( int ) ) ) )
+  {
+    throw std::runtime_error{ "No socket received" };
+  }
+
+  ReceivedSocket result;
+  std::memcpy( &result.socket, CMSG_DATA( cmsg ), sizeof( int ) );
+
+  try
+  {
+    if ( !receiveAll( channel
+                    , reinterpret_cast<char*>( &size ) + n
+                    , sizeof( size ) - n
+                    , timeout ) )
+    {
+      throw std::runtime_error{ "Socket data truncated" };
+    }
+
+    result.data.resize( size );
+    if ( !receiveAll( channel, result.data.data(), size, timeout ) )
+    {
+      throw std::runtime_error{ "Socket data truncated" };
+    }
+  }
+  catch ( ... )
+  {
+    close( result.socket );
+    throw;
+  }
+
+  return result;
+}
+
+
+} // End of namespace listener
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
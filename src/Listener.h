@@ -0,0 +1,111 @@
+#ifndef LIB_LB_HTTPD_LISTENER_H
+#define LIB_LB_HTTPD_LISTENER_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <microhttpd.h>
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief Helpers for the listening sockets handed to, or taken from, MHD. */
+namespace listener
+{
+
+
+/** \brief Steer new connections in \a socket's SO_REUSEPORT group by CPU.
+
+    Attaches a classic BPF program that picks socket number
+    ( CPU that received the connection ) % \a numShards of the group, where
+    sockets are numbered in the order they were bound. A connection therefore
+    lands on the shard local to the CPU handling its interrupts, provided the
+    shards are bound in CPU order and their threads kept on those CPUs. If a
+    shard is missing the kernel falls back to hashing.
+
+    Only one socket of the group needs it.
+    \throw std::runtime_error if the kernel refuses the program.
+ */
+void attachCpuSteering( MHD_socket socket, unsigned int numShards );
+
+/** \brief Connect to the Unix socket at \a path, for \a sendSocket.
+    \throw std::runtime_error on failure or if the listener is not running as
+           our effective user and group.
+ */
+int connectUnix( const std::string& path );
+
+/** \brief A listening Unix socket at \a path, abstract if that starts with '@'.
+
+    Any existing file at \a path is replaced.
+    \throw std::runtime_error on failure.
+ */
+MHD_socket listenUnix( const std::string& path, unsigned int backlog );
+
+/** \brief Listen at \a path and accept one connection, for \a receiveSocket.
+
+    Any existing file at \a path is replaced, and removed again once the
+    connection is accepted, so \a path must be in a directory only we can
+    write to.
+    \throw std::runtime_error on failure, if no one connects within \a timeout
+           or if the one who does is not running as our effective user and
+           group.
+ */
+int acceptUnix( const std::string& path, std::chrono::milliseconds timeout );
+
+/** \brief Pass \a socket, along with \a data, over the connected Unix socket
+           \a channel with SCM_RIGHTS.
+
+    The receiver gets its own descriptor for the same socket so the caller
+    still needs to close \a socket.
+    \throw std::runtime_error on failure.
+ */
+void sendSocket( int channel, MHD_socket socket, std::string_view data = {} );
+
+struct ReceivedSocket
+{
+  MHD_socket socket;
+  std::string data;
+};
+
+/** \brief Receive the next socket and data sent with \a sendSocket.
+    \return Empty once the sender has closed \a channel.
+    \throw std::runtime_error on failure or if \a timeout passes between reads.
+ */
+std::optional<ReceivedSocket> receiveSocket( int channel, std::chrono::milliseconds timeout );
+
+
+} // End of namespace listener
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_LISTENER_H
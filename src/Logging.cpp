@@ -0,0 +1,270 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "LoggingImpl.h"
+#include "MpscRing.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <time.h>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace logging
+{
+
+
+/** \brief One queued log message. */
+struct Entry
+{
+  static constexpr size_t maxMessageSize{ 480 };
+
+  Level level;
+  size_t size;
+  char text[ maxMessageSize ];
+};
+
+
+/** \brief Owns the ring and the background thread that drains it. */
+class AsyncLogger
+{
+public:
+  static AsyncLogger& instance()
+  {
+    static AsyncLogger asyncLogger;
+    return asyncLogger;
+  }
+
+  ~AsyncLogger()
+  {
+    running = false;
+    wake();
+    thread.join();
+  }
+
+  void write( Level level, std::string_view message )
+  {
+    const bool pushed
+    {
+      ring.push( [&]( Entry& entry )
+                 {
+                   // Truncated rather than allocating.
+                   entry.level = level;
+                   entry.size = std::min( message.size(), Entry::maxMessageSize );
+                   memcpy( entry.text, message.data(), entry.size );
+                 } )
+    };
+    if ( pushed )
+    {
+      wake();
+    }
+    else
+    {
+      numDropped.fetch_add( 1, std::memory_order_relaxed );
+    }
+  }
+
+  void setLogger( Logger l )
+  {
+    std::scoped_lock lock{ loggerMutex };
+    logger = std::move( l );
+  }
+
+  void flush()
+  {
+    const uint64_t target{ numPublished.load( std::memory_order_acquire ) };
+    uint64_t done{ numDrained.load( std::memory_order_acquire ) };
+    while ( done < target )
+    {
+      numDrained.wait( done, std::memory_order_acquire );
+      done = numDrained.load( std::memory_order_acquire );
+    }
+  }
+
+private:
+  AsyncLogger()
+    : thread{ &AsyncLogger::run, this }
+  {
+  }
+
+  void wake()
+  {
+    numPublished.fetch_add( 1, std::memory_order_release );
+    numPublished.notify_one();
+  }
+
+  void run()
+  {
+    while ( true )
+    {
+      const uint64_t seen{ numPublished.load( std::memory_order_acquire ) };
+
+      drain();
+
+      numDrained.store( seen, std::memory_order_release );
+      numDrained.notify_all();
+
+      if ( !running )
+      {
+        break;
+      }
+
+      numPublished.wait( seen, std::memory_order_acquire );
+    }
+  }
+
+  void drain()
+  {
+    std::scoped_lock lock{ loggerMutex };
+
+    while ( ring.pop( [this]( const Entry& entry )
+                      {
+                        deliver( entry.level, std::string_view{ entry.text, entry.size } );
+                      } ) )
+    {
+    }
+
+    const uint64_t dropped{ numDropped.exchange( 0, std::memory_order_relaxed ) };
+    if ( dropped > 0 )
+    {
+      deliver( Level::eWarning
+             , std::to_string( dropped ) + " log messages dropped, buffer full" );
+    }
+  }
+
+  void deliver( Level level, std::string_view message )
+  {
+    if ( logger )
+    {
+      logger( level, message );
+    }
+    else
+    {
+      // One write per message and no flush, std::cerr is unbuffered anyway.
+      std::string line{ toString( level ) };
+      line += ": ";
+      line += message;
+      line += '\n';
+      std::cerr.write( line.data(), line.size() );
+    }
+  }
+
+  MpscRing<Entry, 256> ring;
+
+  std::atomic<uint64_t> numPublished{ 0 };
+  std::atomic<uint64_t> numDrained{ 0 };
+  std::atomic<uint64_t> numDropped{ 0 };
+  std::atomic<bool> running{ true };
+
+  std::mutex loggerMutex;
+  Logger logger;
+
+  std::thread thread;
+};
+
+
+const char* toString( Level level )
+{
+  switch ( level )
+  {
+  case Level::eDebug:   return "debug";
+  case Level::eInfo:    return "info";
+  case Level::eWarning: return "warning";
+  case Level::eError:   return "error";
+  }
+
+  return "unknown";
+}
+
+void setLogger( Logger logger )
+{
+  AsyncLogger::instance().setLogger( std::move( logger ) );
+}
+
+void setLevel( Level level )
+{
+  minimumLevel.store( level, std::memory_order_relaxed );
+}
+
+Level level()
+{
+  return minimumLevel.load( std::memory_order_relaxed );
+}
+
+void flush()
+{
+  AsyncLogger::instance().flush();
+}
+
+void write( Level level, std::string_view message, uint64_t numSuppressed )
+{
+  if ( numSuppressed == 0 )
+  {
+    AsyncLogger::instance().write( level, message );
+    return;
+  }
+
+  std::string withCount{ message };
+  withCount += " (";
+  withCount += std::to_string( numSuppressed );
+  withCount += " similar messages suppressed)";
+  AsyncLogger::instance().write( level, withCount );
+}
+
+bool RateLimit::allow( uint64_t& numSuppressed )
+{
+  // The coarse clock is read from the vDSO without a system call.
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+  const int64_t second{ now.tv_sec };
+
+  int64_t current{ window.load( std::memory_order_relaxed ) };
+  if ( ( current != second )
+    && window.compare_exchange_strong( current, second, std::memory_order_relaxed ) )
+  {
+    count.store( 0, std::memory_order_relaxed );
+  }
+
+  if ( count.fetch_add( 1, std::memory_order_relaxed ) < maxPerSecond )
+  {
+    numSuppressed = suppressed.exchange( 0, std::memory_order_relaxed );
+    return true;
+  }
+
+  suppressed.fetch_add( 1, std::memory_order_relaxed );
+  return false;
+}
+
+
+} // End of namespace logging
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
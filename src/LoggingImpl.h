@@ -0,0 +1,104 @@
+#ifndef LIB_LB_HTTPD_LOGGINGIMPL_H
+#define LIB_LB_HTTPD_LOGGINGIMPL_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/Logging.h>
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string_view>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace logging
+{
+
+
+inline std::atomic<Level> minimumLevel{ Level::eInfo };
+
+inline bool isEnabled( Level level )
+{
+  return level >= minimumLevel.load( std::memory_order_relaxed );
+}
+
+/** \brief Queue a message for the background logging thread. Never blocks. */
+void write( Level, std::string_view message, uint64_t numSuppressed );
+
+
+/** \brief Allows at most \a maxPerSecond messages per second through a log site. */
+class RateLimit
+{
+public:
+  static constexpr uint32_t maxPerSecond{ 10 };
+
+  /** \brief If allowed, \a numSuppressed is set to the count refused since the last allowed. */
+  bool allow( uint64_t& numSuppressed );
+
+private:
+  std::atomic<int64_t>  window{ -1 };
+  std::atomic<uint32_t> count{ 0 };
+  std::atomic<uint64_t> suppressed{ 0 };
+};
+
+
+} // End of namespace logging
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+/** \brief Log \a message, a chain of operator<< operands, at \a level.
+
+    e.g. LB_HTTPD_LOG( eError, "Failed to send " << n << " bytes" );
+
+    The message is only formatted if \a level is enabled and the site is within
+    its rate limit.
+ */
+#define LB_HTTPD_LOG( level, message )                                          \
+  do                                                                            \
+  {                                                                             \
+    if ( ::lb::httpd::logging::isEnabled( ::lb::httpd::logging::Level::level ) ) \
+    {                                                                           \
+      static ::lb::httpd::logging::RateLimit lbHttpdLogRateLimit;               \
+      uint64_t lbHttpdLogNumSuppressed{ 0 };                                    \
+      if ( lbHttpdLogRateLimit.allow( lbHttpdLogNumSuppressed ) )               \
+      {                                                                         \
+        std::ostringstream lbHttpdLogStream;                                    \
+        lbHttpdLogStream << message;                                            \
+        ::lb::httpd::logging::write( ::lb::httpd::logging::Level::level         \
+                                   , lbHttpdLogStream.str()                     \
+                                   , lbHttpdLogNumSuppressed );                 \
+      }                                                                         \
+    }                                                                           \
+  }                                                                             \
+  while ( false )
+
+
+#endif // LIB_LB_HTTPD_LOGGINGIMPL_H
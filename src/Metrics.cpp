@@ -0,0 +1,315 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Metrics.h"
+
+#include <lb/httpd/AccessLog.h>
+
+#include <iterator>
+#include <sched.h>
+#include <sstream>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace metrics
+{
+
+
+size_t currentShard()
+{
+  const int cpu{ sched_getcpu() };
+  return ( cpu < 0 ) ? 0 : static_cast<size_t>( cpu ) % numShards;
+}
+
+// static
+size_t Histogram::bucketIndex( uint64_t value )
+{
+  if ( value < numSubBuckets )
+  {
+    return value;
+  }
+
+  const unsigned msb{ 63u - static_cast<unsigned>( __builtin_clzll( value ) ) };
+  const unsigned shift{ msb - subBucketBits };
+  const size_t subBucket{ ( value >> shift ) - numSubBuckets };
+
+  return numSubBuckets + shift * numSubBuckets + subBucket;
+}
+
+// static
+uint64_t Histogram::bucketUpperBound( size_t index )
+{
+  if ( index < numSubBuckets )
+  {
+    return index;
+  }
+
+  const size_t shift{ ( index - numSubBuckets ) / numSubBuckets };
+  const uint64_t subBucket{ ( index - numSubBuckets ) % numSubBuckets };
+
+  // Wraps to the maximum value for the very last bucket, which is what we want.
+  return ( ( numSubBuckets + subBucket + 1 ) << shift ) - 1;
+}
+
+Server::Stats::Histogram Histogram::snapshot() const
+{
+  Server::Stats::Histogram h;
+  h.count = count.value();
+  h.sum = sum.value();
+
+  for ( size_t i = 0; i < numBuckets; ++i )
+  {
+    const uint64_t n{ buckets[i].load( std::memory_order_relaxed ) };
+    if ( n > 0 )
+    {
+      h.buckets.emplace_back( bucketUpperBound( i ), n );
+    }
+  }
+
+  return h;
+}
+
+const char* toString( CloseReason reason )
+{
+  // One list of names for both the metrics and the access log.
+  static_assert( std::size( accesslog::closeReasonNames )
+              == static_cast<size_t>( CloseReason::eNumReasons ) );
+
+  const auto i{ static_cast<size_t>( reason ) };
+  return ( i < std::size( accesslog::closeReasonNames ) ) ? accesslog::closeReasonNames[i] : "unknown";
+}
+
+Server::Stats Metrics::snapshot() const
+{
+  Server::Stats stats;
+
+  for ( size_t m = 0; m < numMethods; ++m )
+  {
+    for ( size_t c = 0; c < numStatusClasses; ++c )
+    {
+      const uint64_t n{ httpRequests[m][c].value() };
+      if ( n > 0 )
+      {
+        stats.httpRequests.push_back( { static_cast<Server::Method>( m )
+                                      , static_cast<unsigned int>( c + 1 )
+                                      , n } );
+      }
+    }
+  }
+
+  stats.httpHandlerMicroseconds = httpHandlerMicroseconds.snapshot();
+  stats.httpRequestMicroseconds = httpRequestMicroseconds.snapshot();
+  stats.httpRequestsShed = httpRequestsShed.value();
+  stats.httpRequestsRateLimited = httpRequestsRateLimited.value();
+
+  stats.webSocketConnectionsOpened = webSocketConnectionsOpened.value();
+  stats.webSocketConnectionsActive = webSocketConnectionsActive.value();
+  stats.webSocketFramesIn          = webSocketFramesIn.value();
+  stats.webSocketFramesOut         = webSocketFramesOut.value();
+  stats.webSocketBytesIn           = webSocketBytesIn.value();
+  stats.webSocketBytesOut          = webSocketBytesOut.value();
+  stats.webSocketMessagesIn        = webSocketMessagesIn.value();
+  stats.webSocketMessagesOut       = webSocketMessagesOut.value();
+  stats.webSocketSendQueueBytes    = webSocketSendQueueBytes.value();
+
+  stats.webSocketLoopIterationMicroseconds = webSocketLoopIterationMicroseconds.snapshot();
+  stats.webSocketLoopLagMicroseconds       = webSocketLoopLagMicroseconds.snapshot();
+  stats.webSocketLoopEventsPerWakeup       = webSocketLoopEventsPerWakeup.snapshot();
+  stats.webSocketReceiverMicroseconds      = webSocketReceiverMicroseconds.snapshot();
+  stats.webSocketSlowReceivers             = webSocketSlowReceivers.value();
+  stats.webSocketsRateLimited              = webSocketsRateLimited.value();
+
+  for ( size_t r = 0; r < static_cast<size_t>( CloseReason::eNumReasons ); ++r )
+  {
+    stats.webSocketCloseReasons.emplace_back( toString( static_cast<CloseReason>( r ) )
+                                            , webSocketCloseReasons[r].value() );
+  }
+
+  return stats;
+}
+
+
+} // End of namespace metrics
+
+
+uint64_t Server::Stats::Histogram::percentile( double p ) const
+{
+  if ( count == 0 )
+  {
+    return 0;
+  }
+
+  const double target{ ( p / 100.0 ) * count };
+  uint64_t cumulative{ 0 };
+  for ( const auto&[ upperBound, n ] : buckets )
+  {
+    cumulative += n;
+    if ( cumulative >= target )
+    {
+      return upperBound;
+    }
+  }
+
+  return buckets.empty() ? 0 : buckets.back().first;
+}
+
+
+static
+const char* toString( Server::Method method )
+{
+  switch ( method )
+  {
+  case Server::Method::eInvalid: return "INVALID";
+  case Server::Method::eGet:     return "GET";
+  case Server::Method::eHead:    return "HEAD";
+  case Server::Method::ePost:    return "POST";
+  case Server::Method::ePut:     return "PUT";
+  case Server::Method::eDelete:  return "DELETE";
+  }
+
+  return "UNKNOWN";
+}
+
+static
+void formatHistogram( std::ostream& os
+                    , const std::string& name
+                    , const std::string& help
+                    , const Server::Stats::Histogram& h
+                    , unsigned maxPowerOfTwo = 26 // 67 seconds in microseconds
+                    , double scale = 1e6 )
+{
+  // Prometheus convention is base units so microseconds become seconds.
+  os << "# HELP " << name << ' ' << help << '\n'
+     << "# TYPE " << name << " histogram\n";
+
+  // The same boundaries every time, as Prometheus needs to compare scrapes.
+  // Each is the top of a power of two range so falls exactly on a boundary of
+  // the finer grained buckets recorded.
+  // Enough digits to print the largest boundary exactly.
+  const auto precision{ os.precision( 10 ) };
+
+  uint64_t cumulative{ 0 };
+  auto I{ h.buckets.begin() };
+  for ( unsigned p = 0; p <= maxPowerOfTwo; ++p )
+  {
+    const uint64_t upperBound{ ( uint64_t{ 1 } << p ) - 1 };
+    for ( ; ( I != h.buckets.end() ) && ( I->first <= upperBound ); ++I )
+    {
+      cumulative += I->second;
+    }
+    os << name << "_bucket{le=\"" << ( upperBound / scale ) << "\"} " << cumulative << '\n';
+  }
+  os << name << "_bucket{le=\"+Inf\"} " << h.count << '\n'
+     << name << "_sum " << ( h.sum / scale ) << '\n'
+     << name << "_count " << h.count << '\n';
+
+  os.precision( precision );
+}
+
+static
+void formatCounter( std::ostream& os
+                  , const std::string& name
+                  , const std::string& help
+                  , const char* type
+                  , int64_t value )
+{
+  os << "# HELP " << name << ' ' << help << '\n'
+     << "# TYPE " << name << ' ' << type << '\n'
+     << name << ' ' << value << '\n';
+}
+
+// static
+std::string Server::formatPrometheus( const Stats& stats )
+{
+  std::ostringstream os;
+
+  os << "# HELP lbhttpd_http_requests_total HTTP requests by method and status class.\n"
+     << "# TYPE lbhttpd_http_requests_total counter\n";
+  for ( const auto& r : stats.httpRequests )
+  {
+    os << "lbhttpd_http_requests_total{method=\"" << toString( r.method )
+       << "\",code=\"" << r.statusClass << "xx\"} " << r.count << '\n';
+  }
+
+  formatHistogram( os
+                 , "lbhttpd_http_handler_duration_seconds"
+                 , "Time spent in the request handler."
+                 , stats.httpHandlerMicroseconds );
+  formatHistogram( os
+                 , "lbhttpd_http_request_duration_seconds"
+                 , "Time from request headers received to response queued."
+                 , stats.httpRequestMicroseconds );
+
+  formatCounter( os, "lbhttpd_http_connections", "Open HTTP connections.", "gauge", stats.httpConnections );
+  formatCounter( os, "lbhttpd_http_requests_shed_total", "HTTP requests rejected by admission control.", "counter", stats.httpRequestsShed );
+  formatCounter( os, "lbhttpd_http_concurrency_limit", "Admission control limit on requests in flight.", "gauge", stats.httpConcurrencyLimit );
+  formatCounter( os, "lbhttpd_http_requests_in_flight", "HTTP requests counted by admission control.", "gauge", stats.httpRequestsInFlight );
+  formatCounter( os, "lbhttpd_http_requests_rate_limited_total", "HTTP requests rejected by per client rate limits.", "counter", stats.httpRequestsRateLimited );
+
+  formatCounter( os, "lbhttpd_websocket_connections_opened_total", "WebSocket connections opened.", "counter", stats.webSocketConnectionsOpened );
+  formatCounter( os, "lbhttpd_websocket_connections", "Open WebSocket connections.", "gauge", stats.webSocketConnectionsActive );
+  formatCounter( os, "lbhttpd_websocket_frames_received_total", "WebSocket frames received.", "counter", stats.webSocketFramesIn );
+  formatCounter( os, "lbhttpd_websocket_frames_sent_total", "WebSocket frames sent.", "counter", stats.webSocketFramesOut );
+  formatCounter( os, "lbhttpd_websocket_received_bytes_total", "WebSocket bytes received.", "counter", stats.webSocketBytesIn );
+  formatCounter( os, "lbhttpd_websocket_sent_bytes_total", "WebSocket bytes sent.", "counter", stats.webSocketBytesOut );
+  formatCounter( os, "lbhttpd_websocket_messages_received_total", "WebSocket data messages received.", "counter", stats.webSocketMessagesIn );
+  formatCounter( os, "lbhttpd_websocket_messages_sent_total", "WebSocket data messages sent.", "counter", stats.webSocketMessagesOut );
+  formatCounter( os, "lbhttpd_websocket_send_queue_bytes", "Unsent WebSocket bytes at the last sample.", "gauge", stats.webSocketSendQueueBytes );
+
+  formatHistogram( os
+                 , "lbhttpd_websocket_loop_iteration_duration_seconds"
+                 , "WebSocket loop time from wake up to next poll."
+                 , stats.webSocketLoopIterationMicroseconds );
+  formatHistogram( os
+                 , "lbhttpd_websocket_loop_lag_seconds"
+                 , "How late the WebSocket loop woke after a poll timeout."
+                 , stats.webSocketLoopLagMicroseconds );
+  formatHistogram( os
+                 , "lbhttpd_websocket_loop_events_per_wakeup"
+                 , "Ready sockets per WebSocket loop wake up."
+                 , stats.webSocketLoopEventsPerWakeup
+                 , 16
+                 , 1.0 );
+  formatHistogram( os
+                 , "lbhttpd_websocket_receiver_duration_seconds"
+                 , "Time spent in each WebSocket receiver call."
+                 , stats.webSocketReceiverMicroseconds );
+  formatCounter( os, "lbhttpd_websocket_slow_receivers_total", "WebSocket receiver calls over budget.", "counter", stats.webSocketSlowReceivers );
+  formatCounter( os, "lbhttpd_websocket_rate_limited_total", "WebSockets closed for exceeding the message rate limit.", "counter", stats.webSocketsRateLimited );
+
+  os << "# HELP lbhttpd_websocket_closes_total WebSocket connections closed by reason.\n"
+     << "# TYPE lbhttpd_websocket_closes_total counter\n";
+  for ( const auto&[ reason, n ] : stats.webSocketCloseReasons )
+  {
+    os << "lbhttpd_websocket_closes_total{reason=\"" << reason << "\"} " << n << '\n';
+  }
+
+  return os.str();
+}
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
@@ -0,0 +1,240 @@
+#ifndef LIB_LB_HTTPD_METRICS_H
+#define LIB_LB_HTTPD_METRICS_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/Server.h>
+
+#include "LoggingImpl.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace metrics
+{
+
+
+/** \brief Number of per-CPU shards. CPUs beyond this share shards. */
+constexpr size_t numShards{ 16 };
+
+/** \brief The shard for the CPU the caller is running on. */
+size_t currentShard();
+
+
+/** \brief A monotonic counter sharded per CPU.
+
+    Each shard is on its own cache line so concurrent increments from different
+    CPUs never contend. Reading sums the shards.
+ */
+class Counter
+{
+public:
+  void add( uint64_t n = 1 )
+  {
+    shards[ currentShard() ].value.fetch_add( n, std::memory_order_relaxed );
+  }
+
+  uint64_t value() const
+  {
+    uint64_t total{ 0 };
+    for ( const auto& shard : shards )
+    {
+      total += shard.value.load( std::memory_order_relaxed );
+    }
+    return total;
+  }
+
+private:
+  struct alignas( 64 ) Shard
+  {
+    std::atomic<uint64_t> value{ 0 };
+  };
+  std::array<Shard, numShards> shards;
+};
+
+
+/** \brief A value that can go up and down. */
+class Gauge
+{
+public:
+  void add( int64_t n ) { v.fetch_add( n, std::memory_order_relaxed ); }
+  void set( int64_t n ) { v.store( n, std::memory_order_relaxed ); }
+
+  int64_t value() const { return v.load( std::memory_order_relaxed ); }
+
+private:
+  std::atomic<int64_t> v{ 0 };
+};
+
+
+/** \brief A log-linear histogram of unsigned values, HDR histogram style.
+
+    Values below 8 get a bucket each, above that every power of two range is
+    split into 8 equal sub-buckets so the relative error is at most 12.5% across
+    the whole 64 bit range. Recording is a couple of bit operations and a
+    relaxed atomic increment.
+ */
+class Histogram
+{
+public:
+  static constexpr unsigned subBucketBits{ 3 };
+  static constexpr size_t numSubBuckets{ 1u << subBucketBits };
+  static constexpr size_t numBuckets{ numSubBuckets + ( 64 - subBucketBits ) * numSubBuckets };
+
+  static size_t bucketIndex( uint64_t value );
+  static uint64_t bucketUpperBound( size_t index );
+
+  void record( uint64_t value )
+  {
+    buckets[ bucketIndex( value ) ].fetch_add( 1, std::memory_order_relaxed );
+    count.add();
+    sum.add( value );
+  }
+
+  template< typename Duration >
+  void recordMicroseconds( Duration d )
+  {
+    const auto us{ std::chrono::duration_cast<std::chrono::microseconds>( d ).count() };
+    record( us > 0 ? us : 0 );
+  }
+
+  Server::Stats::Histogram snapshot() const;
+
+private:
+  std::array<std::atomic<uint64_t>, numBuckets> buckets{};
+  Counter count;
+  Counter sum;
+};
+
+
+/** \brief Why a WebSocket connection was closed. */
+enum class CloseReason
+{
+  eClientClose,     //!< Client sent a close frame
+  eServerClose,     //!< Application sent a close frame
+  eProtocolError,   //!< Client broke the protocol
+  eCloseTimeout,    //!< No reply to our close frame in time
+  eSocketClosed,    //!< Socket closed or failed without a close frame
+  eShutdown,        //!< Server going away
+  ePolicyViolation, //!< Client exceeded a limit, see Server::Config::rateLimit
+  eMigrated,        //!< Handed over to another process
+
+  eNumReasons
+};
+
+const char* toString( CloseReason );
+
+
+/** \brief All the metrics recorded by a \a Server. */
+struct Metrics
+{
+  static constexpr size_t numMethods{ 6 };       // Server::Method including eInvalid
+  static constexpr size_t numStatusClasses{ 5 }; // 1xx to 5xx
+
+  void recordHttpRequest( Server::Method method, unsigned int statusCode )
+  {
+    const size_t statusClass{ statusCode / 100 };
+    if ( ( statusClass >= 1 ) && ( statusClass <= numStatusClasses ) )
+    {
+      httpRequests[ static_cast<size_t>( method ) ][ statusClass - 1 ].add();
+    }
+  }
+
+  void recordClose( CloseReason reason )
+  {
+    webSocketCloseReasons[ static_cast<size_t>( reason ) ].add();
+  }
+
+  Server::Stats snapshot() const;
+
+  Counter httpRequests[ numMethods ][ numStatusClasses ];
+  Histogram httpHandlerMicroseconds;
+  Histogram httpRequestMicroseconds;
+  Counter   httpRequestsShed;
+  Counter   httpRequestsRateLimited;
+
+  Counter webSocketConnectionsOpened;
+  Gauge   webSocketConnectionsActive;
+  Counter webSocketFramesIn;
+  Counter webSocketFramesOut;
+  Counter webSocketBytesIn;
+  Counter webSocketBytesOut;
+  Counter webSocketMessagesIn;
+  Counter webSocketMessagesOut;
+  Gauge   webSocketSendQueueBytes;
+
+  Counter webSocketCloseReasons[ static_cast<size_t>( CloseReason::eNumReasons ) ];
+
+  /** \brief Record a call into a ws::Receivers callback, checking the budget. */
+  void recordReceiver( ws::ConnectionID connectionID
+                     , std::chrono::steady_clock::duration d )
+  {
+    webSocketReceiverMicroseconds.recordMicroseconds( d );
+
+    if ( ( receiverBudget.count() > 0 ) && ( d > receiverBudget ) )
+    {
+      webSocketSlowReceivers.add();
+
+      const auto us{ std::chrono::duration_cast<std::chrono::microseconds>( d ) };
+      if ( slowReceiverCallback )
+      {
+        slowReceiverCallback( connectionID, us );
+      }
+      else
+      {
+        LB_HTTPD_LOG( eWarning, "WebSocket receiver for ID " << connectionID << " took "
+                                << us.count() << " microseconds, budget is "
+                                << receiverBudget.count() );
+      }
+    }
+  }
+
+  Histogram webSocketLoopIterationMicroseconds;
+  Histogram webSocketLoopLagMicroseconds;
+  Histogram webSocketLoopEventsPerWakeup;
+  Histogram webSocketReceiverMicroseconds;
+  Counter   webSocketSlowReceivers;
+  Counter   webSocketsRateLimited;
+
+  // From Server::Config, set once before the loop thread starts.
+  std::chrono::microseconds receiverBudget{ 0 };
+  Server::Config::SlowReceiverCallback slowReceiverCallback;
+};
+
+
+} // End of namespace metrics
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_METRICS_H
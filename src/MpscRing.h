@@ -0,0 +1,130 @@
+#ifndef LIB_LB_HTTPD_MPSCRING_H
+#define LIB_LB_HTTPD_MPSCRING_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief Bounded multi-producer, single-consumer queue.
+
+    Each slot carries a sequence number, as in Dmitry Vyukov's bounded queue,
+    so producers claim a slot with a single compare and swap and the consumer
+    knows when a slot has been filled without any locking. Entries are filled
+    and read in place so nothing is allocated or copied twice.
+
+    \a numSlots must be a power of two.
+ */
+template< typename T, size_t numSlots >
+class MpscRing
+{
+  static_assert( ( numSlots & ( numSlots - 1 ) ) == 0, "numSlots must be a power of two" );
+
+public:
+  MpscRing()
+  {
+    for ( size_t i = 0; i < numSlots; ++i )
+    {
+      slots[i].sequence.store( i, std::memory_order_relaxed );
+    }
+  }
+
+  /** \brief Claim a slot and call \a fill( T& ) on it. Returns false if full. */
+  template< typename Fill >
+  bool push( Fill fill )
+  {
+    size_t position{ enqueuePosition.load( std::memory_order_relaxed ) };
+    Slot* slot{ nullptr };
+    while ( true )
+    {
+      slot = &slots[ position & ( numSlots - 1 ) ];
+      const size_t sequence{ slot->sequence.load( std::memory_order_acquire ) };
+      const auto diff{ static_cast<std::ptrdiff_t>( sequence - position ) };
+      if ( diff == 0 )
+      {
+        if ( enqueuePosition.compare_exchange_weak( position
+                                                  , position + 1
+                                                  , std::memory_order_relaxed ) )
+        {
+          break;
+        }
+      }
+      else if ( diff < 0 )
+      {
+        return false;
+      }
+      else
+      {
+        position = enqueuePosition.load( std::memory_order_relaxed );
+      }
+    }
+
+    fill( slot->value );
+    slot->sequence.store( position + 1, std::memory_order_release );
+
+    return true;
+  }
+
+  /** \brief Consumer only. Calls \a f( const T& ) with the oldest entry, if any. */
+  template< typename Function >
+  bool pop( Function f )
+  {
+    Slot& slot{ slots[ dequeuePosition & ( numSlots - 1 ) ] };
+    if ( slot.sequence.load( std::memory_order_acquire ) != dequeuePosition + 1 )
+    {
+      return false;
+    }
+
+    f( static_cast<const T&>( slot.value ) );
+
+    slot.sequence.store( dequeuePosition + numSlots, std::memory_order_release );
+    ++dequeuePosition;
+
+    return true;
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+  std::array<Slot, numSlots> slots;
+
+  alignas( 64 ) std::atomic<size_t> enqueuePosition{ 0 };
+  alignas( 64 ) size_t dequeuePosition{ 0 };
+};
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_MPSCRING_H
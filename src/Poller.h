@@ -18,22 +18,42 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include "LoggingImpl.h"
+#include "Tracepoints.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <mutex>
-#include <poll.h>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-/** \brief Wrapper around the system poll() call.
+
+/** \brief Wrapper around an epoll instance.
 
     Use \a add to enable polling of a file descriptor and register a callback to
-    be invoked when data is available on that file descriptor.
+    be invoked when data is available on that file descriptor, or it has hung up
+    or is in error. The callback returns false to have it removed.
 
     Use \a remove to remove the file descriptor from being polled.
 
     Use the function operator to perform a single poll of all registered file
     descriptors.
 
+    Additions and removals from other threads are queued and applied by the
+    polling thread just before it next polls. Additions also wake a poll in
+    progress so that a new file descriptor is not left waiting for the timeout.
+    The epoll file descriptor itself, see \a fd, becomes readable whenever there
+    is something to do so can be polled in turn by an outer event loop.
+
     Thread safe.
  */
 class Poller
@@ -41,92 +61,224 @@ class Poller
 public:
   using Callback = std::function< bool() >;
 
+  Poller()
+    : epollFD{ epoll_create1( EPOLL_CLOEXEC ) }
+    , wakeFD{ eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK ) }
+  {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = wakeSlot;
+    if ( ( epollFD < 0 )
+      || ( wakeFD < 0 )
+      || ( epoll_ctl( epollFD, EPOLL_CTL_ADD, wakeFD, &event ) != 0 ) )
+    {
+      const std::string error{ std::strerror( errno ) };
+      closeFDs();
+      throw std::runtime_error{ "Failed to create poller: " + error };
+    }
+  }
+
+  ~Poller()
+  {
+    closeFDs();
+  }
+
+  Poller( const Poller& ) = delete;
+  Poller& operator=( const Poller& ) = delete;
+
   void add( int fd, Callback inCallback )
   {
-    std::scoped_lock l{ pendingAddsMutex };
-    pendingAdds.emplace( fd, inCallback ); // Actually added just prior to polling
+    {
+      std::scoped_lock l{ pendingAddsMutex };
+      pendingAdds.emplace( fd, inCallback ); // Actually added just prior to polling
+    }
+
+    wake();
   }
 
   void remove( int fd )
   {
+    {
+      // An addition not yet made must not be made after the removal is.
+      std::scoped_lock l{ pendingAddsMutex };
+      pendingAdds.erase( fd );
+    }
+
     std::scoped_lock l{ pendingRemovalsMutex };
     pendingRemovals.push_back( fd );
   }
 
+  /** \brief Make a poll in progress, or the next one, return straight away. */
+  void wake()
+  {
+    const uint64_t one{ 1 };
+    [[maybe_unused]] const auto n{ write( wakeFD, &one, sizeof( one ) ) };
+  }
+
+  /** \brief Wait up to \a timeout milliseconds and dispatch.
+      \return The number of file descriptors that were ready, or -1 on error.
+   */
   int operator() ( int timeout )
+  {
+    const int numReady{ wait( timeout ) };
+    if ( numReady > 0 )
+    {
+      dispatch();
+    }
+    return numReady;
+  }
+
+  /** \brief Wait up to \a timeout milliseconds for any file descriptor to be ready.
+      \return The number that are ready, or -1 on error.
+   */
+  int wait( int timeout )
   {
     processPendingRemovals();
     processPendingAdds();
 
-    pollfd* pfd{ nullptr };
-    if ( !pollFDs.empty() )
+    numEvents = 0;
+
+    const int pollResult{ epoll_wait( epollFD, events.data(), events.size(), timeout ) };
+
+    wakeTime = std::chrono::steady_clock::now();
+    timedOut = ( pollResult == 0 );
+
+    LB_HTTPD_TRACE( poll__return, pollResult, fdSlots.size() );
+
+    if ( pollResult < 0 )
     {
-      pfd = &pollFDs[0];
+      if ( errno == EINTR )
+      {
+        return 0;
+      }
+      LB_HTTPD_LOG( eError, "Error polling" );
+      return pollResult;
     }
 
-    const int pollResult{ poll( pfd, pollFDs.size(), timeout ) };
+    numEvents = pollResult;
 
-    if ( pollResult < 0 )
+    int numReady{ 0 };
+    for ( int i = 0; i < numEvents; ++i )
     {
-      std::cerr << "Error polling" << std::endl;
+      if ( events[i].data.u64 == wakeSlot )
+      {
+        uint64_t count;
+        [[maybe_unused]] const auto n{ read( wakeFD, &count, sizeof( count ) ) };
+      }
+      else
+      {
+        ++numReady;
+      }
     }
-    else if ( pollResult > 0 )
+
+    return numReady;
+  }
+
+  /** \brief Invoke the callbacks of the file descriptors found ready by \a wait.
+
+      Removals made since the wait are applied first so no callback is invoked
+      for a file descriptor once \a remove has returned and a dispatch started
+      after it.
+   */
+  void dispatch()
+  {
+    processPendingRemovals();
+
+    int numFDsProcessed{ 0 };
+    std::vector<int> toRemove;
+
+    for ( int i = 0; i < numEvents; ++i )
     {
-      bool repoll{ false };
-      int numFDsProcessed{ 0 };
-      std::vector<int> toRemove;
-      toRemove.reserve( pollFDs.size() );
+      const uint64_t slot{ events[i].data.u64 };
+      if ( slot == wakeSlot )
+      {
+        continue;
+      }
+
+      ++numFDsProcessed;
 
-      for ( PollFDs::size_type i = 0; i < pollFDs.size(); ++i )
+      // A hang up or error is reported whether asked for or not, and keeps
+      // being reported, so the callback must get to read the EOF or error.
+      if ( ( events[i].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) && callbacks[ slot ] )
       {
-        if ( ( pollFDs[i].fd > -1 ) && ( pollFDs[i].revents & POLLIN ) )
+        if ( !callbacks[ slot ]() )
         {
-          if ( !pollCallbacks[i]() )
-          {
-            toRemove.push_back( pollFDs[i].fd );
-          }
-          ++numFDsProcessed;
-
-          // Can terminate early if we've reached the number returned by poll.
-          if ( numFDsProcessed == pollResult )
-          {
-            break;
-          }
+          toRemove.push_back( slotFDs[ slot ] );
         }
       }
+    }
+    numEvents = 0;
 
+    if ( !toRemove.empty() )
+    {
       bulkRemoval( toRemove );
     }
 
-    return pollResult;
+    LB_HTTPD_TRACE( poll__dispatched, numFDsProcessed );
   }
 
+  /** \brief When the last poll returned, before any callbacks were invoked. */
+  std::chrono::steady_clock::time_point lastWakeTime() const { return wakeTime; }
+
+  /** \brief Whether the last poll returned for lack of anything to do. */
+  bool lastTimedOut() const { return timedOut; }
+
+  /** \brief Readable when a call to the function operator has work to do. */
+  int fd() const { return epollFD; }
+
 private:
+  void closeFDs()
+  {
+    if ( wakeFD >= 0 )
+    {
+      close( wakeFD );
+    }
+    if ( epollFD >= 0 )
+    {
+      close( epollFD );
+    }
+  }
+
   void processPendingAdds()
   {
     std::scoped_lock l{ pendingAddsMutex };
 
     for ( auto&[ fd, callback ] : pendingAdds )
     {
-      if ( nextAvailable == pollFDs.size() )
+      size_t slot;
+      if ( freeSlots.empty() )
       {
-        pollFDs.push_back( {} );
-        pollCallbacks.emplace_back();
+        slot = callbacks.size();
+        callbacks.emplace_back();
+        slotFDs.push_back( -1 );
+      }
+      else
+      {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
       }
 
-      auto& pollfd{ pollFDs[ nextAvailable ] };
-      pollfd.fd = fd;
-      pollfd.events = POLLIN;
-      pollCallbacks[ nextAvailable ] = std::move( callback );
-
-      do
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.u64 = slot;
+      if ( epoll_ctl( epollFD, EPOLL_CTL_ADD, fd, &event ) != 0 )
       {
-        ++nextAvailable;
+        LB_HTTPD_LOG( eError, "Failed to add socket " << fd << " to poller: " << std::strerror( errno ) );
+        freeSlots.push_back( slot );
+        continue;
       }
-      while( ( nextAvailable < pollFDs.size() ) && ( pollFDs[ nextAvailable ].fd < 0 ) );
+
+      callbacks[ slot ] = std::move( callback );
+      slotFDs[ slot ] = fd;
+      fdSlots[ fd ] = slot;
     }
 
     pendingAdds.clear();
+
+    if ( events.size() < std::min<size_t>( fdSlots.size() + 1, maxEventsPerPoll ) )
+    {
+      events.resize( std::min<size_t>( fdSlots.size() + 1, maxEventsPerPoll ) );
+    }
   }
 
   void bulkRemoval( const std::vector<int>& extraRemovals )
@@ -151,30 +303,35 @@ private:
   {
     for ( auto& fd : pendingRemovals )
     {
-      for ( PollFDs::size_type i = 0; i < pollFDs.size(); ++i )
+      const auto I{ fdSlots.find( fd ) };
+      if ( I == fdSlots.end() )
       {
-        auto& pfd{ pollFDs[i] };
-        if ( pfd.fd == fd )
-        {
-          pfd.fd = -1;
-          pfd.events = 0;
-          pfd.revents = 0;
-
-          pollCallbacks[i] = {};
+        continue;
+      }
 
-          if ( i < nextAvailable )
-          {
-            nextAvailable = i;
-          }
+      // The socket may already be closed, in which case the kernel has
+      // dropped it from the set itself.
+      epoll_ctl( epollFD, EPOLL_CTL_DEL, fd, nullptr );
 
-          break;
-        }
-      }
+      callbacks[ I->second ] = {};
+      slotFDs[ I->second ] = -1;
+      freeSlots.push_back( I->second );
+      fdSlots.erase( I );
     }
 
     pendingRemovals.clear();
   }
 
+  // Events per epoll_wait. More than this many ready at once just waits for
+  // the next, immediate, call.
+  static constexpr size_t maxEventsPerPoll{ 1024 };
+
+  // Marks the wake eventfd in the epoll data, never a valid slot.
+  static constexpr uint64_t wakeSlot{ ~uint64_t( 0 ) };
+
+  const int epollFD;
+  const int wakeFD;
+
   std::mutex pendingAddsMutex;
   using PendingAdds = std::unordered_map< int, Callback >;
   PendingAdds pendingAdds;
@@ -183,22 +340,18 @@ private:
   using PendingRemovals = std::vector< int >;
   PendingRemovals pendingRemovals;
 
-  // For reference:
-  //
-  // struct pollfd {
-  //   int   fd;         /* file descriptor */
-  //   short events;     /* requested events */
-  //   short revents;    /* returned events */
-  // };
-
-  // Keep the file descriptor vector separate from the callbacks as we need the
-  // contiguous memory to pass to poll.
-  using PollFDs = std::vector<pollfd>;
-  PollFDs pollFDs;
-  PollFDs::size_type nextAvailable{ 0 };
-
-  using Callbacks = std::vector<Callback>;
-  Callbacks pollCallbacks;
+  // Only touched by the polling thread. The epoll data of each descriptor is
+  // its slot in these.
+  std::vector<Callback> callbacks;
+  std::vector<int> slotFDs;
+  std::vector<size_t> freeSlots;
+  std::unordered_map<int, size_t> fdSlots;
+
+  std::vector<epoll_event> events{ 1 };
+  int numEvents{ 0 }; //!< In events, from the last wait
+
+  std::chrono::steady_clock::time_point wakeTime;
+  bool timedOut{ false };
 };
 
 
@@ -0,0 +1,218 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "RateLimiter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+#include <netinet/in.h>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+// static
+std::optional<RateLimiter::Address> RateLimiter::address( const sockaddr* addr )
+{
+  if ( !addr )
+  {
+    return std::nullopt;
+  }
+
+  Address result{};
+  switch ( addr->sa_family )
+  {
+  case AF_INET:
+  {
+    const auto* in{ reinterpret_cast<const sockaddr_in*>( addr ) };
+    result[10] = 0xff;
+    result[11] = 0xff;
+    std::memcpy( result.data() + 12, &in->sin_addr, 4 );
+    return result;
+  }
+  case AF_INET6:
+  {
+    const auto* in6{ reinterpret_cast<const sockaddr_in6*>( addr ) };
+    if ( IN6_IS_ADDR_V4MAPPED( &in6->sin6_addr ) )
+    {
+      // An IPv4 client of a dual stack socket.
+      std::memcpy( result.data(), &in6->sin6_addr, 16 );
+    }
+    else
+    {
+      std::memcpy( result.data(), &in6->sin6_addr, 8 );
+    }
+    return result;
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+size_t RateLimiter::AddressHash::operator()( const Address& address ) const
+{
+  return std::hash<std::string_view>{}(
+    { reinterpret_cast<const char*>( address.data() ), address.size() } );
+}
+
+
+RateLimiter::RateLimiter( const Server::Config::RateLimit& config )
+  : rates{ config.requestsPerSecond, config.upgradesPerSecond, config.messagesPerSecond }
+  , bursts{ config.requestBurst, config.upgradeBurst, config.messageBurst }
+  , idleExpiry{ std::chrono::seconds{ 1 } }
+  , maxEntriesPerShard{ ( config.maxAddresses > 0 )
+                        ? std::max<size_t>( 1, config.maxAddresses / numShards )
+                        : 0 }
+{
+  for ( size_t k = 0; k < rates.size(); ++k )
+  {
+    if ( rates[k] > 0 )
+    {
+      const std::chrono::duration<double> refill{ bursts[k] / rates[k] };
+      idleExpiry = std::max( idleExpiry
+                           , std::chrono::duration_cast<std::chrono::steady_clock::duration>( refill ) );
+    }
+  }
+}
+
+RateLimiter::Shard& RateLimiter::shard( const Address& address )
+{
+  // Not just the low bytes, which are zero for an IPv6 /64.
+  return shards[ AddressHash{}( address ) % numShards ];
+}
+
+bool RateLimiter::tryAcquire( const Address& address, Kind kind, TimePoint now )
+{
+  const size_t k{ static_cast<size_t>( kind ) };
+  if ( rates[k] <= 0 )
+  {
+    return true;
+  }
+
+  Shard& s{ shard( address ) };
+  std::scoped_lock l{ s.mutex };
+
+  sweep( s, now );
+
+  if ( ( maxEntriesPerShard > 0 )
+    && ( s.entries.size() >= maxEntriesPerShard )
+    && !s.entries.contains( address ) )
+  {
+    evict( s );
+  }
+
+  auto[ I, inserted ]{ s.entries.try_emplace( address ) };
+  Entry& entry{ I->second };
+  if ( inserted )
+  {
+    for ( size_t i = 0; i < entry.buckets.size(); ++i )
+    {
+      entry.buckets[i] = { bursts[i], now };
+    }
+  }
+  entry.lastUsed = now;
+
+  Bucket& bucket{ entry.buckets[k] };
+  const std::chrono::duration<double> elapsed{ now - bucket.refilled };
+  bucket.tokens = std::min( bursts[k], bucket.tokens + elapsed.count() * rates[k] );
+  bucket.refilled = now;
+
+  if ( bucket.tokens < 1 )
+  {
+    return false;
+  }
+
+  bucket.tokens -= 1;
+  return true;
+}
+
+size_t RateLimiter::numAddresses() const
+{
+  size_t n{ 0 };
+  for ( const auto& s : shards )
+  {
+    std::scoped_lock l{ s.mutex };
+    n += s.entries.size();
+  }
+  return n;
+}
+
+void RateLimiter::sweep( Shard& s, TimePoint now )
+{
+  const size_t numBuckets{ s.entries.bucket_count() };
+  for ( size_t n = 0; n < numSweepBuckets; ++n )
+  {
+    const size_t b{ s.sweepBucket++ % numBuckets };
+    for ( auto I = s.entries.begin( b ); I != s.entries.end( b ); )
+    {
+      // Erasing leaves the other entries, and iterators to them, in place.
+      const auto J{ I++ };
+      if ( ( now - J->second.lastUsed ) >= idleExpiry )
+      {
+        const Address idle{ J->first };
+        s.entries.erase( idle );
+      }
+    }
+  }
+  s.sweepBucket %= numBuckets;
+}
+
+void RateLimiter::evict( Shard& s )
+{
+  // A full map has most of its buckets in use, so this soon finds a few.
+  constexpr size_t numCandidates{ 8 };
+  constexpr size_t maxBuckets{ 64 };
+
+  const size_t numBuckets{ s.entries.bucket_count() };
+  std::optional<Address> victim;
+  TimePoint victimLastUsed{ TimePoint::max() };
+  size_t numSeen{ 0 };
+  for ( size_t n = 0; ( n < maxBuckets ) && ( numSeen < numCandidates ); ++n )
+  {
+    const size_t b{ ( s.sweepBucket + n ) % numBuckets };
+    for ( auto I = s.entries.begin( b ); I != s.entries.end( b ); ++I, ++numSeen )
+    {
+      if ( I->second.lastUsed < victimLastUsed )
+      {
+        victim = I->first;
+        victimLastUsed = I->second.lastUsed;
+      }
+    }
+  }
+
+  if ( victim )
+  {
+    s.entries.erase( *victim );
+  }
+  else
+  {
+    s.entries.erase( s.entries.begin() );
+  }
+}
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
@@ -0,0 +1,145 @@
+#ifndef LIB_LB_HTTPD_RATELIMITER_H
+#define LIB_LB_HTTPD_RATELIMITER_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/Server.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+#include <sys/socket.h>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief Per client address token buckets, see Server::Config::RateLimit.
+
+    The buckets are held in a hash map split into shards, each with its own
+    mutex, as the MHD thread checks requests while the WebSocket loop thread
+    checks messages. Entries are only created for clients that are seen and
+    are dropped lazily: each lookup sweeps a few hash buckets of its shard of
+    entries idle for long enough that all their buckets would have refilled,
+    so forgetting them changes nothing. A full shard makes room by forgetting
+    the least recently used of a few entries.
+ */
+class RateLimiter
+{
+public:
+  enum class Kind
+  {
+    eRequest,
+    eUpgrade,
+    eMessage,
+
+    eNumKinds
+  };
+
+  /** \brief IPv6 address, IPv4 ones being mapped i.e. ::ffff:a.b.c.d */
+  using Address = std::array<uint8_t, 16>;
+
+  /** \brief The key for a client's socket address. None for non-IP e.g. Unix sockets.
+
+      Only the /64 prefix of an IPv6 address, as a client is typically given
+      a whole /64 and could otherwise use a fresh address for every request.
+   */
+  static std::optional<Address> address( const sockaddr* );
+
+  explicit RateLimiter( const Server::Config::RateLimit& );
+
+  bool enabled( Kind kind ) const { return rates[ static_cast<size_t>( kind ) ] > 0; }
+
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  /** \brief Take a token for \a kind from \a address's bucket if there is one.
+
+      The time is a parameter only so that tests can advance it.
+   */
+  bool tryAcquire( const Address&, Kind, TimePoint now = std::chrono::steady_clock::now() );
+
+  /** \brief The number of client addresses currently tracked. */
+  size_t numAddresses() const;
+
+private:
+  struct Bucket
+  {
+    double tokens;
+    TimePoint refilled;
+  };
+
+  struct Entry
+  {
+    std::array<Bucket, static_cast<size_t>( Kind::eNumKinds )> buckets;
+    TimePoint lastUsed;
+  };
+
+  struct AddressHash
+  {
+    size_t operator()( const Address& ) const;
+  };
+
+  struct alignas( 64 ) Shard
+  {
+    mutable std::mutex mutex;
+    std::unordered_map<Address, Entry, AddressHash> entries;
+    size_t sweepBucket{ 0 }; //!< Where the next sweep starts
+  };
+
+  static constexpr size_t numShards{ 16 };
+
+  /** \brief Hash buckets visited per sweep, keeping each lookup's share of
+             the work constant however many clients there are.
+   */
+  static constexpr size_t numSweepBuckets{ 4 };
+
+  Shard& shard( const Address& );
+
+  void sweep( Shard&, TimePoint now );
+
+  /** \brief Forget the least recently used of a few entries in \a shard. */
+  void evict( Shard& );
+
+  std::array<double, static_cast<size_t>( Kind::eNumKinds )> rates;
+  std::array<double, static_cast<size_t>( Kind::eNumKinds )> bursts;
+
+  // Long enough for any bucket to refill completely.
+  std::chrono::steady_clock::duration idleExpiry;
+
+  size_t maxEntriesPerShard; //!< Zero for no limit
+
+  std::array<Shard, numShards> shards;
+};
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_RATELIMITER_H
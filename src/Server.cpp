@@ -17,12 +17,14 @@
 
 #include <lb/httpd/Server.h>
 
+#include <algorithm>
 #include <atomic>
+#include <charconv>
 #include <cstring>
-#include <iostream>
 #include <mutex>
 #include <poll.h>
 #include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -33,8 +35,17 @@
 // Not available on my system at time of writing :(
 //#include <microhttpd_ws.h>
 
-#include "Poller.h"
+#include "AccessLogWriter.h"
+#include "AdmissionControl.h"
+#include "Listener.h"
+#include "LoggingImpl.h"
+#include "Metrics.h"
+#include "RateLimiter.h"
+#include "Tracepoints.h"
+#include "Tracer.h"
 #include "WebSocket.h"
+#include "WebSockets.h"
+#include "ws/ReactorImpl.h"
 #include "ws/SendersImpl.h"
 
 
@@ -46,26 +57,142 @@ namespace httpd
 {
 
 
-// Library-wide counter i.e. shared by all Server instances effectively.
-ws::ConnectionID globalConnectionID{ 0 };
+// Library-wide counter i.e. shared by all Server instances effectively, whose
+// upgrade handlers run on their own MHD threads.
+std::atomic<ws::ConnectionID> globalConnectionID{ 0 };
+
+/** \brief Make sure IDs handed out from now on are at least \a id. */
+static
+void raiseGlobalConnectionID( ws::ConnectionID id )
+{
+  auto next{ globalConnectionID.load( std::memory_order_relaxed ) };
+  while ( ( next < id )
+       && !globalConnectionID.compare_exchange_weak( next, id, std::memory_order_relaxed ) )
+  {
+  }
+}
+
+
+struct ConnectionContext
+{
+  std::string url;
+  MHD_PostProcessor* pp{ nullptr };
+  WebSocket::TimePoint start;
+  uint64_t numBytesIn{ 0 };
+  std::unique_ptr<Server::Trace> trace; //!< Only if this request is sampled
+
+  void addStage( Server::Trace::Stage stage )
+  {
+    if ( trace )
+    {
+      trace->stages.emplace_back( stage, std::chrono::steady_clock::now() );
+    }
+  }
+};
+
+/** \brief Per TCP connection, as opposed to per request, state.
+
+    Only created when tracing or admission control need it. MHD handles one
+    request at a time per connection so this also tracks the current request.
+ */
+struct ConnectionState
+{
+  WebSocket::TimePoint accepted;
+  std::unique_ptr<Server::Trace> trace; //!< Queued response awaiting completion
+
+  bool admitted{ false };            //!< Counted by admission control
+  WebSocket::TimePoint requestStart; //!< When admitted
+};
+
+static
+ConnectionState* connectionState( MHD_Connection* connection )
+{
+  const MHD_ConnectionInfo*const info
+  {
+    MHD_get_connection_info( connection, MHD_CONNECTION_INFO_SOCKET_CONTEXT )
+  };
+  return info ? (ConnectionState*)info->socket_context : nullptr;
+}
+
+static
+const sockaddr* clientAddress( MHD_Connection* connection )
+{
+  const MHD_ConnectionInfo*const info
+  {
+    MHD_get_connection_info( connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS )
+  };
+  return info ? info->client_addr : nullptr;
+}
 
 
 struct Server::Private
 {
   Private( Config
          , RequestHandler rh
-         , std::optional<ws::Handler> wsh );
+         , std::optional<ws::Handler> wsh
+         , std::shared_ptr<ws::Reactor> sharedReactor );
   Private( Config
          , std::string httpsCert
          , std::string httpsPrivateKey
          , RequestHandler rh
-         , std::optional<ws::Handler> wsh );
+         , std::optional<ws::Handler> wsh
+         , std::shared_ptr<ws::Reactor> sharedReactor );
   ~Private();
 
   /** \brief Called on construction. Throws a runtime error if there is an issue. */
   static Config sanityCheck( Config );
 
+  static std::unique_ptr<AccessLogWriter> createAccessLog( const Config& );
+
+  /** \brief Start MHD with the options common to HTTP and HTTPS plus \a extraOptions. */
+  MHD_Daemon* startDaemon( unsigned int flags
+                         , std::vector<MHD_OptionItem> extraOptions );
+
+  static void connectionNotify( void* userData
+                              , MHD_Connection*
+                              , void** socketContext
+                              , MHD_ConnectionNotificationCode );
+
+  static void requestCompleted( void* userData
+                              , MHD_Connection*
+                              , void** connectionContext
+                              , MHD_RequestTerminationCode );
+
+  /** \brief Record the response as queued and hold the trace until it completes. */
+  void responseQueued( MHD_Connection*, ConnectionContext& );
+
+  /** \brief Admission control, on the first call for a request. */
+  bool admit( MHD_Connection*, const char* url );
+  void releaseAdmission( ConnectionState& );
+
+  /** \brief Per client rate limits, on the first call for a request. */
+  bool withinRateLimit( MHD_Connection* );
+
+  /** \brief Give Config::preBodyHook the chance to answer before the body is read. */
+  std::optional<Response> invokePreBodyHook( MHD_Connection*, const char* url, Method );
+
+  /** \brief Reject a request with 429 or 503 and a Retry-After header. */
+  static MHD_Result queueRetryLaterResponse( Private*
+                                           , MHD_Connection*
+                                           , const char* url
+                                           , Method
+                                           , unsigned int statusCode
+                                           , std::chrono::seconds retryAfter );
+
+  /** \brief Maybe sample this request, on the first call for it. */
+  void startTrace( MHD_Connection*, ConnectionContext&, const char* url, Method );
+
+  void logRequest( const ConnectionContext&
+                 , const char* url
+                 , Method
+                 , unsigned int statusCode
+                 , size_t numBytesOut );
+  void logWebSocketClose( const WebSocket& );
+
   MHD_Response* maybeCreateWebSocketResponse( const char* url, Method, Version );
+  MHD_Response* maybeCreateMetricsResponse( const char* url
+                                          , Method
+                                          , size_t& numBytes ) const;
 
   bool isHeaderSet( const std::string& ) const;
   bool isHeaderSetTo( const std::string&, const std::string& ) const;
@@ -93,6 +220,16 @@ struct Server::Private
                             , MHD_socket socket
                             , MHD_UpgradeResponseHandle* upgradeHandle );
 
+  /** \brief Create and announce a WebSocket. Call with \a webSocketMutex held. */
+  WebSocket* openWebSocket( ws::ConnectionID
+                          , std::string url
+                          , std::optional<RateLimiter::Address> clientAddress
+                          , MHD_socket
+                          , MHD_UpgradeResponseHandle* );
+
+  /** \brief Called with the Reactor loops stopped, see Server::migrateWebSockets. */
+  size_t migrateWebSocketsNow( int channel );
+
   static MHD_Result accessHandlerCallback( void* cls
                                          , MHD_Connection*
                                          , const char* url
@@ -108,12 +245,50 @@ struct Server::Private
                                , Version
                                , std::string );
 
-  void webSocketLoop();
+  /** \brief The Reactor to poll our WebSockets with, null without a ws::Handler. */
+  static std::shared_ptr<ws::Reactor> chooseReactor( const Config&
+                                                   , bool haveWebSocketHandler
+                                                   , std::shared_ptr<ws::Reactor> sharedReactor );
+
+  ws::Reactor::Impl& reactorImpl() const
+  {
+    return ws::Reactor::Impl::get( *reactor );
+  }
+
+  /** \brief Called on a Reactor loop after each poll. */
+  void afterPoll( size_t loop, const ws::Reactor::Impl::Pass& );
+
+  /** \brief How long a Reactor loop may sleep between passes for our sake. */
+  int webSocketLoopTimeout() const;
+
   void webSocketClosed( ws::ConnectionID );
 
+  /** \brief Called on a loop after each poll, samples all connections if it is time. */
+  void maybeSampleConnectionStats();
+
 
   Config config;
 
+  // Before mhd as MHD's thread starts recording into it straight away.
+  metrics::Metrics metrics;
+
+  std::unique_ptr<AccessLogWriter> accessLog; //!< Null if not enabled
+
+  Tracer tracer;
+
+  AdmissionControl admission;
+
+  RateLimiter rateLimiter;
+
+  /** \brief Set while we own the file for Config::unixSocketPath. Before mhd
+             as that sets it.
+   */
+  bool removeUnixSocketPath{ false };
+
+  /** \brief Before mhd as WebSockets may be upgraded as soon as that starts. */
+  std::shared_ptr<ws::Reactor> reactor;
+  ws::Reactor::Impl::ClientID reactorClient;
+
   MHD_Daemon*const mhd;
 
   RequestHandler requestHandler;
@@ -124,17 +299,20 @@ struct Server::Private
   Headers       headers;
   PostKeyValues postKeyValues;
 
-  using WebSockets = std::unordered_map< ws::ConnectionID, WebSocket >;
   WebSockets webSockets;
 
+  // Closes may be reported from any thread, and are removed by the loop that
+  // polls the connection.
   using ClosedWebSockets = std::unordered_set< ws::ConnectionID >;
+  std::mutex closedWebSocketsMutex;
   ClosedWebSockets closedWebSockets;
 
-  std::thread webSocketThread;
-  std::mutex  webSocketMutex;
-  std::atomic<bool> webSocketRunning{ true };
+  mutable std::mutex webSocketMutex;
+
+  bool tls{ false };
 
-  Poller poller;
+  std::mutex connectionStatsMutex; //!< Held by the loop that is sampling
+  WebSocket::TimePoint lastConnectionStatsTime;
 };
 
 
@@ -189,20 +367,40 @@ Server::Version parseVersion( const char* versionStr )
 }
 
 
+static
+unsigned int daemonThreadingFlag( const Server::Config& config )
+{
+  // In external mode MHD is driven from Server::runOnce and only needs to
+  // expose an epoll fd for the application to wait on.
+  return config.externalEventLoop ? MHD_USE_EPOLL : MHD_USE_INTERNAL_POLLING_THREAD;
+}
+
+static
+unsigned int webSocketMigrationFlag( const Server::Config& config )
+{
+  // Without this MHD does shutdown(2) on closing a connection, which would cut
+  // off the copy of the socket passed to another process too. Plain HTTP only,
+  // as with TLS MHD must shut the session down itself.
+  return config.webSocketMigration ? MHD_USE_TURBO : 0;
+}
+
+
 Server::Private::Private( Config config
                         , RequestHandler rh
-                        , std::optional<ws::Handler> wsh )
+                        , std::optional<ws::Handler> wsh
+                        , std::shared_ptr<ws::Reactor> sharedReactor )
   : config{ sanityCheck( std::move( config ) ) }
-  , mhd{ MHD_start_daemon( MHD_USE_INTERNAL_POLLING_THREAD
-                         | MHD_USE_ERROR_LOG
-                         | MHD_ALLOW_UPGRADE
-                         | MHD_ALLOW_SUSPEND_RESUME
-                         , config.port
-                         , nullptr // accept policy callback not required
-                         , nullptr // accept policy callback user data
-                         , &accessHandlerCallback
-                         , this
-                         , MHD_OPTION_END ) }
+  , accessLog{ createAccessLog( this->config ) }
+  , tracer{ this->config.traceSampleRate, this->config.traceBufferSize }
+  , admission{ this->config.admissionControl }
+  , rateLimiter{ this->config.rateLimit }
+  , reactor{ chooseReactor( this->config, wsh.has_value(), std::move( sharedReactor ) ) }
+  , mhd{ startDaemon( daemonThreadingFlag( this->config )
+                    | MHD_USE_ERROR_LOG
+                    | MHD_ALLOW_UPGRADE
+                    | MHD_ALLOW_SUSPEND_RESUME
+                    | webSocketMigrationFlag( this->config )
+                    , {} ) }
   , requestHandler{ std::move( rh ) }
   , webSocketHandler{ std::move( wsh ) }
 {
@@ -211,37 +409,43 @@ Server::Private::Private( Config config
     throw std::runtime_error( "No HTTP request handler specified" );
   }
 
-  if ( webSocketHandler )
-  {
-    webSocketThread = std::move( std::thread{ std::bind( &Private::webSocketLoop
-                                                       , this ) } );
-  }
+  metrics.receiverBudget = this->config.receiverBudget;
+  metrics.slowReceiverCallback = this->config.slowReceiverCallback;
 
   if ( !mhd )
   {
     throw std::runtime_error( "Failed to create HTTP MHD server" );
   }
+
+  if ( reactor )
+  {
+    reactorClient = reactorImpl().attach( std::bind( &Private::afterPoll
+                                                   , this
+                                                   , std::placeholders::_1
+                                                   , std::placeholders::_2 )
+                                        , webSocketLoopTimeout() );
+  }
 }
 
 Server::Private::Private( Config config
                         , std::string httpsCert
                         , std::string httpsPrivateKey
                         , RequestHandler rh
-                        , std::optional<ws::Handler> wsh )
+                        , std::optional<ws::Handler> wsh
+                        , std::shared_ptr<ws::Reactor> sharedReactor )
   : config{ sanityCheck( std::move( config ) ) }
-  , mhd{ MHD_start_daemon( MHD_USE_INTERNAL_POLLING_THREAD
-                         | MHD_USE_ERROR_LOG
-                         | MHD_ALLOW_UPGRADE
-                         | MHD_ALLOW_SUSPEND_RESUME
-                         | MHD_USE_TLS
-                         , config.port
-                         , nullptr // accept policy callback not required
-                         , nullptr // accept policy callback user data
-                         , &accessHandlerCallback
-                         , this
-                         , MHD_OPTION_HTTPS_MEM_CERT, httpsCert.c_str()
-                         , MHD_OPTION_HTTPS_MEM_KEY, httpsPrivateKey.c_str()
-                         , MHD_OPTION_END ) }
+  , accessLog{ createAccessLog( this->config ) }
+  , tracer{ this->config.traceSampleRate, this->config.traceBufferSize }
+  , admission{ this->config.admissionControl }
+  , rateLimiter{ this->config.rateLimit }
+  , reactor{ chooseReactor( this->config, wsh.has_value(), std::move( sharedReactor ) ) }
+  , mhd{ startDaemon( daemonThreadingFlag( this->config )
+                    | MHD_USE_ERROR_LOG
+                    | MHD_ALLOW_UPGRADE
+                    | MHD_ALLOW_SUSPEND_RESUME
+                    | MHD_USE_TLS
+                    , { { MHD_OPTION_HTTPS_MEM_CERT, 0, (void*)httpsCert.c_str() }
+                      , { MHD_OPTION_HTTPS_MEM_KEY, 0, (void*)httpsPrivateKey.c_str() } } ) }
   , requestHandler{ std::move( rh ) }
   , webSocketHandler{ std::move( wsh ) }
 {
@@ -250,41 +454,70 @@ Server::Private::Private( Config config
     throw std::runtime_error( "No HTTPS request handler specified" );
   }
 
-  if ( webSocketHandler )
-  {
-    webSocketThread = std::move( std::thread{ std::bind( &Private::webSocketLoop
-                                                       , this ) } );
-  }
+  tls = true;
+
+  metrics.receiverBudget = this->config.receiverBudget;
+  metrics.slowReceiverCallback = this->config.slowReceiverCallback;
 
   if ( !mhd )
   {
     throw std::runtime_error( "Failed to create HTTPS MHD server" );
   }
+
+  if ( reactor )
+  {
+    reactorClient = reactorImpl().attach( std::bind( &Private::afterPoll
+                                                   , this
+                                                   , std::placeholders::_1
+                                                   , std::placeholders::_2 )
+                                        , webSocketLoopTimeout() );
+  }
 }
 
 Server::Private::~Private()
 {
-  // Stop polling for data
-  webSocketRunning = false;
-  if ( webSocketThread.joinable() )
+  // Stop polling for data. Once detached no loop calls us back, and once all
+  // loops have finished the pass they are in none is still in a WebSocket.
+  if ( reactor )
   {
-    webSocketThread.join();
+    reactorImpl().detach( reactorClient );
+    {
+      std::scoped_lock l{ webSocketMutex };
+      webSockets.forEach( [this]( WebSocket& ws )
+      {
+        reactorImpl().remove( ws.socket );
+      } );
+    }
+    reactorImpl().exclusive( []{} );
   }
 
   // Close any WebSocket connections that have not been closed by the client.
-  for ( auto&[id, ws] : webSockets )
+  webSockets.forEach( [this]( WebSocket& ws )
   {
     ws.closeConnection( encoding::websocket::closestatus::ProtocolCode::eGoingAway );
-  }
+    logWebSocketClose( ws );
+  } );
   webSockets.clear();
 
   MHD_stop_daemon( mhd );
+
+  if ( removeUnixSocketPath )
+  {
+    unlink( config.unixSocketPath.c_str() );
+  }
 }
 
 // static
 Server::Config Server::Private::sanityCheck( Config config )
 {
-  if ( ( config.port < 1 ) || ( config.port > 65535 ) )
+  if ( ( config.listenSocket != MHD_INVALID_SOCKET ) && !config.unixSocketPath.empty() )
+  {
+    throw std::runtime_error{ "Only one of listenSocket and unixSocketPath may be given." };
+  }
+
+  if ( ( config.listenSocket == MHD_INVALID_SOCKET )
+    && config.unixSocketPath.empty()
+    && ( ( config.port < 1 ) || ( config.port > 65535 ) ) )
   {
     throw std::runtime_error{ "Invalid port number specified. Needs to be in the range 1 to 65535." };
   }
@@ -294,173 +527,723 @@ Server::Config Server::Private::sanityCheck( Config config )
     throw std::runtime_error{ "Invalid maximum socket bytes to receive. Needs to be greater than zero." };
   }
 
-  return config;
-}
-
-MHD_Response* Server::Private::maybeCreateWebSocketResponse( const char* url
-                                                           , Method method
-                                                           , Version version )
-{
-  if ( !webSocketHandler )
+  if ( config.connectionStatsInterval.count() < 0 )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid connection stats interval. Needs to be zero or greater." };
   }
 
-  if ( !webSocketHandler->isHandled( url ) )
+  const auto& admission{ config.admissionControl };
+  if ( admission.enabled
+    && ( ( admission.minLimit < 1 )
+      || ( admission.minLimit > admission.initialLimit )
+      || ( admission.initialLimit > admission.maxLimit ) ) )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid admission control limits. Need 1 <= min <= initial <= max." };
   }
 
-  // Examine headers. Should look something like:
-  //
-  // Host: localhost:4567
-  // Accept: */*
-  // Upgrade: websocket
-  // Connection: Upgrade
-  // Sec-WebSocket-Version: 13
-  // Sec-WebSocket-Key: ZHEJMUkToewFjjdufVsStQ==
-  if ( method != Method::eGet )
+  if ( admission.enabled && ( admission.tolerance < 1.0 ) )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid admission control tolerance. Needs to be at least 1." };
   }
-  else if ( !isHeaderSet( MHD_HTTP_HEADER_HOST ) )
+
+  const auto& rateLimit{ config.rateLimit };
+  if ( ( ( rateLimit.requestsPerSecond > 0 ) && ( rateLimit.requestBurst < 1 ) )
+    || ( ( rateLimit.upgradesPerSecond > 0 ) && ( rateLimit.upgradeBurst < 1 ) )
+    || ( ( rateLimit.messagesPerSecond > 0 ) && ( rateLimit.messageBurst < 1 ) ) )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid rate limit burst. Needs to be at least 1 when the rate is set." };
   }
-  else if ( !isHeaderSetTo( MHD_HTTP_HEADER_UPGRADE, "websocket" ) )
+
+  if ( ( config.reusePortCpuShards > 0 ) && !config.reusePort )
   {
-    return nullptr;
+    throw std::runtime_error{ "Reuseport CPU steering needs reusePort to be set." };
   }
-  else if ( !isHeaderSetTo( "Connection", "Upgrade" ) )
+
+  const auto& tuning{ config.tuning };
+  if ( ( tuning.connectionMemoryLimit > 0 )
+    && ( tuning.connectionMemoryIncrement > tuning.connectionMemoryLimit ) )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid connection memory increment. Needs to be no more than the limit." };
   }
-  else if ( !isHeaderSet( "Sec-WebSocket-Version" ) )
+
+  if ( tuning.connectionTimeout.count() < 0 )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid connection timeout. Needs to be zero or greater." };
   }
-  else if ( !isHeaderSet( MHD_HTTP_HEADER_SEC_WEBSOCKET_KEY ) )
+
+  // MHD requires at least 256 bytes.
+  if ( tuning.postProcessorBufferSize < 256 )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid POST processor buffer size. Needs to be at least 256." };
   }
-  else if ( ( version.major  < 1 )
-         || ( version.major == 1 ) && ( version.minor < 1 ) )
+
+  if ( tuning.webSocketCloseTimeout.count() <= 0 )
   {
-    return nullptr;
+    throw std::runtime_error{ "Invalid WebSocket close timeout. Needs to be greater than zero." };
   }
 
-  MHD_Response*const mhdResponse
+  if ( config.receiverBudget.count() < 0 )
   {
-    MHD_create_response_for_upgrade( &upgradeHandler, this )
-  };
+    throw std::runtime_error{ "Invalid receiver budget. Needs to be zero or greater." };
+  }
 
-  /**
-   * For the response we need at least the following headers:
-   * 1. "Connection: Upgrade"
-   * 2. "Upgrade: websocket"
-   * 3. "Sec-WebSocket-Accept: <base64value>"
-   * The value for Sec-WebSocket-Accept can be generated with MHD_websocket_create_accept_header.
-   * It requires the value of the Sec-WebSocket-Key header of the request.
-   * See also: https://tools.ietf.org/html/rfc6455#section-4.2.2
-   */
-  MHD_add_response_header( mhdResponse
-                         , MHD_HTTP_HEADER_UPGRADE
-                         , "websocket" );
-  // Header is known to exist from check above
-  std::string acceptResponse{ headers[ MHD_HTTP_HEADER_SEC_WEBSOCKET_KEY ] };
+  return config;
+}
 
-  // If we had websocket support we could use MHD_websocket_create_accept_header
-  acceptResponse.append( "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" );
-  acceptResponse = encoding::sha1::encode( acceptResponse );
-  acceptResponse = encoding::base64::encode( acceptResponse );
-  MHD_add_response_header( mhdResponse
-                         , MHD_HTTP_HEADER_SEC_WEBSOCKET_ACCEPT
-                         , acceptResponse.c_str() );
+// static
+std::shared_ptr<ws::Reactor>
+Server::Private::chooseReactor( const Config& config
+                              , bool haveWebSocketHandler
+                              , std::shared_ptr<ws::Reactor> sharedReactor )
+{
+  if ( !haveWebSocketHandler )
+  {
+    return {};
+  }
 
-  return mhdResponse;
-}
+  if ( config.externalEventLoop )
+  {
+    if ( sharedReactor )
+    {
+      throw std::runtime_error{ "A shared ws::Reactor cannot be used with an external event loop" };
+    }
+    return ws::Reactor::Impl::createUnthreaded();
+  }
 
+  if ( sharedReactor )
+  {
+    return sharedReactor;
+  }
 
-bool Server::Private::isHeaderSet( const std::string& header ) const
-{
-  return headers.count( header ) > 0;
+  return std::make_shared<ws::Reactor>( config.webSocketLoopScaling );
 }
 
-bool Server::Private::isHeaderSetTo( const std::string& header
-                                   , const std::string& value ) const
+MHD_Daemon* Server::Private::startDaemon( unsigned int flags
+                                        , std::vector<MHD_OptionItem> options )
 {
-  const auto I{ headers.find( header ) };
-  return ( I != headers.end() ) && ( I->second == value );
-}
+  const auto& tuning{ config.tuning };
+  if ( tuning.connectionLimit > 0 )
+  {
+    options.push_back( { MHD_OPTION_CONNECTION_LIMIT, (intptr_t)tuning.connectionLimit, nullptr } );
+  }
+  if ( tuning.connectionMemoryLimit > 0 )
+  {
+    options.push_back( { MHD_OPTION_CONNECTION_MEMORY_LIMIT, (intptr_t)tuning.connectionMemoryLimit, nullptr } );
+  }
+  if ( tuning.connectionMemoryIncrement > 0 )
+  {
+    options.push_back( { MHD_OPTION_CONNECTION_MEMORY_INCREMENT, (intptr_t)tuning.connectionMemoryIncrement, nullptr } );
+  }
+  if ( tuning.listenBacklog > 0 )
+  {
+    options.push_back( { MHD_OPTION_LISTEN_BACKLOG_SIZE, (intptr_t)tuning.listenBacklog, nullptr } );
+  }
+  if ( tuning.connectionTimeout.count() > 0 )
+  {
+    options.push_back( { MHD_OPTION_CONNECTION_TIMEOUT, (intptr_t)tuning.connectionTimeout.count(), nullptr } );
+  }
 
-struct ConnectionContext
-{
-  std::string url;
-  MHD_PostProcessor* pp{ nullptr };
-};
+  MHD_socket listenSocket{ config.listenSocket };
+  if ( !config.unixSocketPath.empty() )
+  {
+    listenSocket = listener::listenUnix( config.unixSocketPath, tuning.listenBacklog );
+    removeUnixSocketPath = ( config.unixSocketPath[0] != '@' );
+  }
 
-// static
-MHD_Result Server::Private::accessHandlerCallback( void* userData
-                                                 , MHD_Connection* connection
-                                                 , const char* url
-                                                 , const char* methodStr
-                                                 , const char* versionStr
-                                                 , const char* uploadData
-                                                 , size_t* uploadDataSize
-                                                 , void** connectionContext )
-{
-  auto server = (Private*)userData;
+  if ( listenSocket != MHD_INVALID_SOCKET )
+  {
+    options.push_back( { MHD_OPTION_LISTEN_SOCKET, (intptr_t)listenSocket, nullptr } );
+  }
 
-//  std::cout << "URL:              " << url << '\n';
-//  std::cout << "Method:           " << methodStr << '\n';
-//  std::cout << "Version:          " << versionStr << '\n';
-//  std::cout << "Upload data size: " << *uploadDataSize << '\n';
-//  std::cout << "Upload data:      ";
-//  if ( uploadData )
-//  {
-//    std::cout << std::string{ uploadData, *uploadDataSize } << '\n';
-//  }
-//  else
-//  {
-//    std::cout << "<null>\n";
-//  }
-//  std::cout << std::flush;
+  if ( config.reusePort )
+  {
+    options.push_back( { MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, nullptr } );
+  }
 
-  const auto method{ parseMethod( methodStr ) };
-  if ( method == Method::eInvalid )
+  if ( config.rateLimit.connectionsPerAddress > 0 )
   {
-    return MHD_NO;
+    options.push_back( { MHD_OPTION_PER_IP_CONNECTION_LIMIT
+                       , (intptr_t)config.rateLimit.connectionsPerAddress
+                       , nullptr } );
   }
 
-  const auto version{ parseVersion( versionStr ) };
-  if ( version.major < 0 )
+  if ( tracer.enabled() || admission.enabled() )
   {
-    return MHD_NO;
+    options.push_back( { MHD_OPTION_NOTIFY_CONNECTION, (intptr_t)&connectionNotify, this } );
+    options.push_back( { MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)&requestCompleted, this } );
   }
+  options.push_back( { MHD_OPTION_END, 0, nullptr } );
 
-  //std::cout << "HEADERS:" << std::endl;
-  MHD_get_connection_values( connection, MHD_HEADER_KIND, &keyValueIterator, server );
+  MHD_Daemon*const daemon
+  {
+    MHD_start_daemon( flags
+                    , ( listenSocket != MHD_INVALID_SOCKET ) ? 0 : config.port
+                    , nullptr // accept policy callback not required
+                    , nullptr // accept policy callback user data
+                    , &accessHandlerCallback
+                    , this
+                    , MHD_OPTION_ARRAY, options.data()
+                    , MHD_OPTION_END )
+  };
 
-  if ( !*connectionContext )
+  if ( !daemon && !config.unixSocketPath.empty() )
   {
-    // First invocation for this connection so set things up as required.
-    ConnectionContext*const cc{ new ConnectionContext };
-    *connectionContext = cc;
+    close( listenSocket );
+    removeUnixSocketPath = false;
+  }
 
-    cc->url = url;
-    if ( method == Method::ePost )
+  if ( daemon && ( config.reusePortCpuShards > 0 ) )
+  {
+    const MHD_DaemonInfo*const info
     {
-      cc->pp = MHD_create_post_processor( connection
-                                        , 1024 * 32
-                                        , &postDataIterator
-                                        , userData );
-      if ( !cc->pp )
+      MHD_get_daemon_info( daemon, MHD_DAEMON_INFO_LISTEN_FD )
+    };
+    try
+    {
+      if ( !info )
       {
-        std::cerr << "Failed to create POST processor!" << std::endl;
+        throw std::runtime_error{ "No listening socket for reuseport CPU steering" };
       }
+      listener::attachCpuSteering( info->listen_fd, config.reusePortCpuShards );
     }
+    catch ( ... )
+    {
+      MHD_stop_daemon( daemon );
+      throw;
+    }
+  }
 
-    // Return now and we get called again. No, I don't know either.
+  return daemon;
+}
+
+// static
+void Server::Private::connectionNotify( void* userData
+                                      , MHD_Connection* connection
+                                      , void** socketContext
+                                      , MHD_ConnectionNotificationCode code )
+{
+  switch ( code )
+  {
+  case MHD_CONNECTION_NOTIFY_STARTED:
+    *socketContext = new ConnectionState{ std::chrono::steady_clock::now() };
+    break;
+  case MHD_CONNECTION_NOTIFY_CLOSED:
+  {
+    auto server = (Private*)userData;
+    auto state = (ConnectionState*)(*socketContext);
+    if ( state && state->admitted )
+    {
+      server->admission.abandon();
+    }
+    delete state;
+    *socketContext = nullptr;
+    break;
+  }
+  }
+}
+
+// static
+void Server::Private::requestCompleted( void* userData
+                                      , MHD_Connection* connection
+                                      , void** connectionContext
+                                      , MHD_RequestTerminationCode )
+{
+  auto server = (Private*)userData;
+
+  ConnectionState*const state{ connectionState( connection ) };
+  if ( state && state->admitted )
+  {
+    server->releaseAdmission( *state );
+  }
+  if ( state && state->trace )
+  {
+    state->trace->stages.emplace_back( Trace::Stage::eResponseCompleted
+                                     , std::chrono::steady_clock::now() );
+    server->tracer.push( std::move( *state->trace ) );
+    state->trace.reset();
+  }
+}
+
+bool Server::Private::admit( MHD_Connection* connection, const char* url )
+{
+  if ( !admission.enabled() || admission.isPriorityPath( url ) )
+  {
+    return true;
+  }
+
+  ConnectionState*const state{ connectionState( connection ) };
+  if ( !state )
+  {
+    return true;
+  }
+
+  if ( !admission.tryAcquire() )
+  {
+    return false;
+  }
+
+  state->admitted = true;
+  state->requestStart = std::chrono::steady_clock::now();
+  return true;
+}
+
+void Server::Private::releaseAdmission( ConnectionState& state )
+{
+  admission.release( std::chrono::steady_clock::now() - state.requestStart );
+  state.admitted = false;
+}
+
+bool Server::Private::withinRateLimit( MHD_Connection* connection )
+{
+  const bool limitRequests{ rateLimiter.enabled( RateLimiter::Kind::eRequest ) };
+  const bool limitUpgrades{ rateLimiter.enabled( RateLimiter::Kind::eUpgrade ) };
+  if ( !limitRequests && !limitUpgrades )
+  {
+    return true;
+  }
+
+  const auto address{ RateLimiter::address( clientAddress( connection ) ) };
+  if ( !address )
+  {
+    return true;
+  }
+
+  if ( limitRequests && !rateLimiter.tryAcquire( *address, RateLimiter::Kind::eRequest ) )
+  {
+    return false;
+  }
+
+  return !limitUpgrades
+      || !MHD_lookup_connection_value( connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_UPGRADE )
+      || rateLimiter.tryAcquire( *address, RateLimiter::Kind::eUpgrade );
+}
+
+std::optional<Server::Response> Server::Private::invokePreBodyHook( MHD_Connection* connection
+                                                                  , const char* url
+                                                                  , Method method )
+{
+  std::optional<uint64_t> contentLength;
+
+  const char*const value
+  {
+    MHD_lookup_connection_value( connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH )
+  };
+  if ( value )
+  {
+    const char*const end{ value + std::strlen( value ) };
+    uint64_t n{ 0 };
+    const auto[ ptr, ec ]{ std::from_chars( value, end, n ) };
+    if ( ( ec == std::errc{} ) && ( ptr == end ) )
+    {
+      contentLength = n;
+    }
+  }
+
+  auto response{ config.preBodyHook( url, method, headers, contentLength ) };
+  if ( response )
+  {
+    // There will be no call to the request handler to take these.
+    headers.clear();
+  }
+  return response;
+}
+
+// static
+MHD_Result Server::Private::queueRetryLaterResponse( Private* server
+                                                   , MHD_Connection* connection
+                                                   , const char* url
+                                                   , Method method
+                                                   , unsigned int statusCode
+                                                   , std::chrono::seconds retryAfter )
+{
+  static const std::string tooManyRequests{ "Too Many Requests" };
+  static const std::string serviceUnavailable{ "Service Unavailable" };
+
+  const std::string& content
+  {
+    ( statusCode == MHD_HTTP_TOO_MANY_REQUESTS ) ? tooManyRequests : serviceUnavailable
+  };
+
+  MHD_Response*const mhdResponse
+  {
+    MHD_create_response_from_buffer( content.size()
+                                   , (void*)content.c_str()
+                                   , MHD_RESPMEM_PERSISTENT )
+  };
+  if ( !mhdResponse )
+  {
+    return MHD_NO;
+  }
+
+  const std::string retryAfterSeconds{ std::to_string( retryAfter.count() ) };
+  MHD_add_response_header( mhdResponse, MHD_HTTP_HEADER_RETRY_AFTER, retryAfterSeconds.c_str() );
+
+  const auto result
+  {
+    MHD_queue_response( connection, statusCode, mhdResponse )
+  };
+
+  MHD_destroy_response( mhdResponse );
+
+  server->metrics.recordHttpRequest( method, statusCode );
+
+  // There will be no call to the request handler to take these.
+  server->headers.clear();
+
+  ConnectionContext cc;
+  cc.start = std::chrono::steady_clock::now();
+  server->logRequest( cc, url, method, statusCode, content.size() );
+
+  LB_HTTPD_TRACE( request__end, url, static_cast<int>( method ), statusCode );
+
+  return result;
+}
+
+void Server::Private::startTrace( MHD_Connection* connection
+                                , ConnectionContext& cc
+                                , const char* url
+                                , Method method )
+{
+  cc.trace = tracer.sample();
+  if ( !cc.trace )
+  {
+    return;
+  }
+
+  cc.trace->method = method;
+  cc.trace->url = url;
+
+  ConnectionState*const state{ connectionState( connection ) };
+  if ( state )
+  {
+    cc.trace->stages.emplace_back( Trace::Stage::eAccepted, state->accepted );
+  }
+  cc.trace->stages.emplace_back( Trace::Stage::eHeadersParsed, cc.start );
+}
+
+void Server::Private::responseQueued( MHD_Connection* connection, ConnectionContext& cc )
+{
+  if ( !cc.trace )
+  {
+    return;
+  }
+
+  cc.addStage( Trace::Stage::eResponseQueued );
+
+  ConnectionState*const state{ connectionState( connection ) };
+  if ( state )
+  {
+    state->trace = std::move( cc.trace );
+  }
+  else
+  {
+    tracer.push( std::move( *cc.trace ) );
+    cc.trace.reset();
+  }
+}
+
+// static
+std::unique_ptr<AccessLogWriter> Server::Private::createAccessLog( const Config& config )
+{
+  if ( config.accessLogPath.empty() )
+  {
+    return {};
+  }
+
+  return std::make_unique<AccessLogWriter>( config.accessLogPath, config.accessLogCapacity );
+}
+
+void Server::Private::logRequest( const ConnectionContext& cc
+                                , const char* url
+                                , Method method
+                                , unsigned int statusCode
+                                , size_t numBytesOut )
+{
+  if ( !accessLog )
+  {
+    return;
+  }
+
+  const auto duration{ std::chrono::steady_clock::now() - cc.start };
+  accessLog->write( accesslog::RecordType::eHttpRequest
+                  , 0
+                  , static_cast<uint8_t>( method )
+                  , statusCode
+                  , url
+                  , cc.numBytesIn
+                  , numBytesOut
+                  , std::chrono::duration_cast<std::chrono::microseconds>( duration ).count() );
+}
+
+void Server::Private::logWebSocketClose( const WebSocket& webSocket )
+{
+  if ( !accessLog )
+  {
+    return;
+  }
+
+  const auto lifetime{ std::chrono::steady_clock::now() - webSocket.cold->openedTimePoint };
+  const auto reason{ webSocket.cold->closeReason.value_or( metrics::CloseReason::eShutdown ) };
+  accessLog->write( accesslog::RecordType::eWebSocketClose
+                  , webSocket.connectionID
+                  , static_cast<uint8_t>( Method::eGet )
+                  , static_cast<uint16_t>( reason )
+                  , webSocket.cold->urlPath
+                  , webSocket.bytesReceived
+                  , webSocket.bytesSent.load( std::memory_order_relaxed )
+                  , std::chrono::duration_cast<std::chrono::microseconds>( lifetime ).count() );
+}
+
+MHD_Response* Server::Private::maybeCreateWebSocketResponse( const char* url
+                                                           , Method method
+                                                           , Version version )
+{
+  if ( !webSocketHandler )
+  {
+    return nullptr;
+  }
+
+  if ( !webSocketHandler->isHandled( url ) )
+  {
+    return nullptr;
+  }
+
+  // Examine headers. Should look something like:
+  //
+  // Host: localhost:4567
+  // Accept: */*
+  // Upgrade: websocket
+  // Connection: Upgrade
+  // Sec-WebSocket-Version: 13
+  // Sec-WebSocket-Key: ZHEJMUkToewFjjdufVsStQ==
+  if ( method != Method::eGet )
+  {
+    return nullptr;
+  }
+  else if ( !isHeaderSet( MHD_HTTP_HEADER_HOST ) )
+  {
+    return nullptr;
+  }
+  else if ( !isHeaderSetTo( MHD_HTTP_HEADER_UPGRADE, "websocket" ) )
+  {
+    return nullptr;
+  }
+  else if ( !isHeaderSetTo( "Connection", "Upgrade" ) )
+  {
+    return nullptr;
+  }
+  else if ( !isHeaderSet( "Sec-WebSocket-Version" ) )
+  {
+    return nullptr;
+  }
+  else if ( !isHeaderSet( MHD_HTTP_HEADER_SEC_WEBSOCKET_KEY ) )
+  {
+    return nullptr;
+  }
+  else if ( ( version.major  < 1 )
+         || ( version.major == 1 ) && ( version.minor < 1 ) )
+  {
+    return nullptr;
+  }
+
+  MHD_Response*const mhdResponse
+  {
+    MHD_create_response_for_upgrade( &upgradeHandler, this )
+  };
+
+  /**
+   * For the response we need at least the following headers:
+   * 1. "Connection: Upgrade"
+   * 2. "Upgrade: websocket"
+   * 3. "Sec-WebSocket-Accept: <base64value>"
+   * The value for Sec-WebSocket-Accept can be generated with MHD_websocket_create_accept_header.
+   * It requires the value of the Sec-WebSocket-Key header of the request.
+   * See also: https://tools.ietf.org/html/rfc6455#section-4.2.2
+   */
+  MHD_add_response_header( mhdResponse
+                         , MHD_HTTP_HEADER_UPGRADE
+                         , "websocket" );
+  // Header is known to exist from check above
+  std::string acceptResponse{ headers[ MHD_HTTP_HEADER_SEC_WEBSOCKET_KEY ] };
+
+  // If we had websocket support we could use MHD_websocket_create_accept_header
+  acceptResponse.append( "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" );
+  acceptResponse = encoding::sha1::encode( acceptResponse );
+  acceptResponse = encoding::base64::encode( acceptResponse );
+  MHD_add_response_header( mhdResponse
+                         , MHD_HTTP_HEADER_SEC_WEBSOCKET_ACCEPT
+                         , acceptResponse.c_str() );
+
+  return mhdResponse;
+}
+
+
+bool Server::Private::isHeaderSet( const std::string& header ) const
+{
+  return headers.count( header ) > 0;
+}
+
+bool Server::Private::isHeaderSetTo( const std::string& header
+                                   , const std::string& value ) const
+{
+  const auto I{ headers.find( header ) };
+  return ( I != headers.end() ) && ( I->second == value );
+}
+
+MHD_Response* Server::Private::maybeCreateMetricsResponse( const char* url
+                                                         , Method method
+                                                         , size_t& numBytes ) const
+{
+  if ( config.metricsPath.empty()
+    || ( method != Method::eGet )
+    || ( config.metricsPath != url ) )
+  {
+    return nullptr;
+  }
+
+  const std::string content{ formatPrometheus( metrics.snapshot() ) };
+  numBytes = content.size();
+
+  MHD_Response*const mhdResponse
+  {
+    MHD_create_response_from_buffer( content.size()
+                                   , (void*)content.c_str()
+                                   , MHD_RESPMEM_MUST_COPY )
+  };
+  if ( mhdResponse )
+  {
+    MHD_add_response_header( mhdResponse
+                           , MHD_HTTP_HEADER_CONTENT_TYPE
+                           , "text/plain; version=0.0.4" );
+  }
+
+  return mhdResponse;
+}
+
+// static
+MHD_Result Server::Private::accessHandlerCallback( void* userData
+                                                 , MHD_Connection* connection
+                                                 , const char* url
+                                                 , const char* methodStr
+                                                 , const char* versionStr
+                                                 , const char* uploadData
+                                                 , size_t* uploadDataSize
+                                                 , void** connectionContext )
+{
+  auto server = (Private*)userData;
+
+//  std::cout << "URL:              " << url << '\n';
+//  std::cout << "Method:           " << methodStr << '\n';
+//  std::cout << "Version:          " << versionStr << '\n';
+//  std::cout << "Upload data size: " << *uploadDataSize << '\n';
+//  std::cout << "Upload data:      ";
+//  if ( uploadData )
+//  {
+//    std::cout << std::string{ uploadData, *uploadDataSize } << '\n';
+//  }
+//  else
+//  {
+//    std::cout << "<null>\n";
+//  }
+//  std::cout << std::flush;
+
+  const auto method{ parseMethod( methodStr ) };
+  if ( method == Method::eInvalid )
+  {
+    return MHD_NO;
+  }
+
+  const auto version{ parseVersion( versionStr ) };
+  if ( version.major < 0 )
+  {
+    return MHD_NO;
+  }
+
+  //std::cout << "HEADERS:" << std::endl;
+  MHD_get_connection_values( connection, MHD_HEADER_KIND, &keyValueIterator, server );
+
+  if ( !*connectionContext )
+  {
+    // Reject clients over their rate, and shed load, as early, and so as
+    // cheaply, as possible.
+    if ( !server->withinRateLimit( connection ) )
+    {
+      server->metrics.httpRequestsRateLimited.add();
+      return queueRetryLaterResponse( server
+                                    , connection
+                                    , url
+                                    , method
+                                    , MHD_HTTP_TOO_MANY_REQUESTS
+                                    , server->config.rateLimit.retryAfter );
+    }
+
+    if ( !server->admit( connection, url ) )
+    {
+      server->metrics.httpRequestsShed.add();
+      return queueRetryLaterResponse( server
+                                    , connection
+                                    , url
+                                    , method
+                                    , MHD_HTTP_SERVICE_UNAVAILABLE
+                                    , server->config.admissionControl.retryAfter );
+    }
+
+    // First invocation for this connection so set things up as required.
+    ConnectionContext*const cc{ new ConnectionContext };
+    *connectionContext = cc;
+
+    cc->url = url;
+    cc->start = std::chrono::steady_clock::now();
+
+    LB_HTTPD_TRACE( request__start, url, static_cast<int>( method ) );
+
+    server->startTrace( connection, *cc, url, method );
+
+    if ( server->config.preBodyHook )
+    {
+      const auto response{ server->invokePreBodyHook( connection, url, method ) };
+      if ( response )
+      {
+        MHD_Response*const mhdResponse
+        {
+          MHD_create_response_from_buffer( response->content.size()
+                                         , (void*)response->content.c_str()
+                                         , MHD_RESPMEM_MUST_COPY )
+        };
+
+        const auto result
+        {
+          MHD_queue_response( connection, response->code, mhdResponse )
+        };
+
+        MHD_destroy_response( mhdResponse );
+
+        server->metrics.recordHttpRequest( method, response->code );
+        server->logRequest( *cc, url, method, response->code, response->content.size() );
+        server->responseQueued( connection, *cc );
+
+        LB_HTTPD_TRACE( request__end, url, static_cast<int>( method ), response->code );
+
+        delete cc;
+        *connectionContext = nullptr;
+
+        return result;
+      }
+    }
+
+    if ( method == Method::ePost )
+    {
+      cc->pp = MHD_create_post_processor( connection
+                                        , server->config.tuning.postProcessorBufferSize
+                                        , &postDataIterator
+                                        , userData );
+      if ( !cc->pp )
+      {
+        LB_HTTPD_LOG( eError, "Failed to create POST processor!" );
+      }
+    }
+
+    // Return now and we get called again. No, I don't know either.
     return MHD_YES;
   }
 
@@ -470,6 +1253,8 @@ MHD_Result Server::Private::accessHandlerCallback( void* userData
   {
     server->maybeCreateWebSocketResponse( url, method, version )
   };
+  ConnectionContext*const cc{ (ConnectionContext*)(*connectionContext) };
+
   if ( mhdResponse )
   {
     const auto result
@@ -479,10 +1264,50 @@ MHD_Result Server::Private::accessHandlerCallback( void* userData
 
     MHD_destroy_response( mhdResponse );
 
+    server->metrics.recordHttpRequest( method, MHD_HTTP_SWITCHING_PROTOCOLS );
+    server->logRequest( *cc, url, method, MHD_HTTP_SWITCHING_PROTOCOLS, 0 );
+
+    // MHD only reports completion once the upgraded connection closes so the
+    // request is over, as far as admission control and tracing go, here.
+    ConnectionState*const state{ connectionState( connection ) };
+    if ( state && state->admitted )
+    {
+      server->releaseAdmission( *state );
+    }
+    if ( cc->trace )
+    {
+      cc->addStage( Trace::Stage::eResponseQueued );
+      server->tracer.push( std::move( *cc->trace ) );
+      cc->trace.reset();
+    }
+
+    LB_HTTPD_TRACE( request__end, url, static_cast<int>( method ), MHD_HTTP_SWITCHING_PROTOCOLS );
+
     return result;
   }
 
-  ConnectionContext*const cc{ (ConnectionContext*)(*connectionContext) };
+  size_t numMetricsBytes{ 0 };
+  mhdResponse = server->maybeCreateMetricsResponse( url, method, numMetricsBytes );
+  if ( mhdResponse )
+  {
+    const auto result
+    {
+      MHD_queue_response( connection, MHD_HTTP_OK, mhdResponse )
+    };
+
+    MHD_destroy_response( mhdResponse );
+
+    server->metrics.recordHttpRequest( method, MHD_HTTP_OK );
+    server->logRequest( *cc, url, method, MHD_HTTP_OK, numMetricsBytes );
+    server->responseQueued( connection, *cc );
+
+    LB_HTTPD_TRACE( request__end, url, static_cast<int>( method ), MHD_HTTP_OK );
+
+    MHD_destroy_post_processor( cc->pp );
+    delete cc;
+
+    return result;
+  }
 
   // Note that passing MHD_POSTDATA_KIND to MHD_get_connection_values does
   // nothing, even for small POST data, contrary to the documentation. It
@@ -493,6 +1318,8 @@ MHD_Result Server::Private::accessHandlerCallback( void* userData
   // and must not queue a response.
   if ( ( method == Method::ePost ) && ( *uploadDataSize != 0 ) )
   {
+    cc->numBytesIn += *uploadDataSize;
+
     const auto result
     {
       MHD_post_process( cc->pp, uploadData, *uploadDataSize )
@@ -506,6 +1333,14 @@ MHD_Result Server::Private::accessHandlerCallback( void* userData
   MHD_destroy_post_processor( cc->pp );
   cc->pp = nullptr;
 
+  if ( method == Method::ePost )
+  {
+    cc->addStage( Trace::Stage::eBodyComplete );
+  }
+
+  const auto handlerStart{ std::chrono::steady_clock::now() };
+  cc->addStage( Trace::Stage::eHandlerStart );
+
   const auto response
   {
     server->invokeRequestHandler( connection
@@ -516,6 +1351,10 @@ MHD_Result Server::Private::accessHandlerCallback( void* userData
                                                         , *uploadDataSize } ) )
   };
 
+  server->metrics.httpHandlerMicroseconds.recordMicroseconds(
+    std::chrono::steady_clock::now() - handlerStart );
+  cc->addStage( Trace::Stage::eHandlerEnd );
+
   mhdResponse
     = MHD_create_response_from_buffer( response.content.size()
                                      , (void*)response.content.c_str()
@@ -528,6 +1367,14 @@ MHD_Result Server::Private::accessHandlerCallback( void* userData
 
   MHD_destroy_response( mhdResponse );
 
+  server->metrics.httpRequestMicroseconds.recordMicroseconds(
+    std::chrono::steady_clock::now() - cc->start );
+  server->metrics.recordHttpRequest( method, response.code );
+  server->logRequest( *cc, url, method, response.code, response.content.size() );
+  server->responseQueued( connection, *cc );
+
+  LB_HTTPD_TRACE( request__end, url, static_cast<int>( method ), response.code );
+
   delete cc;
 
   return result;
@@ -609,55 +1456,156 @@ void Server::Private::upgradeHandler( void* userData
   auto cc{ (ConnectionContext*)connectionContext };
   if ( !cc )
   {
-    std::cerr << "Missing connection context in upgrade handler" << std::endl;
-    return;
+    LB_HTTPD_LOG( eError, "Missing connection context in upgrade handler" );
+    return;
+  }
+
+  std::string url{ std::move( cc->url ) };
+  delete cc;
+
+  const auto connectionID{ globalConnectionID.fetch_add( 1, std::memory_order_relaxed ) };
+
+  std::unique_lock l{ server->webSocketMutex };
+
+  WebSocket*const webSocketPtr
+  {
+    server->openWebSocket( connectionID
+                         , std::move( url )
+                         , RateLimiter::address( clientAddress( connection ) )
+                         , socket
+                         , upgradeHandle )
+  };
+  if ( !webSocketPtr )
+  {
+    return;
+  }
+
+  WebSocket& webSocket{ *webSocketPtr };
+  const auto ticket{ server->reactorImpl().reserve( webSocket.socket ) };
+
+  if ( extraDataSize > 0 )
+  {
+// TODO - this is not quite right. It may be data or control and it will have
+// a Header that needs decoding to tell us.
+//    webSocket.receivers.receiveData( connectionID, std::string{ extraData, extraDataSize } );
+  }
+
+  // Adding may wait for scaleMutex, held while rebalancing waits out every
+  // pass, and a pass may want webSocketMutex.
+  l.unlock();
+  server->reactorImpl().add( socket, ticket, std::bind( &WebSocket::receive, &webSocket ) );
+}
+
+WebSocket* Server::Private::openWebSocket( ws::ConnectionID connectionID
+                                         , std::string url
+                                         , std::optional<RateLimiter::Address> clientAddress
+                                         , MHD_socket socket
+                                         , MHD_UpgradeResponseHandle* upgradeHandle )
+{
+  WebSocket*const webSocketPtr
+  {
+    webSockets.emplace( connectionID
+                      , config.maxSocketBytesToReceive
+                      , config.tuning.webSocketCloseTimeout
+                      , config.webSocketMigration && !tls
+                      , metrics
+                      , tracer
+                      , rateLimiter
+                      , clientAddress
+                      , url
+                      , socket
+                      , upgradeHandle
+                      , std::bind( &Private::webSocketClosed, this, std::placeholders::_1 ) )
+  };
+  if ( !webSocketPtr )
+  {
+    LB_HTTPD_LOG( eError, "Failed to create WebSocket for " << url );
+    return nullptr;
   }
 
-  std::string url{ std::move( cc->url ) };
-  delete cc;
+  WebSocket& webSocket{ *webSocketPtr };
 
-  const auto connectionID{ globalConnectionID++ };
+  LB_HTTPD_TRACE( ws__upgrade, connectionID, url.c_str() );
 
-  std::scoped_lock l{ server->webSocketMutex };
-
-  const auto emplacePair
-  {
-    server->webSockets.emplace( std::piecewise_construct
-                              , std::forward_as_tuple( connectionID )
-                              , std::forward_as_tuple( connectionID
-                                                     , server->config.maxSocketBytesToReceive
-                                                     , url
-                                                     , socket
-                                                     , upgradeHandle
-                                                     , std::bind( &Private::webSocketClosed, server, std::placeholders::_1 ) ) )
-  };
-  if ( !emplacePair.second )
+  if ( accessLog )
   {
-    std::cerr << "Failed to create WebSocket for " << url << std::endl;
-    return;
+    accessLog->write( accesslog::RecordType::eWebSocketOpen
+                    , connectionID
+                    , static_cast<uint8_t>( Method::eGet )
+                    , MHD_HTTP_SWITCHING_PROTOCOLS
+                    , url
+                    , 0
+                    , 0
+                    , 0 );
   }
 
-  WebSocket& webSocket{ emplacePair.first->second };
+  metrics.webSocketConnectionsOpened.add();
+  metrics.webSocketConnectionsActive.add( 1 );
 
   auto receivers
   {
-    server->webSocketHandler->connectionEstablised(
+    webSocketHandler->connectionEstablised(
       { connectionID
       , url
-      , webSocket.senders
+      , webSocket.cold->senders
       } )
   };
 
   webSocket.receivers = std::move( receivers );
 
-  if ( extraDataSize > 0 )
+  return webSocketPtr;
+}
+
+size_t Server::Private::migrateWebSocketsNow( int channel )
+{
+  std::scoped_lock l{ webSocketMutex };
+
+  std::vector<ws::ConnectionID> migrated;
+  std::optional<std::runtime_error> error;
+
+  webSockets.forEach( [&]( WebSocket& webSocket )
   {
-// TODO - this is not quite right. It may be data or control and it will have
-// a Header that needs decoding to tell us.
-//    webSocket.receivers.receiveData( connectionID, std::string{ extraData, extraDataSize } );
+    if ( error
+      || ( webSocket.closeHandshake != WebSocket::CloseHandshake::eNone )
+      || !ws::Senders::Impl::closeUnlessStreaming( webSocket.cold->senders ) )
+    {
+      return;
+    }
+
+    try
+    {
+      listener::sendSocket( channel
+                          , webSocket.socket
+                          , webSocket.migrationState().serialize() );
+      migrated.push_back( webSocket.connectionID );
+    }
+    catch ( const std::runtime_error& e )
+    {
+      // Its Senders are closed so it cannot carry on here either.
+      error = e;
+      webSocket.closeConnection( encoding::websocket::closestatus::ProtocolCode::eGoingAway );
+    }
+  } );
+
+  for ( const auto connectionID : migrated )
+  {
+    WebSocket*const webSocket{ webSockets.find( connectionID ) };
+    webSocket->closeHandshake = WebSocket::CloseHandshake::eComplete;
+    webSocket->recordClose( metrics::CloseReason::eMigrated );
+
+    reactorImpl().remove( webSocket->socket );
+    logWebSocketClose( *webSocket );
+    webSockets.erase( connectionID );
+    metrics.webSocketConnectionsActive.add( -1 );
   }
 
-  server->poller.add( webSocket.socket, std::bind( &WebSocket::receive, &webSocket ) );
+  if ( error )
+  {
+    LB_HTTPD_LOG( eError, "WebSocket migration stopped after " << migrated.size()
+                          << " connections: " << error->what() );
+  }
+
+  return migrated.size();
 }
 
 Server::Response Server::Private::invokeRequestHandler( MHD_Connection* connection
@@ -685,56 +1633,162 @@ Server::Response Server::Private::invokeRequestHandler( MHD_Connection* connecti
   return response;
 }
 
-void Server::Private::webSocketLoop()
+int Server::Private::webSocketLoopTimeout() const
+{
+  // Wake often enough to sample connection stats on time.
+  int pollTimeout{ 500 };
+  if ( config.connectionStatsInterval.count() > 0 )
+  {
+    pollTimeout = std::min<int>( pollTimeout, config.connectionStatsInterval.count() );
+  }
+  return pollTimeout;
+}
+
+void Server::Private::afterPoll( size_t loop, const ws::Reactor::Impl::Pass& pass )
 {
-  while ( webSocketRunning )
+  if ( pass.timedOut )
   {
-    // Note that the addition of new WebSocket instances does not affect the
-    // poller as it is already mutex protected internally.
-    //
-    // If any WebSocket gets closed as a result of the poll then it will end up
-    // in the closedWebSockets container.
-    const int pollResult{ poller( 500 ) };
-    if ( pollResult < 0 )
+    if ( pass.timeout > 0 )
     {
-      std::cerr << "Error while polling" << std::endl;
-      std::this_thread::sleep_for( std::chrono::seconds( 2 ) ); // Keep trying every 2 seconds
-      continue;
+      metrics.webSocketLoopLagMicroseconds.recordMicroseconds(
+        pass.wakeTime - pass.pollStart - std::chrono::milliseconds{ pass.timeout } );
     }
+  }
+  else if ( pass.numReady > 0 )
+  {
+    metrics.webSocketLoopEventsPerWakeup.record( pass.numReady );
+  }
+
+  // Now see if any WebSocket needs removed from the list. Only the loop that
+  // polls a WebSocket may remove it as only that loop could be in it.
+  ClosedWebSockets closed;
+  {
+    std::scoped_lock l{ closedWebSocketsMutex };
+    closed.swap( closedWebSockets );
+  }
 
-    // Now see if any WebSocket needs removed from the list.
-    for ( const auto& connectionID : closedWebSockets )
+  if ( !closed.empty() )
+  {
+    // Those for other loops, or still awaiting the reply to our close frame,
+    // go back for a later pass.
+    std::vector<ws::ConnectionID> requeued;
     {
       std::scoped_lock l{ webSocketMutex };
 
-      const auto W{ webSockets.find( connectionID ) };
-      if ( W == webSockets.end() )
+      for ( const auto& connectionID : closed )
       {
-        std::cerr << "Unknown WebSocket closed!" << std::endl;
-        return;
+        WebSocket*const webSocket{ webSockets.find( connectionID ) };
+        if ( !webSocket )
+        {
+          LB_HTTPD_LOG( eError, "Unknown WebSocket closed!" );
+          continue;
+        }
+        if ( !reactorImpl().polledBy( loop, webSocket->socket ) )
+        {
+          requeued.push_back( connectionID );
+          continue;
+        }
+        if ( webSocket->canClose() )
+        {
+          reactorImpl().remove( webSocket->socket );
+          logWebSocketClose( *webSocket );
+          webSockets.erase( connectionID );
+          metrics.webSocketConnectionsActive.add( -1 );
+        }
+        else if ( webSocket->closeHandshake == WebSocket::CloseHandshake::eServerInitiated )
+        {
+          requeued.push_back( connectionID );
+        }
       }
-      if ( W->second.canClose() )
+    }
+
+    if ( !requeued.empty() )
+    {
+      std::scoped_lock l{ closedWebSocketsMutex };
+      closedWebSockets.insert( requeued.begin(), requeued.end() );
+    }
+  }
+
+  maybeSampleConnectionStats();
+
+  metrics.webSocketLoopIterationMicroseconds.recordMicroseconds(
+    std::chrono::steady_clock::now() - pass.wakeTime );
+}
+
+void Server::Private::maybeSampleConnectionStats()
+{
+  if ( config.connectionStatsInterval.count() <= 0 )
+  {
+    return;
+  }
+
+  // Whichever loop gets here first once it is time samples for all of them.
+  std::unique_lock sampling{ connectionStatsMutex, std::try_to_lock };
+  if ( !sampling )
+  {
+    return;
+  }
+
+  const auto now{ std::chrono::steady_clock::now() };
+  if ( now - lastConnectionStatsTime < config.connectionStatsInterval )
+  {
+    return;
+  }
+  lastConnectionStatsTime = now;
+
+  // The system calls are made without webSocketMutex so as not to hold up
+  // the other loops and the MHD thread for the whole sweep.
+  std::vector< std::pair<ws::ConnectionID, MHD_socket> > sockets;
+  {
+    std::scoped_lock l{ webSocketMutex };
+
+    sockets.reserve( webSockets.size() );
+    webSockets.forEach( [&sockets]( WebSocket& webSocket )
+    {
+      sockets.emplace_back( webSocket.connectionID, webSocket.socket );
+    } );
+  }
+
+  std::vector<ws::ConnectionStats> samples;
+  samples.reserve( sockets.size() );
+  int64_t sendQueueBytes{ 0 };
+  for ( const auto&[ connectionID, socket ] : sockets )
+  {
+    samples.push_back( WebSocket::sampleStats( socket ) );
+    sendQueueBytes += samples.back().sendQueueBytes;
+  }
+
+  {
+    std::scoped_lock l{ webSocketMutex };
+
+    for ( size_t i = 0; i < sockets.size(); ++i )
+    {
+      // Any closed meanwhile are gone, and their socket maybe reused.
+      WebSocket*const webSocket{ webSockets.find( sockets[i].first ) };
+      if ( webSocket && ( webSocket->socket == sockets[i].second ) )
       {
-        poller.remove( W->second.socket );
-        webSockets.erase( W );
+        webSocket->cold->stats = samples[i];
       }
     }
-    closedWebSockets.clear();
   }
+  metrics.webSocketSendQueueBytes.set( sendQueueBytes );
 }
 
 void Server::Private::webSocketClosed( ws::ConnectionID connectionID )
 {
+  std::scoped_lock l{ closedWebSocketsMutex };
   closedWebSockets.insert( connectionID );
 }
 
 
 Server::Server( Config config
               , RequestHandler rh
-              , std::optional<ws::Handler> wsh )
+              , std::optional<ws::Handler> wsh
+              , std::shared_ptr<ws::Reactor> reactor )
   : d{ std::make_unique<Private>( std::move( config )
                                 , std::move( rh )
-                                , std::move( wsh ) ) }
+                                , std::move( wsh )
+                                , std::move( reactor ) ) }
 {
 }
 
@@ -742,12 +1796,14 @@ Server::Server( Config config
               , std::string httpsCert
               , std::string httpsPrivateKey
               , RequestHandler rh
-              , std::optional<ws::Handler> wsh )
+              , std::optional<ws::Handler> wsh
+              , std::shared_ptr<ws::Reactor> reactor )
   : d{ std::make_unique<Private>( std::move( config )
                                 , std::move( httpsCert )
                                 , std::move( httpsPrivateKey )
                                 , std::move( rh )
-                                , std::move( wsh ) ) }
+                                , std::move( wsh )
+                                , std::move( reactor ) ) }
 {
 }
 
@@ -757,6 +1813,405 @@ Server::~Server()
 
 Server::Server( Server&& ) = default;
 
+std::optional<ws::ConnectionStats>
+Server::sampleConnectionStats( ws::ConnectionID connectionID ) const
+{
+  MHD_socket socket;
+  {
+    std::scoped_lock l{ d->webSocketMutex };
+
+    const WebSocket*const webSocket{ d->webSockets.find( connectionID ) };
+    if ( !webSocket )
+    {
+      return {};
+    }
+    socket = webSocket->socket;
+  }
+
+  return WebSocket::sampleStats( socket );
+}
+
+std::optional<ws::ConnectionStats>
+Server::connectionStats( ws::ConnectionID connectionID ) const
+{
+  std::scoped_lock l{ d->webSocketMutex };
+
+  const WebSocket*const webSocket{ d->webSockets.find( connectionID ) };
+  if ( !webSocket )
+  {
+    return {};
+  }
+
+  return webSocket->cold->stats;
+}
+
+
+Server::Stats Server::stats() const
+{
+  Stats stats{ d->metrics.snapshot() };
+
+  const MHD_DaemonInfo*const info
+  {
+    MHD_get_daemon_info( d->mhd, MHD_DAEMON_INFO_CURRENT_CONNECTIONS )
+  };
+  if ( info )
+  {
+    stats.httpConnections = info->num_connections;
+  }
+
+  if ( d->admission.enabled() )
+  {
+    stats.httpConcurrencyLimit = d->admission.limit();
+    stats.httpRequestsInFlight = d->admission.inFlight();
+  }
+
+  return stats;
+}
+
+std::vector<Server::Trace> Server::traces() const
+{
+  return d->tracer.dump();
+}
+
+void Server::handOverListenSocket( const std::string& unixSocketPath )
+{
+  // Reach the successor before we stop accepting, so that failing to leaves
+  // us as we were.
+  const int channel{ listener::connectUnix( unixSocketPath ) };
+
+  // MHD needs its inter-thread channel, which MHD_ALLOW_SUSPEND_RESUME gives
+  // us, to quiesce its internal thread. The socket is ours after this.
+  const MHD_socket socket{ MHD_quiesce_daemon( d->mhd ) };
+  if ( socket == MHD_INVALID_SOCKET )
+  {
+    close( channel );
+    throw std::runtime_error{ "Failed to stop accepting connections" };
+  }
+
+  // The successor carries on numbering WebSocket connections from here so
+  // any we migrate to it keep their IDs.
+  const ws::ConnectionID nextID{ globalConnectionID.load( std::memory_order_relaxed ) };
+
+  try
+  {
+    listener::sendSocket( channel
+                        , socket
+                        , { reinterpret_cast<const char*>( &nextID ), sizeof( nextID ) } );
+  }
+  catch ( ... )
+  {
+    close( socket );
+    close( channel );
+    throw;
+  }
+
+  close( socket );
+  close( channel );
+
+  // The successor is listening at our Unix socket path now.
+  d->removeUnixSocketPath = false;
+
+  LB_HTTPD_LOG( eInfo, "Listening socket handed over via " << unixSocketPath );
+}
+
+// static
+MHD_socket Server::receiveListenSocket( const std::string& unixSocketPath
+                                      , std::chrono::milliseconds timeout )
+{
+  const int channel{ listener::acceptUnix( unixSocketPath, timeout ) };
+
+  std::optional<listener::ReceivedSocket> received;
+  try
+  {
+    received = listener::receiveSocket( channel, timeout );
+  }
+  catch ( ... )
+  {
+    close( channel );
+    throw;
+  }
+  close( channel );
+
+  if ( !received )
+  {
+    throw std::runtime_error{ "No listening socket received at " + unixSocketPath };
+  }
+
+  ws::ConnectionID nextID;
+  if ( received->data.size() == sizeof( nextID ) )
+  {
+    std::memcpy( &nextID, received->data.data(), sizeof( nextID ) );
+    raiseGlobalConnectionID( nextID );
+  }
+
+  return received->socket;
+}
+
+bool Server::drain( std::chrono::milliseconds timeout )
+{
+  const auto deadline{ std::chrono::steady_clock::now() + timeout };
+
+  while ( true )
+  {
+    const MHD_DaemonInfo*const info
+    {
+      MHD_get_daemon_info( d->mhd, MHD_DAEMON_INFO_CURRENT_CONNECTIONS )
+    };
+    if ( !info )
+    {
+      return false;
+    }
+
+    // MHD counts upgraded connections until they close, but not the ones we
+    // adopted from another process.
+    size_t numWebSockets{ 0 };
+    {
+      std::scoped_lock l{ d->webSocketMutex };
+      d->webSockets.forEach( [&numWebSockets]( WebSocket& webSocket )
+      {
+        if ( webSocket.cold->upgradeResponseHandle )
+        {
+          ++numWebSockets;
+        }
+      } );
+    }
+    if ( info->num_connections <= numWebSockets )
+    {
+      return true;
+    }
+
+    if ( std::chrono::steady_clock::now() >= deadline )
+    {
+      return false;
+    }
+
+    if ( d->config.externalEventLoop )
+    {
+      // Nothing else is driving the Server while we are in here.
+      std::vector<pollfd> fds;
+      for ( const int fd : eventFDs() )
+      {
+        fds.push_back( { fd, POLLIN, 0 } );
+      }
+      poll( fds.data(), fds.size(), 10 );
+      runOnce();
+    }
+    else
+    {
+      std::this_thread::sleep_for( std::chrono::milliseconds{ 10 } );
+    }
+  }
+}
+
+size_t Server::migrateWebSockets( const std::string& unixSocketPath )
+{
+  if ( !d->config.webSocketMigration )
+  {
+    throw std::runtime_error{ "WebSocket migration not enabled in the Config" };
+  }
+
+  // Over TLS the socket MHD gives us is one end of a socketpair, the real one
+  // and its session state staying inside MHD.
+  if ( d->tls )
+  {
+    throw std::runtime_error{ "WebSocket migration is not supported over HTTPS" };
+  }
+
+  if ( !d->webSocketHandler )
+  {
+    return 0;
+  }
+
+  const int channel{ listener::connectUnix( unixSocketPath ) };
+
+  // With the loops stopped none of them is in a WebSocket we are sending on.
+  size_t numMigrated{ 0 };
+  try
+  {
+    d->reactorImpl().exclusive( [this, channel, &numMigrated]
+    {
+      numMigrated = d->migrateWebSocketsNow( channel );
+    } );
+  }
+  catch ( ... )
+  {
+    close( channel );
+    throw;
+  }
+  close( channel );
+
+  LB_HTTPD_LOG( eInfo, "Migrated " << numMigrated << " WebSockets via " << unixSocketPath );
+
+  return numMigrated;
+}
+
+size_t Server::adoptWebSockets( const std::string& unixSocketPath
+                              , std::chrono::milliseconds timeout )
+{
+  if ( !d->webSocketHandler )
+  {
+    throw std::runtime_error{ "Cannot adopt WebSockets without a WebSocket handler" };
+  }
+
+  const int channel{ listener::acceptUnix( unixSocketPath, timeout ) };
+
+  size_t numAdopted{ 0 };
+  size_t numFailed{ 0 };
+  try
+  {
+    while ( auto received{ listener::receiveSocket( channel, timeout ) } )
+    {
+      auto state{ WebSocket::MigrationState::deserialize( received->data ) };
+      if ( !state )
+      {
+        LB_HTTPD_LOG( eError, "Invalid migrated WebSocket state, dropping connection" );
+        close( received->socket );
+        ++numFailed;
+        continue;
+      }
+
+      // Keep the IDs we hand out clear of the adopted ones.
+      raiseGlobalConnectionID( state->connectionID + 1 );
+
+      sockaddr_storage peer{};
+      socklen_t peerSize{ sizeof( peer ) };
+      const bool havePeer{ getpeername( received->socket, (sockaddr*)&peer, &peerSize ) == 0 };
+
+      std::unique_lock l{ d->webSocketMutex };
+
+      // Only a connection upgraded by the predecessor after it handed over
+      // its listening socket can clash with one of ours.
+      ws::ConnectionID connectionID{ state->connectionID };
+      if ( d->webSockets.find( connectionID ) )
+      {
+        connectionID = globalConnectionID.fetch_add( 1, std::memory_order_relaxed );
+        LB_HTTPD_LOG( eWarning, "Migrated WebSocket ID " << state->connectionID
+                                << " already in use, now ID " << connectionID );
+        state->connectionID = connectionID;
+      }
+
+      WebSocket*const webSocket
+      {
+        d->openWebSocket( connectionID
+                        , state->urlPath
+                        , RateLimiter::address( havePeer ? (const sockaddr*)&peer : nullptr )
+                        , received->socket
+                        , nullptr )
+      };
+      if ( !webSocket )
+      {
+        close( received->socket );
+        ++numFailed;
+        continue;
+      }
+
+      if ( !webSocket->resume( std::move( *state ) ) )
+      {
+        // Closed on resuming. No loop polls it to remove it so do so here.
+        LB_HTTPD_LOG( eWarning, "Migrated WebSocket ID " << connectionID << " failed to resume" );
+        {
+          std::scoped_lock c{ d->closedWebSocketsMutex };
+          d->closedWebSockets.erase( connectionID );
+        }
+        d->logWebSocketClose( *webSocket );
+        d->webSockets.erase( connectionID );
+        d->metrics.webSocketConnectionsActive.add( -1 );
+        ++numFailed;
+        continue;
+      }
+
+      const auto ticket{ d->reactorImpl().reserve( webSocket->socket ) };
+
+      // Adding may wait for scaleMutex, held while rebalancing waits out every
+      // pass, and a pass may want webSocketMutex.
+      l.unlock();
+      d->reactorImpl().add( received->socket, ticket, std::bind( &WebSocket::receive, webSocket ) );
+      ++numAdopted;
+    }
+  }
+  catch ( ... )
+  {
+    close( channel );
+    throw;
+  }
+
+  close( channel );
+
+  LB_HTTPD_LOG( eInfo, "Adopted " << numAdopted << " WebSockets via " << unixSocketPath
+                       << ", " << numFailed << " failed" );
+
+  return numAdopted;
+}
+
+std::vector<int> Server::eventFDs() const
+{
+  if ( !d->config.externalEventLoop )
+  {
+    throw std::runtime_error{ "Server not in external event loop mode" };
+  }
+
+  std::vector<int> fds;
+
+  const MHD_DaemonInfo*const info{ MHD_get_daemon_info( d->mhd, MHD_DAEMON_INFO_EPOLL_FD ) };
+  if ( info )
+  {
+    fds.push_back( info->epoll_fd );
+  }
+
+  if ( d->reactor )
+  {
+    fds.push_back( d->reactorImpl().fd() );
+  }
+
+  return fds;
+}
+
+std::chrono::milliseconds Server::nextTimeout() const
+{
+  if ( !d->config.externalEventLoop )
+  {
+    throw std::runtime_error{ "Server not in external event loop mode" };
+  }
+
+  std::chrono::milliseconds timeout{ std::chrono::milliseconds::max() };
+
+  MHD_UNSIGNED_LONG_LONG mhdTimeout;
+  if ( MHD_get_timeout( d->mhd, &mhdTimeout ) == MHD_YES )
+  {
+    timeout = std::chrono::milliseconds( mhdTimeout );
+  }
+
+  // The loop also has work that does not show up on the poller fd: closes
+  // requested from other threads, and stats sampling.
+  if ( d->reactor )
+  {
+    timeout = std::min( timeout, std::chrono::milliseconds( d->reactorImpl().pollTimeout() ) );
+  }
+
+  return timeout;
+}
+
+void Server::runOnce()
+{
+  if ( !d->config.externalEventLoop )
+  {
+    throw std::runtime_error{ "Server not in external event loop mode" };
+  }
+
+  if ( MHD_run( d->mhd ) != MHD_YES )
+  {
+    LB_HTTPD_LOG( eError, "Error running MHD" );
+  }
+
+  if ( d->reactor )
+  {
+    if ( d->reactorImpl().runOnce( 0 ) < 0 )
+    {
+      LB_HTTPD_LOG( eError, "Error while polling" );
+    }
+  }
+}
+
 
 } // End of namespace httpd
 
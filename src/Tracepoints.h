@@ -0,0 +1,61 @@
+#ifndef LIB_LB_HTTPD_TRACEPOINTS_H
+#define LIB_LB_HTTPD_TRACEPOINTS_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/** \file
+    \brief Static user space tracepoints (USDT) for bpftrace, perf and friends.
+
+    Built in only when compiled with LB_HTTPD_USDT defined, e.g. "make USDT=1",
+    which needs the systemtap sdt headers. Otherwise the macro expands to
+    nothing and its arguments are not evaluated.
+
+    When built in, an unattached probe is a single nop in the instruction stream
+    plus an ELF note so there is no need to rebuild to start tracing, e.g.
+
+    \code
+    bpftrace -e 'usdt:./liblbHttpd.so:lbhttpd:request__end { @[arg2] = count(); }'
+    \endcode
+
+    Probes, all under the "lbhttpd" provider:
+    - request__start( url, method )
+    - request__end( url, method, statusCode )
+    - ws__upgrade( connectionID, url )
+    - ws__frame__decode( connectionID, numBytes, numFrames )
+    - ws__frame__send( connectionID, finAndOpCode, numBytes )
+    - poll__return( pollResult, numFDs )
+    - poll__dispatched( numFDsProcessed )
+
+    Method is the numeric value of Server::Method and finAndOpCode is the first
+    byte of the encoded frame header. Byte counts include frame headers.
+ */
+
+#ifdef LB_HTTPD_USDT
+
+#include <sys/sdt.h>
+
+#define LB_HTTPD_TRACE( name, ... ) STAP_PROBEV( lbhttpd, name, ##__VA_ARGS__ )
+
+#else
+
+#define LB_HTTPD_TRACE( name, ... ) do {} while ( false )
+
+#endif
+
+
+#endif // LIB_LB_HTTPD_TRACEPOINTS_H
@@ -0,0 +1,92 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Tracer.h"
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+Tracer::Tracer( unsigned int sampleRate, size_t capacity )
+  : sampleRate{ ( capacity > 0 ) ? sampleRate : 0 }
+  , capacity{ capacity }
+{
+}
+
+void Tracer::push( Server::Trace&& trace )
+{
+  std::scoped_lock l{ mutex };
+
+  if ( traces.size() < capacity )
+  {
+    traces.push_back( std::move( trace ) );
+  }
+  else
+  {
+    traces[ next ] = std::move( trace );
+  }
+  next = ( next + 1 ) % capacity;
+}
+
+std::vector<Server::Trace> Tracer::dump() const
+{
+  std::scoped_lock l{ mutex };
+
+  std::vector<Server::Trace> result;
+  result.reserve( traces.size() );
+
+  // Until the buffer is full next is also its size so this starts at zero.
+  for ( size_t i = 0; i < traces.size(); ++i )
+  {
+    result.push_back( traces[ ( next + i ) % traces.size() ] );
+  }
+
+  return result;
+}
+
+
+// static
+const char* Server::Trace::toString( Stage stage )
+{
+  switch ( stage )
+  {
+  case Stage::eAccepted:          return "accepted";
+  case Stage::eHeadersParsed:     return "headers_parsed";
+  case Stage::eBodyComplete:      return "body_complete";
+  case Stage::eHandlerStart:      return "handler_start";
+  case Stage::eHandlerEnd:        return "handler_end";
+  case Stage::eResponseQueued:    return "response_queued";
+  case Stage::eResponseCompleted: return "response_completed";
+  case Stage::eReceived:          return "received";
+  case Stage::eDecoded:           return "decoded";
+  case Stage::eReceiverStart:     return "receiver_start";
+  case Stage::eReceiverEnd:       return "receiver_end";
+  }
+
+  return "unknown";
+}
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
@@ -0,0 +1,85 @@
+#ifndef LIB_LB_HTTPD_TRACER_H
+#define LIB_LB_HTTPD_TRACER_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/Server.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief Decides which requests and messages to trace and keeps the results.
+
+    Sampling is a single relaxed increment so costs next to nothing for the
+    requests that are not traced. Completed traces go in a fixed size ring,
+    overwriting the oldest, behind a mutex; only sampled requests take it.
+ */
+class Tracer
+{
+public:
+  /** \brief \a sampleRate of zero disables tracing. */
+  Tracer( unsigned int sampleRate, size_t capacity );
+
+  bool enabled() const { return sampleRate > 0; }
+
+  /** \brief Returns a new trace for 1 in every \a sampleRate calls, else null. */
+  std::unique_ptr<Server::Trace> sample()
+  {
+    if ( !enabled()
+      || ( count.fetch_add( 1, std::memory_order_relaxed ) % sampleRate != 0 ) )
+    {
+      return {};
+    }
+    return std::make_unique<Server::Trace>();
+  }
+
+  void push( Server::Trace&& );
+
+  std::vector<Server::Trace> dump() const;
+
+private:
+  const unsigned int sampleRate;
+  const size_t capacity;
+
+  std::atomic<uint64_t> count{ 0 };
+
+  mutable std::mutex mutex;
+  std::vector<Server::Trace> traces;
+  size_t next{ 0 };
+};
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_TRACER_H
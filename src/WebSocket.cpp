@@ -17,11 +17,23 @@
 
 #include "WebSocket.h"
 
+#include "LoggingImpl.h"
+#include "Metrics.h"
+#include "Tracepoints.h"
+#include "Tracer.h"
+#include "ws/MessageImpl.h"
 #include "ws/SendersImpl.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
-#include <iostream>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 
 namespace lb
@@ -34,61 +46,64 @@ namespace httpd
 
 WebSocket::WebSocket( ws::ConnectionID connectionID
                     , size_t maxBytesToReceive
+                    , std::chrono::milliseconds closeTimeout
+                    , bool migratable
+                    , metrics::Metrics& metrics
+                    , Tracer& tracer
+                    , RateLimiter& rateLimiter
+                    , std::optional<RateLimiter::Address> clientAddress
                     , std::string urlPath
                     , MHD_socket socket
                     , MHD_UpgradeResponseHandle* upgradeResponseHandle
                     , std::function< void(ws::ConnectionID) > closeCallback )
-  : connectionID{ connectionID }
+  : socket{ socket }
+  , connectionID{ connectionID }
   , maxBytesToReceive{ maxBytesToReceive }
-  , urlPath{ std::move( urlPath ) }
-  , socket{ socket }
-  , upgradeResponseHandle{ upgradeResponseHandle }
-  , closeCallback{ std::move( closeCallback ) }
-  , senders{ ws::Senders::Impl::create( std::bind( &WebSocket::sendMessage
-                                                 , this
-                                                 , std::placeholders::_1
-                                                 , std::placeholders::_2 )
-                                      , std::bind( &WebSocket::sendClose
-                                                 , this
-                                                 , std::placeholders::_1
-                                                 , std::placeholders::_2 )
-                                      , std::bind( &WebSocket::sendPing
-                                                 , this
-                                                 , std::placeholders::_1 )
-                                      , std::bind( &WebSocket::sendPong
-                                                 , this
-                                                 , std::placeholders::_1 ) ) }
+  , migratable{ migratable }
+  , metrics{ metrics }
+  , tracer{ tracer }
+  , rateLimiter{ rateLimiter }
+  , clientAddress{ rateLimiter.enabled( RateLimiter::Kind::eMessage ) ? clientAddress : std::nullopt }
+  , cold{ std::make_unique<Cold>( std::move( urlPath )
+                                , upgradeResponseHandle
+                                , std::move( closeCallback )
+                                , upgradeResponseHandle == nullptr
+                                , closeTimeout ) }
 {
+  cold->senders = ws::Senders::Impl::create( *this );
 }
 
 WebSocket::~WebSocket()
 {
+  // Any copies of the Senders held by the application must not reach us now.
+  ws::Senders::Impl::close( cold->senders );
+
   closeSocket();
 }
 
-bool WebSocket::canClose() const
+bool WebSocket::canClose( std::chrono::steady_clock::time_point now )
 {
   // Should only get invoked when we have a value so this is a safety check.
   switch( closeHandshake )
   {
   case CloseHandshake::eNone:
-    std::cerr << "Improper request. No close initiated." << std::endl;
+    LB_HTTPD_LOG( eError, "Improper request. No close initiated." );
     return false;
   case CloseHandshake::eServerInitiated:
   {
     // Test for time-out while awaiting a close confirmation
-    const size_t closeTimeoutMilliseconds{ 2000 };
-    const TimePoint now{ std::chrono::steady_clock::now() };
     const auto diffMilliSeconds
     {
-      std::chrono::duration_cast<std::chrono::milliseconds>( now - closeSentTimePoint )
+      std::chrono::duration_cast<std::chrono::milliseconds>( now - cold->closeSentTimePoint )
     };
-    if ( diffMilliSeconds.count() > closeTimeoutMilliseconds )
+    if ( diffMilliSeconds <= cold->closeTimeout )
     {
-      std::cerr << "No close confirmation received within " << closeTimeoutMilliseconds
-                << " milliseconds, destroying WebSocket." << std::endl;
       return false;
     }
+
+    LB_HTTPD_LOG( eWarning, "No close confirmation received within " << cold->closeTimeout.count()
+                            << " milliseconds, destroying WebSocket." );
+    recordClose( metrics::CloseReason::eCloseTimeout );
     break;
   }
   case CloseHandshake::eClientInitiated:
@@ -102,13 +117,18 @@ bool WebSocket::canClose() const
 
 void WebSocket::closeSocket()
 {
-  if ( upgradeResponseHandle )
+  if ( cold->upgradeResponseHandle )
   {
-    MHD_upgrade_action( upgradeResponseHandle, MHD_UPGRADE_ACTION_CLOSE );
+    MHD_upgrade_action( cold->upgradeResponseHandle, MHD_UPGRADE_ACTION_CLOSE );
 
     // No further need for this now and it is a simple way of ensuring we won't
     // try to close the socket again.
-    upgradeResponseHandle = nullptr;
+    cold->upgradeResponseHandle = nullptr;
+  }
+  else if ( cold->ownsSocket && ( socket != MHD_INVALID_SOCKET ) )
+  {
+    close( socket );
+    socket = MHD_INVALID_SOCKET;
   }
 }
 
@@ -121,20 +141,43 @@ bool WebSocket::receive()
   auto numBytesReceived{ recv( socket, buffer, maxBytesToReceive, 0 ) };
   if ( numBytesReceived < 0 )
   {
-    std::cerr << "Error reading from socket " << socket << " for ID " << connectionID
-              << " , errno: " << errno
-              << " (" << strerror( errno ) << " )" << std::endl;
-    return true;
+    const int error{ errno };
+    if ( ( error == EINTR ) || ( error == EAGAIN ) || ( error == EWOULDBLOCK ) )
+    {
+      return true;
+    }
+
+    // The socket will keep polling as in error so treat it as closed.
+    LB_HTTPD_LOG( eError, "Error reading from socket " << socket << " for ID " << connectionID
+                          << " , errno: " << error
+                          << " (" << strerror( error ) << " )" );
   }
-  else if ( numBytesReceived == 0 )
+
+  if ( numBytesReceived <= 0 )
   {
-    // Connection closed
+    // Connection closed or failed without a close frame so there is no handshake
+    // left to do. Have the Server remove us.
+    if ( closeHandshake == CloseHandshake::eNone )
+    {
+      recordClose( metrics::CloseReason::eSocketClosed );
+      ws::Senders::Impl::close( cold->senders );
+    }
+    closeHandshake = CloseHandshake::eComplete;
+    cold->closeCallback( connectionID );
     return false;
   }
 
   // numBytesReceived > 0
   //std::cout << "Received " << numBytesReceived << " bytes." << std::endl;
 
+  if ( tracer.enabled() )
+  {
+    receivedTimePoint = std::chrono::steady_clock::now();
+  }
+
+  metrics.webSocketBytesIn.add( numBytesReceived );
+  bytesReceived += numBytesReceived;
+
   return parseFrame( buffer, numBytesReceived );
 }
 
@@ -142,6 +185,20 @@ bool WebSocket::parseFrame( char* p, size_t numBytes )
 {
   encoding::websocket::Decoder::Result parseResult{ frameParser.decode( p, numBytes ) };
 
+  if ( migratable )
+  {
+    keepUndecodedTail( p, numBytes, parseResult );
+  }
+
+  if ( tracer.enabled() )
+  {
+    decodedTimePoint = std::chrono::steady_clock::now();
+  }
+
+  metrics.webSocketFramesIn.add( parseResult.frames.size() );
+
+  LB_HTTPD_TRACE( ws__frame__decode, connectionID, numBytes, parseResult.frames.size() );
+
   for ( auto& frame : parseResult.frames )
   {
     if ( !frame.header.isMasked )
@@ -166,9 +223,13 @@ bool WebSocket::parseFrame( char* p, size_t numBytes )
       }
       if ( frame.header.fin )
       {
-        receivers.receiveData( connectionID
-                             , ws::Receivers::DataOpCode::eText
-                             , std::move( frame.payload ) );
+        metrics.webSocketMessagesIn.add();
+        if ( !admitMessage() )
+        {
+          return false;
+        }
+        deliverData( ws::Receivers::DataOpCode::eText
+                   , std::move( frame.payload ) );
       }
       else // must be the first frame of a fragmented text message
       {
@@ -184,9 +245,13 @@ bool WebSocket::parseFrame( char* p, size_t numBytes )
       }
       if ( frame.header.fin )
       {
-        receivers.receiveData( connectionID
-                             , ws::Receivers::DataOpCode::eBinary
-                             , std::move( frame.payload ) );
+        metrics.webSocketMessagesIn.add();
+        if ( !admitMessage() )
+        {
+          return false;
+        }
+        deliverData( ws::Receivers::DataOpCode::eBinary
+                   , std::move( frame.payload ) );
       }
       else // must be the first frame of a fragmented binary message
       {
@@ -202,9 +267,13 @@ bool WebSocket::parseFrame( char* p, size_t numBytes )
       }
       if ( frame.header.fin )
       {
-        receivers.receiveData( connectionID
-                             , fragmented->dataOpCode
-                             , std::move( fragmented->payload ) );
+        metrics.webSocketMessagesIn.add();
+        if ( !admitMessage() )
+        {
+          return false;
+        }
+        deliverData( fragmented->dataOpCode
+                   , std::move( fragmented->payload ) );
         fragmented.reset();
       }
       else // must be the first frame of a fragmented text message
@@ -216,24 +285,24 @@ bool WebSocket::parseFrame( char* p, size_t numBytes )
     {
       // Even if we are awaiting a close confirmation we still pass out the
       // notification here as it could be useful.
-      receivers.receiveControl( connectionID
-                              , ws::Receivers::ControlOpCode::eClose
-                              , frame.payload );
+      deliverControl( ws::Receivers::ControlOpCode::eClose
+                    , frame.payload );
 
       switch( closeHandshake )
       {
       case CloseHandshake::eNone:
       {
         closeHandshake = CloseHandshake::eClientInitiated;
+        recordClose( metrics::CloseReason::eClientClose );
 
         // Parrot back the payload as per the RFC. Note we can't pass frame.header
         // here as this will have the masking bit set.
         encoding::websocket::Header header;
         header.opCode = encoding::websocket::Header::OpCode::eConnectionClose;
         header.payloadSize = frame.payload.size();
-        sendFrame( header, frame.payload.c_str() );
+        sendControlFrame( header, frame.payload.c_str() );
 
-        ws::Senders::Impl::close( senders );
+        ws::Senders::Impl::close( cold->senders );
         break;
       }
       case CloseHandshake::eServerInitiated:
@@ -252,28 +321,26 @@ bool WebSocket::parseFrame( char* p, size_t numBytes )
       // Either way we close the socket. Ideally clients who initiate the close
       // will wait for us to do this (see RFC 6455 Section 7.1.1).
 
-      closeCallback( connectionID );
+      cold->closeCallback( connectionID );
 
       return false;
     }
     case encoding::websocket::Header::OpCode::ePing:
     {
-      receivers.receiveControl( connectionID
-                              , ws::Receivers::ControlOpCode::ePing
-                              , frame.payload );
+      deliverControl( ws::Receivers::ControlOpCode::ePing
+                    , frame.payload );
 
       // Parrot back the payload as per the RFC. Note we can't pass frame.header
       // here as this will have the masking bit set.
       encoding::websocket::Header header;
       header.opCode = encoding::websocket::Header::OpCode::ePong;
       header.payloadSize = frame.payload.size();
-      sendFrame( header, frame.payload.c_str() );
+      sendControlFrame( header, frame.payload.c_str() );
       break;
     }
     case encoding::websocket::Header::OpCode::ePong:
-      receivers.receiveControl( connectionID
-                              , ws::Receivers::ControlOpCode::eClose
-                              , frame.payload );
+      deliverControl( ws::Receivers::ControlOpCode::ePong
+                    , frame.payload );
       break;
     }
   }
@@ -281,8 +348,120 @@ bool WebSocket::parseFrame( char* p, size_t numBytes )
   return true;
 }
 
+bool WebSocket::admitMessage()
+{
+  if ( !clientAddress
+    || rateLimiter.tryAcquire( *clientAddress, RateLimiter::Kind::eMessage ) )
+  {
+    return true;
+  }
+
+  metrics.webSocketsRateLimited.add();
+  LB_HTTPD_LOG( eWarning, "WebSocket ID " << connectionID << " exceeded its message rate, closing" );
+
+  closeConnection( encoding::websocket::closestatus::ProtocolCode::ePolicyViolation
+                 , "Message rate exceeded." );
+  return false;
+}
+
+void WebSocket::keepUndecodedTail( const char* p
+                                  , size_t numBytes
+                                  , const encoding::websocket::Decoder::Result& result )
+{
+  // The bytes fed to the decoder so far are undecoded followed by p.
+  const size_t numFedBytes{ undecoded.size() + numBytes };
+  const auto byteAt = [this, p]( size_t i ) -> uint8_t
+  {
+    return ( i < undecoded.size() ) ? undecoded[i] : p[ i - undecoded.size() ];
+  };
+
+  // Walk the headers as actually encoded rather than re-encoding the decoded
+  // ones, which would be shorter for any non-minimal payload length.
+  size_t numFrameBytes{ 0 };
+  for ( size_t i = 0; i < result.frames.size(); ++i )
+  {
+    if ( numFrameBytes + 2 > numFedBytes )
+    {
+      undecoded.clear();
+      return;
+    }
+
+    const uint8_t second{ byteAt( numFrameBytes + 1 ) };
+    const uint8_t sizeCode( second & 0x7f );
+    const size_t numSizeBytes{ sizeCode == 127 ? 8u : sizeCode == 126 ? 2u : 0u };
+    const size_t numHeaderBytes{ 2 + numSizeBytes + ( ( second & 0x80 ) ? 4 : 0 ) };
+    if ( numFrameBytes + numHeaderBytes > numFedBytes )
+    {
+      undecoded.clear();
+      return;
+    }
+
+    uint64_t payloadSize{ sizeCode };
+    if ( numSizeBytes > 0 )
+    {
+      payloadSize = 0;
+      for ( size_t j = 0; j < numSizeBytes; ++j )
+      {
+        payloadSize = ( payloadSize << 8 ) | byteAt( numFrameBytes + 2 + j );
+      }
+    }
+
+    numFrameBytes += numHeaderBytes;
+    if ( payloadSize > numFedBytes - numFrameBytes )
+    {
+      // The decoder only returns whole frames so this cannot happen.
+      undecoded.clear();
+      return;
+    }
+    numFrameBytes += payloadSize;
+  }
+
+  const size_t numPending{ numFedBytes - numFrameBytes };
+  if ( numPending <= numBytes )
+  {
+    undecoded.assign( p + numBytes - numPending, numPending );
+  }
+  else
+  {
+    undecoded.erase( 0, numFrameBytes );
+    undecoded.append( p, numBytes );
+  }
+}
+
+void WebSocket::deliverData( ws::Receivers::DataOpCode opCode, std::string payload )
+{
+  auto trace{ tracer.sample() };
+
+  const auto start{ std::chrono::steady_clock::now() };
+  receivers.receiveData( connectionID, opCode, std::move( payload ), cold->senders );
+  const auto end{ std::chrono::steady_clock::now() };
+
+  metrics.recordReceiver( connectionID, end - start );
+
+  if ( trace )
+  {
+    using Stage = Server::Trace::Stage;
+    trace->webSocket = true;
+    trace->connectionID = connectionID;
+    trace->method = Server::Method::eGet;
+    trace->url = cold->urlPath;
+    trace->stages = { { Stage::eReceived, receivedTimePoint }
+                    , { Stage::eDecoded, decodedTimePoint }
+                    , { Stage::eReceiverStart, start }
+                    , { Stage::eReceiverEnd, end } };
+    tracer.push( std::move( *trace ) );
+  }
+}
+
+void WebSocket::deliverControl( ws::Receivers::ControlOpCode opCode, std::string payload )
+{
+  const auto start{ std::chrono::steady_clock::now() };
+  receivers.receiveControl( connectionID, opCode, std::move( payload ), cold->senders );
+  metrics.recordReceiver( connectionID, std::chrono::steady_clock::now() - start );
+}
+
 ws::SendResult
-WebSocket::sendMessage( std::string payload, size_t maxFrameSize )
+WebSocket::sendMessage( std::string_view payload, size_t maxFrameSize )
 {
   // Should not be necessary as we close the Senders::Impl but does no harm.
   if ( closeHandshake != CloseHandshake::eNone )
@@ -290,57 +469,184 @@ WebSocket::sendMessage( std::string payload, size_t maxFrameSize )
     return ws::SendResult::eClosed;
   }
 
-  const auto encodedHeaderSize
+  const auto plan
   {
-    encoding::websocket::Header::encodedSizeInBytes( payload.size(), false )
+    FramePlan::create( encoding::websocket::Header::OpCode::eText
+                     , payload.size()
+                     , maxFrameSize )
   };
-  if ( ( maxFrameSize != 0 ) && ( maxFrameSize <= encodedHeaderSize ) )
+  if ( !plan )
   {
-    std::cerr << "Max frame size is too low" << std::endl;
+    LB_HTTPD_LOG( eError, "Max frame size is too low" );
     return ws::SendResult::eFailure;
   }
 
-  size_t numPayloadBytesRemaining{ payload.size() };
+  return sendPlannedMessage( *plan, payload.data() );
+}
 
-  // Note that the server never masks the payload, only the client does.
-  encoding::websocket::Header header;
-  header.opCode = encoding::websocket::Header::OpCode::eText;
+ws::SendResult
+WebSocket::sendMessage( const ws::Message& message
+                      , size_t maxFrameSize
+                      , ws::Receivers::DataOpCode dataOpCode )
+{
+  // Should not be necessary as we close the Senders::Impl but does no harm.
+  if ( closeHandshake != CloseHandshake::eNone )
+  {
+    return ws::SendResult::eClosed;
+  }
+
+  const ws::Message::Impl*const impl{ ws::Message::Impl::get( message ) };
+  if ( !impl )
+  {
+    return sendMessage( std::string_view{}, maxFrameSize );
+  }
 
-  bool sentFirstFrame{ false };
-  const char* p{ payload.c_str() };
-  if ( maxFrameSize > 0 )
+  const auto opCode
   {
-    const auto encodedHeaderSize
+    ( dataOpCode == ws::Receivers::DataOpCode::eBinary )
+      ? encoding::websocket::Header::OpCode::eBinary
+      : encoding::websocket::Header::OpCode::eText
+  };
+
+  const auto plan{ impl->framePlan( opCode, maxFrameSize ) };
+  if ( !plan )
+  {
+    LB_HTTPD_LOG( eError, "Max frame size is too low" );
+    return ws::SendResult::eFailure;
+  }
+
+  return sendPlannedMessage( *plan, impl->payload.data() );
+}
+
+ws::SendResult
+WebSocket::sendPlannedMessage( const FramePlan& plan, const char* p )
+{
+  for ( size_t i = 0; i < plan.numFragments; ++i )
+  {
+    // First or Continuation (if any)
+    const auto result
     {
-      encoding::websocket::Header::encodedSizeInBytes( numPayloadBytesRemaining, false )
+      sendEncodedFrame( ( i == 0 ) ? plan.first : plan.middle
+                      , p
+                      , plan.fragmentPayloadSize )
     };
-    while ( numPayloadBytesRemaining + encodedHeaderSize > maxFrameSize )
+    if ( result != ws::SendResult::eSuccess )
     {
-      // First or Continuation (if any)
-      if ( sentFirstFrame )
-      {
-        header.opCode = encoding::websocket::Header::OpCode::eContinuation;
-      }
-      header.payloadSize = maxFrameSize - encodedHeaderSize;
-      //std::cout << "Sending frame..." << std::endl;
-      sendFrame( header, p );
-      sentFirstFrame = true;
-      numPayloadBytesRemaining -= header.payloadSize;
-      p += header.payloadSize;
+      return result;
     }
+    p += plan.fragmentPayloadSize;
   }
 
   // Final (maybe only) frame i.e. "fin"
-  //std::cout << "Sending final frame..." << std::endl;
-  header.fin = true;
-  header.payloadSize = numPayloadBytesRemaining;
-  sendFrame( header, p );
+  const auto result
+  {
+    sendEncodedFrame( plan.last
+                    , p
+                    , plan.payloadSize - plan.numFragments * plan.fragmentPayloadSize )
+  };
+  if ( result == ws::SendResult::eSuccess )
+  {
+    metrics.webSocketMessagesOut.add();
+  }
+  return result;
+}
 
-  return ws::SendResult::eSuccess;
+size_t WebSocket::adaptiveFramePayloadSize() const
+{
+  size_t budget{ minAdaptiveFramePayloadSize };
+
+  int sendBufferSize{ 0 };
+  socklen_t optionSize{ sizeof( sendBufferSize ) };
+  int numQueuedBytes{ 0 };
+  if ( ( getsockopt( socket, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, &optionSize ) == 0 )
+    && ( ioctl( socket, SIOCOUTQ, &numQueuedBytes ) == 0 )
+    && ( sendBufferSize > numQueuedBytes ) )
+  {
+    budget = std::max( budget, size_t( sendBufferSize - numQueuedBytes ) );
+  }
+
+  // Not available for TLS where MHD gives us one end of a socket pair.
+  tcp_info info{};
+  optionSize = sizeof( info );
+  if ( ( getsockopt( socket, IPPROTO_TCP, TCP_INFO, &info, &optionSize ) == 0 )
+    && ( info.tcpi_snd_cwnd > 0 )
+    && ( info.tcpi_snd_mss > 0 ) )
+  {
+    const size_t congestionWindowBytes{ size_t( info.tcpi_snd_cwnd ) * info.tcpi_snd_mss };
+    budget = std::max( minAdaptiveFramePayloadSize
+                     , std::min( budget, 2 * congestionWindowBytes ) );
+  }
+
+  return budget;
+}
+
+// static
+ws::ConnectionStats WebSocket::sampleStats( MHD_socket socket )
+{
+  ws::ConnectionStats stats;
+  stats.sampleTime = std::chrono::steady_clock::now();
+
+  int numQueuedBytes{ 0 };
+  if ( ioctl( socket, SIOCOUTQ, &numQueuedBytes ) == 0 )
+  {
+    stats.sendQueueBytes = numQueuedBytes;
+  }
+
+  tcp_info info{};
+  socklen_t optionSize{ sizeof( info ) };
+  if ( getsockopt( socket, IPPROTO_TCP, TCP_INFO, &info, &optionSize ) == 0 )
+  {
+    stats.hasTcpInfo = true;
+    stats.roundTripTime = std::chrono::microseconds{ info.tcpi_rtt };
+    stats.roundTripTimeVariance = std::chrono::microseconds{ info.tcpi_rttvar };
+    stats.congestionWindow = info.tcpi_snd_cwnd;
+    stats.sendMss = info.tcpi_snd_mss;
+    stats.unackedBytes = size_t( info.tcpi_unacked ) * info.tcpi_snd_mss;
+    stats.retransmits = info.tcpi_total_retrans;
+    stats.lostSegments = info.tcpi_lost;
+  }
+
+  return stats;
+}
+
+ws::SendResult
+WebSocket::sendStreamFrame( ws::Receivers::DataOpCode dataOpCode
+                          , bool first
+                          , bool fin
+                          , std::string_view payload )
+{
+  // Should not be necessary as we close the Senders::Impl but does no harm.
+  if ( closeHandshake != CloseHandshake::eNone )
+  {
+    return ws::SendResult::eClosed;
+  }
+
+  encoding::websocket::Header header;
+  if ( !first )
+  {
+    header.opCode = encoding::websocket::Header::OpCode::eContinuation;
+  }
+  else if ( dataOpCode == ws::Receivers::DataOpCode::eBinary )
+  {
+    header.opCode = encoding::websocket::Header::OpCode::eBinary;
+  }
+  else
+  {
+    header.opCode = encoding::websocket::Header::OpCode::eText;
+  }
+  header.fin = fin;
+  header.payloadSize = payload.size();
+
+  const auto result{ sendFrame( header, payload.data() ) };
+  if ( fin && ( result == ws::SendResult::eSuccess ) )
+  {
+    metrics.webSocketMessagesOut.add();
+  }
+  return result;
 }
 
 ws::SendResult WebSocket::sendClose( encoding::websocket::closestatus::PayloadCode code
-                                   , std::string reason )
+                                   , std::string_view reason )
 {
   // Should not be necessary as we close the Senders::Impl but does no harm.
   if ( closeHandshake != CloseHandshake::eNone )
@@ -358,17 +664,18 @@ ws::SendResult WebSocket::sendClose( encoding::websocket::closestatus::PayloadCo
   header.payloadSize = payload.size();
 
   closeHandshake = CloseHandshake::eServerInitiated;
+  recordClose( metrics::CloseReason::eServerClose );
 
-  closeSentTimePoint = std::chrono::steady_clock::now();
+  cold->closeSentTimePoint = std::chrono::steady_clock::now();
 
   sendFrame( header, payload.c_str() );
 
-  closeCallback( connectionID );
+  cold->closeCallback( connectionID );
 
   return ws::SendResult::eSuccess;
 }
 
-ws::SendResult WebSocket::sendPing( std::string payload )
+ws::SendResult WebSocket::sendPing( std::string_view payload )
 {
   // Should not be necessary as we close the Senders::Impl but does no harm.
   if ( closeHandshake != CloseHandshake::eNone )
@@ -380,12 +687,12 @@ ws::SendResult WebSocket::sendPing( std::string payload )
   header.opCode = encoding::websocket::Header::OpCode::ePing;
   header.payloadSize = payload.size();
 
-  sendFrame( header, payload.c_str() );
+  sendFrame( header, payload.data() );
 
   return ws::SendResult::eFailure;
 }
 
-ws::SendResult WebSocket::sendPong( std::string payload )
+ws::SendResult WebSocket::sendPong( std::string_view payload )
 {
   // Should not be necessary as we close the Senders::Impl but does no harm.
   if ( closeHandshake != CloseHandshake::eNone )
@@ -397,7 +704,7 @@ ws::SendResult WebSocket::sendPong( std::string payload )
   header.opCode = encoding::websocket::Header::OpCode::ePong;
   header.payloadSize = payload.size();
 
-  sendFrame( header, payload.c_str() );
+  sendFrame( header, payload.data() );
 
   return ws::SendResult::eFailure;
 }
@@ -406,25 +713,46 @@ ws::SendResult
 WebSocket::sendFrame( const encoding::websocket::Header& header
                     , const char* framePayload )
 {
-  const auto encodedHeaderSize{ header.encodedSizeInBytes() };
-  const size_t numBytesToSend{ encodedHeaderSize + header.payloadSize };
-  std::unique_ptr<char[]> sendBuffer
-  {
-    std::make_unique<char[]>( numBytesToSend )
-  };
+  return sendEncodedFrame( EncodedHeader{ header }, framePayload, header.payloadSize );
+}
+
+ws::SendResult
+WebSocket::sendControlFrame( const encoding::websocket::Header& header
+                           , const char* framePayload )
+{
+  std::scoped_lock l{ ws::Senders::Impl::sendMutex( cold->senders ) };
+  return sendFrame( header, framePayload );
+}
 
-  char* p = sendBuffer.get();
+ws::SendResult
+WebSocket::sendEncodedFrame( const EncodedHeader& encodedHeader
+                           , const char* framePayload
+                           , size_t framePayloadSize )
+{
+  // The header and payload are written together in a single gathering send so
+  // that the payload is never copied.
+  iovec iov[2];
+  iov[0].iov_base = const_cast<char*>( encodedHeader.bytes );
+  iov[0].iov_len  = encodedHeader.size;
+  iov[1].iov_base = const_cast<char*>( framePayload );
+  iov[1].iov_len  = framePayloadSize;
 
-  header.encode( p );
+  msghdr message{};
+  message.msg_iov    = iov;
+  message.msg_iovlen = 2;
 
-  p += encodedHeaderSize;
-  memcpy( p, framePayload, header.payloadSize );
+  const size_t numBytesToSend{ iov[0].iov_len + iov[1].iov_len };
+
+  LB_HTTPD_TRACE( ws__frame__send
+                , connectionID
+                , static_cast<unsigned char>( encodedHeader.bytes[0] )
+                , numBytesToSend );
 
   const int flags{ 0 };
   size_t numBytesRemaningToBeSent{ numBytesToSend };
   while ( numBytesRemaningToBeSent > 0 )
   {
-    const auto numSentBytes{ ::send( socket, sendBuffer.get(), numBytesToSend, flags ) };
+    const auto numSentBytes{ ::sendmsg( socket, &message, flags ) };
     if ( numSentBytes < 0 )
     {
       // MHD socket always blocks so this ought to be redundant
@@ -433,16 +761,36 @@ WebSocket::sendFrame( const encoding::websocket::Header& header
         continue;
       }
 
-      std::cerr << "Failed to send " << numBytesToSend << " of WebSocket data!" << std::endl;
+      LB_HTTPD_LOG( eError, "Failed to send " << numBytesToSend << " of WebSocket data!" );
       return ws::SendResult::eFailure;
     }
-    else if ( numSentBytes < numBytesToSend )
+
+    const size_t numSent{ static_cast<size_t>( numSentBytes ) };
+    if ( numSent < numBytesRemaningToBeSent )
+    {
+      LB_HTTPD_LOG( eWarning, "Did not send full frame!" );
+    }
+    numBytesRemaningToBeSent -= numSent;
+
+    // Skip over whatever has been sent ready for the next attempt.
+    size_t numSkip{ numSent };
+    while ( ( message.msg_iovlen > 0 ) && ( numSkip >= message.msg_iov->iov_len ) )
     {
-      std::cerr << "Did not send full frame!" << std::endl;
+      numSkip -= message.msg_iov->iov_len;
+      ++message.msg_iov;
+      --message.msg_iovlen;
+    }
+    if ( message.msg_iovlen > 0 )
+    {
+      message.msg_iov->iov_base = static_cast<char*>( message.msg_iov->iov_base ) + numSkip;
+      message.msg_iov->iov_len -= numSkip;
     }
-    numBytesRemaningToBeSent -= numSentBytes;
   }
 
+  metrics.webSocketFramesOut.add();
+  metrics.webSocketBytesOut.add( numBytesToSend );
+  bytesSent.fetch_add( numBytesToSend, std::memory_order_relaxed );
+
   return ws::SendResult::eSuccess;
 }
 
@@ -482,13 +830,147 @@ void WebSocket::closeConnection( encoding::websocket::closestatus::ProtocolCode
   payload.append( reason );
   header.payloadSize = payload.size();
 
-  closeHandshake = CloseHandshake::eServerInitiated;
+  // The socket is closed without awaiting the client's reply, so there is no
+  // handshake left for canClose to wait on.
+  closeHandshake = CloseHandshake::eComplete;
+  switch ( statusCode )
+  {
+  case encoding::websocket::closestatus::ProtocolCode::eGoingAway:
+    recordClose( metrics::CloseReason::eShutdown );
+    break;
+  case encoding::websocket::closestatus::ProtocolCode::ePolicyViolation:
+    recordClose( metrics::CloseReason::ePolicyViolation );
+    break;
+  default:
+    recordClose( metrics::CloseReason::eProtocolError );
+    break;
+  }
 
-  sendFrame( header, payload.c_str() );
+  sendControlFrame( header, payload.c_str() );
+
+  cold->closeCallback( connectionID );
+}
+
+void WebSocket::recordClose( metrics::CloseReason reason )
+{
+  // Each connection is counted once, against whatever ended it first.
+  if ( !cold->closeReason )
+  {
+    cold->closeReason = reason;
+    metrics.recordClose( reason );
+  }
+}
 
-  closeCallback( connectionID );
+
+// Version 1 layout, native byte order as both ends are on the same host:
+// magic, connection ID, URL size and URL, fragmented flag, opcode, size and
+// payload, undecoded size and bytes.
+static constexpr uint32_t migrationMagic{ 0x4c42574d }; // "LBWM"
+
+template< typename T >
+static void put( std::string& out, T value )
+{
+  out.append( reinterpret_cast<const char*>( &value ), sizeof( value ) );
 }
 
+static void putString( std::string& out, std::string_view value )
+{
+  put<uint64_t>( out, value.size() );
+  out.append( value );
+}
+
+template< typename T >
+static bool get( std::string_view& in, T& value )
+{
+  if ( in.size() < sizeof( value ) )
+  {
+    return false;
+  }
+  std::memcpy( &value, in.data(), sizeof( value ) );
+  in.remove_prefix( sizeof( value ) );
+  return true;
+}
+
+static bool getString( std::string_view& in, std::string& value )
+{
+  uint64_t size;
+  if ( !get( in, size ) || ( in.size() < size ) )
+  {
+    return false;
+  }
+  value.assign( in.data(), size );
+  in.remove_prefix( size );
+  return true;
+}
+
+std::string WebSocket::MigrationState::serialize() const
+{
+  std::string out;
+  out.reserve( 64 + urlPath.size() + undecoded.size()
+             + ( fragmented ? fragmented->payload.size() : 0 ) );
+
+  put( out, migrationMagic );
+  put<uint64_t>( out, connectionID );
+  putString( out, urlPath );
+  put<uint8_t>( out, fragmented ? 1 : 0 );
+  put<uint8_t>( out, fragmented ? static_cast<uint8_t>( fragmented->dataOpCode ) : 0 );
+  putString( out, fragmented ? std::string_view{ fragmented->payload } : std::string_view{} );
+  putString( out, undecoded );
+
+  return out;
+}
+
+// static
+std::optional<WebSocket::MigrationState>
+WebSocket::MigrationState::deserialize( std::string_view in )
+{
+  uint32_t magic;
+  uint64_t connectionID;
+  uint8_t isFragmented;
+  uint8_t opCode;
+  std::string fragmentedPayload;
+
+  MigrationState state;
+  if ( !get( in, magic ) || ( magic != migrationMagic )
+    || !get( in, connectionID )
+    || !getString( in, state.urlPath )
+    || !get( in, isFragmented )
+    || !get( in, opCode )
+    || !getString( in, fragmentedPayload )
+    || !getString( in, state.undecoded )
+    || !in.empty() )
+  {
+    return std::nullopt;
+  }
+
+  state.connectionID = connectionID;
+  if ( isFragmented )
+  {
+    state.fragmented = { static_cast<ws::Receivers::DataOpCode>( opCode )
+                       , std::move( fragmentedPayload ) };
+  }
+
+  return state;
+}
+
+WebSocket::MigrationState WebSocket::migrationState() const
+{
+  return { connectionID, cold->urlPath, fragmented, undecoded };
+}
+
+bool WebSocket::resume( MigrationState state )
+{
+  fragmented = std::move( state.fragmented );
+
+  if ( state.undecoded.empty() )
+  {
+    return true;
+  }
+
+  // Only ever part of a frame so nothing is delivered, it just primes the
+  // decoder for the rest.
+  return parseFrame( state.undecoded.data(), state.undecoded.size() );
+}
 
 } // End of namespace httpd
 
@@ -18,17 +18,24 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <lb/httpd/ws/ConnectionStats.h>
+#include <lb/httpd/ws/Message.h>
 #include <lb/httpd/ws/Receivers.h>
 #include <lb/httpd/ws/Senders.h>
 
+#include "FramePlan.h"
+#include "RateLimiter.h"
+
 #include <lb/encoding/websocket.h>
 
 #include <microhttpd.h>
 
+#include <atomic>
 #include <chrono>
 #include <functional>
-#include <mutex>
+#include <memory>
 #include <optional>
+#include <string_view>
 
 
 namespace lb
@@ -39,6 +46,15 @@ namespace httpd
 {
 
 
+namespace metrics
+{
+  struct Metrics;
+  enum class CloseReason;
+}
+
+class Tracer;
+
+
 /** \brief Handles a valid, connected WebSocket, allowing two-way communication.
 
     If \a Server is configured to accept WebSockets (via its constructor) then a
@@ -51,6 +67,10 @@ namespace httpd
 
     It stores a copy of the \a Receivers object returned from the connection
     established callback. This is set directly by \a Server.
+
+    The members are grouped by when they are used. Those used for every poll
+    event and every received frame are held directly, those only needed to
+    set up, send through or tear down the connection are held in \a Cold.
  */
 struct WebSocket
 {
@@ -58,21 +78,40 @@ struct WebSocket
 
   /** \brief Creates a manager for a single, established WebSocket connection.
       \param connectinoID The ID assigned by \a Serrver to this connection
+      \param closeTimeout How long to await the reply to our close frame.
+      \param migratable Keep what \a migrationState needs as data arrives.
+      \param metrics Where to count frames, bytes and messages. Must outlive us.
+      \param tracer Samples received messages. Must outlive us.
+      \param rateLimiter Limits received data messages. Must outlive us.
+      \param clientAddress The client's key in \a rateLimiter, if it has one.
       \param urlPath The URL path of the original request
       \param socket The MHD socket of the establisehd connection through which
                     we can \a send and \a recv.
       \param urh The MHS upgrade response handler that we need to close the
-                 connection.
+                 connection. Null if the socket is ours outright, as for a
+                 connection migrated from another process, and so closed
+                 directly.
    */
   WebSocket( ws::ConnectionID connectionID
            , size_t maxBytesToReceive
+           , std::chrono::milliseconds closeTimeout
+           , bool migratable
+           , metrics::Metrics& metrics
+           , Tracer& tracer
+           , RateLimiter& rateLimiter
+           , std::optional<RateLimiter::Address> clientAddress
            , std::string urlPath
            , MHD_socket socket
            , MHD_UpgradeResponseHandle* urh
            , CloseCallback closeCallback = {} );
   ~WebSocket();
 
-  bool canClose() const;
+  /** \brief Whether the Server may now remove us.
+
+      A close we initiated is held until the client replies or \a closeTimeout
+      has passed since it was sent.
+   */
+  bool canClose( std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now() );
 
   void closeSocket();
 
@@ -80,24 +119,81 @@ struct WebSocket
 
   bool parseFrame( char* buffer, size_t numBytesReceived );
 
+  /** \brief Keep the bytes given to \a frameParser that are not yet part of a frame. */
+  void keepUndecodedTail( const char* buffer
+                        , size_t numBytesReceived
+                        , const encoding::websocket::Decoder::Result& );
+
   std::optional<encoding::websocket::Header> parseHeader( const char* buffer
                                                         , size_t numBufferBytes );
 
+  /** \brief Check the client's message rate, closing the connection if exceeded. */
+  bool admitMessage();
+
+  /** \brief Pass a message to \a receivers, timing the call. */
+  void deliverData( ws::Receivers::DataOpCode, std::string payload );
+  void deliverControl( ws::Receivers::ControlOpCode, std::string payload );
+
   /** \brief Send a complete message through the WebSocket.
 
       A message may be split into multiple frames if a send limit has been set
       and the message size (including header) would exceed it.
    */
-  ws::SendResult sendMessage( std::string, size_t maxFrameSize );
+  ws::SendResult sendMessage( std::string_view, size_t maxFrameSize );
+
+  /** \brief As above but using the payload and cached frame headers of \a message. */
+  ws::SendResult sendMessage( const ws::Message& message
+                            , size_t maxFrameSize
+                            , ws::Receivers::DataOpCode );
+
+  ws::SendResult sendPlannedMessage( const FramePlan&, const char* payload );
+
+  /**
+      \brief The payload size for the next frame when fragmenting adaptively.
+
+      Sized to fit the free space in the socket's send buffer, capped at two
+      congestion windows' worth as anything more just queues in the kernel
+      ahead of any control frames, and never less than
+      \a minAdaptiveFramePayloadSize.
+   */
+  size_t adaptiveFramePayloadSize() const;
+
+  /** \brief Sample \a socket's TCP_INFO and send queue depth.
+
+      Only system calls on the descriptor so needs no lock, but a closed and
+      reused descriptor gives some other socket's figures.
+   */
+  static ws::ConnectionStats sampleStats( MHD_socket socket );
+
+  /** \brief Floor for \a adaptiveFramePayloadSize, avoiding tiny frames on a full socket. */
+  static constexpr size_t minAdaptiveFramePayloadSize{ 4 * 1024 };
+
+  /** \brief Send one frame of a message being streamed by a \a StreamSender. */
+  ws::SendResult sendStreamFrame( ws::Receivers::DataOpCode
+                                , bool first
+                                , bool fin
+                                , std::string_view payload );
 
-  ws::SendResult sendClose( encoding::websocket::closestatus::PayloadCode, std::string );
+  ws::SendResult sendClose( encoding::websocket::closestatus::PayloadCode, std::string_view );
 
-  ws::SendResult sendPing( std::string payload );
-  ws::SendResult sendPong( std::string payload );
+  ws::SendResult sendPing( std::string_view payload );
+  ws::SendResult sendPong( std::string_view payload );
 
   ws::SendResult sendFrame( const encoding::websocket::Header& header
                           , const char* remainingData );
 
+  /** \brief As \a sendFrame, for the frames we send of our own accord.
+
+      Holds the mutex that every send through \a Senders holds, so a frame
+      an application thread is part way through writing is finished first.
+   */
+  ws::SendResult sendControlFrame( const encoding::websocket::Header& header
+                                 , const char* remainingData );
+
+  ws::SendResult sendEncodedFrame( const EncodedHeader&
+                                 , const char* framePayload
+                                 , size_t framePayloadSize );
+
   /** \brief Send a close control frame to the client and close our socket.
 
       From RFC 6455:
@@ -109,24 +205,38 @@ struct WebSocket
   void closeConnection( encoding::websocket::closestatus::ProtocolCode statusCode
                       , const std::string& reason = {} );
 
+  /** \brief Remember and count the first reason given for the close, ignoring later ones. */
+  void recordClose( metrics::CloseReason );
 
-  std::mutex mutex;
 
-  const ws::ConnectionID connectionID;
-  const size_t maxBytesToReceive;
+  // Hot data, touched by the loop thread on every event.
 
-  const std::string urlPath;
   MHD_socket socket;
-  MHD_UpgradeResponseHandle* upgradeResponseHandle;
 
-  CloseCallback closeCallback;
+  // Note that there is no transition from eClientInitiated to eComplete as we
+  // have no way to detect it. They are, effectively, the same state.
+  enum class CloseHandshake
+  {
+    eNone,
+    eServerInitiated,
+    eClientInitiated,
+    eComplete
+  };
+  CloseHandshake closeHandshake{ CloseHandshake::eNone };
+
+  const ws::ConnectionID connectionID;
+  const size_t maxBytesToReceive;
+  const bool migratable;
 
-  ws::Receivers receivers; //!< Provided via Handler::connectionEstablished
+  metrics::Metrics& metrics;
+  Tracer& tracer;
+  RateLimiter& rateLimiter;
 
-  // This is shared with the ws::Handler::Connection object we pass to the
-  // connectionEstablised callback. We need to retain part ownership because
-  // we need to invalidate it if we go away.
-  ws::Senders senders;
+  /** \brief Only set if data messages are rate limited. */
+  const std::optional<RateLimiter::Address> clientAddress;
+
+  uint64_t bytesReceived{ 0 };              //!< Loop thread only
+  std::atomic<uint64_t> bytesSent{ 0 };     //!< Any sending thread
 
   encoding::websocket::Decoder frameParser;
 
@@ -137,19 +247,65 @@ struct WebSocket
   };
   std::optional<Fragmented> fragmented;
 
-  // Note that there is no transition from eClientInitiated to eComplete as we
-  // have no way to detect it. They are, effectively, the same state.
-  enum class CloseHandshake
+  /** \brief Received bytes still inside \a frameParser. Only kept if \a migratable. */
+  std::string undecoded;
+
+  ws::Receivers receivers; //!< Provided via Handler::connectionEstablished
+
+  using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+
+  // Only set when tracing, for the trace of the next message delivered.
+  TimePoint receivedTimePoint;
+  TimePoint decodedTimePoint;
+
+  // Cold data, only needed when setting up, sending or closing.
+  struct Cold
   {
-    eNone,
-    eServerInitiated,
-    eClientInitiated,
-    eComplete
+    const std::string urlPath;
+    MHD_UpgradeResponseHandle* upgradeResponseHandle;
+
+    CloseCallback closeCallback;
+
+    const bool ownsSocket;
+
+    const std::chrono::milliseconds closeTimeout;
+
+    // This is shared with the ws::Handler::Connection object we pass to the
+    // connectionEstablised callback. We need to retain part ownership because
+    // we need to invalidate it if we go away.
+    ws::Senders senders;
+
+    TimePoint closeSentTimePoint;
+
+    const TimePoint openedTimePoint{ std::chrono::steady_clock::now() };
+    std::optional<metrics::CloseReason> closeReason;
+
+    /** \brief The latest periodic sample, see Server::Config::connectionStatsInterval. */
+    std::optional<ws::ConnectionStats> stats;
   };
-  CloseHandshake closeHandshake{ CloseHandshake::eNone };
+  const std::unique_ptr<Cold> cold;
 
-  using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
-  TimePoint closeSentTimePoint;
+
+  // Migration to another process, see Server::migrateWebSockets.
+
+  /** \brief Everything needed to resume the connection given its socket. */
+  struct MigrationState
+  {
+    ws::ConnectionID connectionID;
+    std::string urlPath;
+    std::optional<Fragmented> fragmented;
+    std::string undecoded;
+
+    std::string serialize() const;
+
+    /** \brief Empty if \a data is not a valid, current version, state. */
+    static std::optional<MigrationState> deserialize( std::string_view data );
+  };
+
+  MigrationState migrationState() const;
+
+  /** \brief Pick up where the migrated connection left off. Call before polling. */
+  bool resume( MigrationState );
 };
 
 
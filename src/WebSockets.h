@@ -0,0 +1,152 @@
+#ifndef LIB_LB_HTTPD_WEBSOCKETS_H
+#define LIB_LB_HTTPD_WEBSOCKETS_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "WebSocket.h"
+
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+/** \brief Storage for the WebSocket connections of a \a Server.
+
+    WebSockets are constructed in place in fixed size blocks rather than in
+    individually allocated hash map nodes. Records never move once
+    constructed, as \a Senders and the \a Poller callbacks point at them, and
+    freed slots are reused by later connections.
+
+    The \a ConnectionID index maps an ID to its slot for lookups, adding and
+    removing.
+
+    Not thread safe.
+ */
+class WebSockets
+{
+public:
+  /** \brief Construct a WebSocket in a free slot. Returns null if \a id is in use. */
+  template< typename... Args >
+  WebSocket* emplace( ws::ConnectionID id, Args&&... args )
+  {
+    if ( index.count( id ) > 0 )
+    {
+      return nullptr;
+    }
+
+    if ( freeSlots.empty() )
+    {
+      const size_t firstSlot{ blocks.size() * blockSize };
+      blocks.push_back( std::make_unique<Slot[]>( blockSize ) );
+      for ( size_t i = blockSize; i > 0; --i )
+      {
+        freeSlots.push_back( firstSlot + i - 1 );
+      }
+    }
+
+    const size_t slot{ freeSlots.back() };
+    freeSlots.pop_back();
+
+    Slot& s{ at( slot ) };
+    s.emplace( id, std::forward<Args>( args )... );
+    index.emplace( id, slot );
+
+    return &*s;
+  }
+
+  WebSocket* find( ws::ConnectionID id )
+  {
+    const auto I{ index.find( id ) };
+    return ( I != index.end() ) ? &*at( I->second ) : nullptr;
+  }
+
+  const WebSocket* find( ws::ConnectionID id ) const
+  {
+    const auto I{ index.find( id ) };
+    return ( I != index.end() ) ? &*at( I->second ) : nullptr;
+  }
+
+  void erase( ws::ConnectionID id )
+  {
+    const auto I{ index.find( id ) };
+    if ( I != index.end() )
+    {
+      at( I->second ).reset();
+      freeSlots.push_back( I->second );
+      index.erase( I );
+    }
+  }
+
+  template< typename Function >
+  void forEach( Function f )
+  {
+    for ( const auto&[ id, slot ] : index )
+    {
+      f( *at( slot ) );
+    }
+  }
+
+  void clear()
+  {
+    index.clear();
+    freeSlots.clear();
+    blocks.clear();
+  }
+
+  size_t size() const { return index.size(); }
+
+private:
+  using Slot = std::optional<WebSocket>;
+
+  // 64 connections per allocation keeps the block well clear of the allocator's
+  // small object sizes while not wasting much on a quiet server.
+  static constexpr size_t blockSize{ 64 };
+
+  Slot& at( size_t slot )
+  {
+    return blocks[ slot / blockSize ][ slot % blockSize ];
+  }
+
+  const Slot& at( size_t slot ) const
+  {
+    return blocks[ slot / blockSize ][ slot % blockSize ];
+  }
+
+  std::vector< std::unique_ptr<Slot[]> > blocks;
+  std::vector< size_t > freeSlots;
+
+  std::unordered_map< ws::ConnectionID, size_t > index;
+};
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WEBSOCKETS_H
@@ -0,0 +1,83 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/CoConnection.h>
+#include "CoConnectionImpl.h"
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+bool CoConnection::ReceiveAwaitable::await_ready() const
+{
+  return ( impl.numQueued > 0 ) || impl.closed;
+}
+
+void CoConnection::ReceiveAwaitable::await_suspend( std::coroutine_handle<> h )
+{
+  impl.awaiting = h;
+}
+
+std::optional<CoConnection::Message> CoConnection::ReceiveAwaitable::await_resume()
+{
+  // Drain anything already queued before reporting the close.
+  return impl.pop();
+}
+
+ConnectionID CoConnection::id() const
+{
+  return d->id;
+}
+
+const std::string& CoConnection::url() const
+{
+  return d->url;
+}
+
+Senders& CoConnection::senders()
+{
+  return d->senders;
+}
+
+CoConnection::ReceiveAwaitable CoConnection::receive()
+{
+  return ReceiveAwaitable{ *d };
+}
+
+CoConnection::SendAwaitable CoConnection::send( std::string_view message
+                                              , size_t maxFrameSize )
+{
+  return SendAwaitable{ d->senders.sendData( message, maxFrameSize ) };
+}
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
@@ -0,0 +1,136 @@
+#ifndef LIB_LB_HTTPD_WS_COCONNECTIONIMPL_H
+#define LIB_LB_HTTPD_WS_COCONNECTIONIMPL_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/CoConnection.h>
+
+#include <utility>
+#include <vector>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief State shared between the coroutine and the \a Receivers feeding it.
+
+    Only ever touched on one thread at a time: the thread establishing the
+    connection until the coroutine first suspends and the WebSocket loop thread
+    thereafter, so no locking is required.
+ */
+struct CoConnection::Impl
+{
+  static CoConnection create( ConnectionID id, std::string url, Senders senders )
+  {
+    CoConnection connection;
+    connection.d = std::make_shared<Impl>( id, std::move( url ), std::move( senders ) );
+    return connection;
+  }
+
+  static std::shared_ptr<Impl> get( const CoConnection& connection )
+  {
+    return connection.d;
+  }
+
+  Impl( ConnectionID id, std::string url, Senders senders )
+    : id{ id }
+    , url{ std::move( url ) }
+    , senders{ std::move( senders ) }
+    , slots( 4 )
+  {
+  }
+
+  /** \brief Queue a received message, reusing a free slot if there is one. */
+  void push( Receivers::DataOpCode opCode, std::string payload )
+  {
+    if ( numQueued == slots.size() )
+    {
+      // Grow the pool, unwrapping the ring so that head is at the start.
+      std::vector<Message> grown( slots.size() * 2 );
+      for ( size_t i = 0; i < numQueued; ++i )
+      {
+        grown[i] = std::move( slots[ ( head + i ) % slots.size() ] );
+      }
+      slots.swap( grown );
+      head = 0;
+    }
+
+    Message& slot{ slots[ ( head + numQueued ) % slots.size() ] };
+    slot.opCode = opCode;
+    slot.payload = std::move( payload );
+    ++numQueued;
+  }
+
+  std::optional<Message> pop()
+  {
+    if ( numQueued == 0 )
+    {
+      return {};
+    }
+
+    Message& slot{ slots[ head ] };
+    std::optional<Message> message{ Message{ slot.opCode, std::move( slot.payload ) } };
+    head = ( head + 1 ) % slots.size();
+    --numQueued;
+    return message;
+  }
+
+  /** \brief Resume the coroutine if it is waiting in receive(). */
+  void resume()
+  {
+    if ( awaiting )
+    {
+      std::exchange( awaiting, {} ).resume();
+    }
+  }
+
+  const ConnectionID id;
+  const std::string url;
+
+  Senders senders;
+
+  // Ring of message slots, grown as required but never shrunk.
+  std::vector<Message> slots;
+  size_t head{ 0 };
+  size_t numQueued{ 0 };
+
+  bool closed{ false };
+
+  std::coroutine_handle<> awaiting;
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_COCONNECTIONIMPL_H
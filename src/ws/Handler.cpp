@@ -16,6 +16,8 @@
 */
 
 #include <lb/httpd/ws/Handler.h>
+#include "CoConnectionImpl.h"
+#include "../LoggingImpl.h"
 
 #include <mutex>
 #include <stdexcept>
@@ -46,26 +48,115 @@ struct Handler::Private
    */
   IsHandled isHandled;
 
+  /** \brief Exactly one of this and \a connectionTask is valid. */
   ConnectionEstablished connectionEstablished;
 
-  Private( IsHandled ih, ConnectionEstablished ce )
+  ConnectionTask connectionTask;
+
+  Private( IsHandled ih, ConnectionEstablished ce, ConnectionTask ct )
     : isHandled{ std::move( ih ) }
     , connectionEstablished{ std::move( ce ) }
+    , connectionTask{ std::move( ct ) }
   {
     if ( !isHandled )
     {
       throw std::runtime_error( "IsHandled function is invalid" );
     }
-    if ( !connectionEstablished )
+    if ( !connectionEstablished && !connectionTask )
     {
       throw std::runtime_error( "ConnectionEstablished function is invalid" );
     }
   }
+
+  Receivers startTask( Connection );
 };
 
+/** \brief Owns a connection's coroutine on behalf of its \a Receivers.
+
+    The \a Receivers returned for a coroutine connection capture this so the
+    coroutine frame lives exactly as long as the WebSocket's copy of them.
+ */
+struct TaskDriver
+{
+  std::shared_ptr<CoConnection::Impl> connection;
+  Task task;
+
+  void resume()
+  {
+    connection->resume();
+    checkException();
+  }
+
+  /** \brief Log and release the coroutine if an exception escaped it. */
+  void checkException()
+  {
+    if ( task.done() && task.exception() )
+    {
+      try
+      {
+        std::rethrow_exception( task.exception() );
+      }
+      catch ( const std::exception& e )
+      {
+        LB_HTTPD_LOG( eError, "WebSocket task for ID " << connection->id
+                              << " threw: " << e.what() );
+      }
+      catch ( ... )
+      {
+        LB_HTTPD_LOG( eError, "WebSocket task for ID " << connection->id
+                              << " threw an unknown exception" );
+      }
+      task = {};
+    }
+  }
+};
+
+Receivers Handler::Private::startTask( Connection c )
+{
+  CoConnection coConnection
+  {
+    CoConnection::Impl::create( c.id, c.url, std::move( c.senders ) )
+  };
+
+  auto driver{ std::make_shared<TaskDriver>() };
+  driver->connection = CoConnection::Impl::get( coConnection );
+
+  // Runs until the first suspension point, which may be the end of it.
+  driver->task = connectionTask( std::move( coConnection ) );
+  driver->checkException();
+
+  return
+  {
+    [driver]( ConnectionID, Receivers::DataOpCode opCode, std::string payload )
+    {
+      if ( driver->task.done() )
+      {
+        // Nothing will ever receive it.
+        return;
+      }
+      driver->connection->push( opCode, std::move( payload ) );
+      driver->resume();
+    },
+    [driver]( ConnectionID, Receivers::ControlOpCode opCode, std::string )
+    {
+      if ( opCode == Receivers::ControlOpCode::eClose )
+      {
+        driver->connection->closed = true;
+        driver->resume();
+      }
+    }
+  };
+}
+
 Handler::Handler( IsHandled ih
                 , ConnectionEstablished ce )
-  : d{ std::make_shared<Private>( std::move( ih ), std::move( ce ) ) }
+  : d{ std::make_shared<Private>( std::move( ih ), std::move( ce ), ConnectionTask{} ) }
+{
+}
+
+Handler::Handler( IsHandled ih
+                , ConnectionTask ct )
+  : d{ std::make_shared<Private>( std::move( ih ), ConnectionEstablished{}, std::move( ct ) ) }
 {
 }
 
@@ -80,7 +171,16 @@ Receivers Handler::connectionEstablised( Connection c ) const
 {
   std::scoped_lock<std::mutex> l{ d->mutex };
 
-  return d->connectionEstablished( std::move( c ) );
+  if ( d->connectionTask )
+  {
+    return d->startTask( std::move( c ) );
+  }
+  else if ( d->connectionEstablished )
+  {
+    return d->connectionEstablished( std::move( c ) );
+  }
+
+  return {};
 }
 
 void Handler::stopHandling()
@@ -89,6 +189,7 @@ void Handler::stopHandling()
 
   d->isHandled = {};
   d->connectionEstablished = {};
+  d->connectionTask = {};
 }
 
 
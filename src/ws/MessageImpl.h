@@ -0,0 +1,130 @@
+#ifndef LIB_LB_HTTPD_WS_MESSAGEIMPL_H
+#define LIB_LB_HTTPD_WS_MESSAGEIMPL_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/Message.h>
+
+#include "../FramePlan.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+struct Message::Impl
+{
+  /** \brief Null for a default constructed Message. */
+  static const Impl* get( const Message& message )
+  {
+    return message.d.get();
+  }
+
+  explicit Impl( std::string p )
+    : payload{ std::move( p ) }
+  {
+  }
+
+  ~Impl()
+  {
+    for ( auto& slot : framePlans )
+    {
+      delete slot.load( std::memory_order_relaxed );
+    }
+  }
+
+  /**
+      \brief The frame plan for sending this message, cached after first use.
+      \return Empty if \a maxFrameSize is too small, see \a FramePlan::create.
+
+      Lock free so that threads broadcasting the same message do not contend.
+      Only the first \a numCachedFramePlans opcode and frame size combinations
+      are cached, any more are planned afresh on each send.
+   */
+  std::optional<FramePlan> framePlan( encoding::websocket::Header::OpCode opCode
+                                    , size_t maxFrameSize ) const
+  {
+    for ( auto& slot : framePlans )
+    {
+      const CachedFramePlan* cached{ slot.load( std::memory_order_acquire ) };
+      if ( !cached )
+      {
+        auto plan{ FramePlan::create( opCode, payload.size(), maxFrameSize ) };
+        if ( !plan )
+        {
+          return plan;
+        }
+
+        auto fresh{ std::make_unique<const CachedFramePlan>( CachedFramePlan{ opCode, maxFrameSize, *plan } ) };
+        if ( slot.compare_exchange_strong( cached, fresh.get(), std::memory_order_acq_rel ) )
+        {
+          fresh.release();
+          return plan;
+        }
+        // Another thread filled the slot first, cached is now its plan.
+      }
+
+      if ( ( cached->opCode == opCode ) && ( cached->maxFrameSize == maxFrameSize ) )
+      {
+        return cached->plan;
+      }
+    }
+
+    return FramePlan::create( opCode, payload.size(), maxFrameSize );
+  }
+
+  const std::string payload;
+
+  /** \brief Typically a message is only ever sent one or two ways. */
+  static constexpr size_t numCachedFramePlans{ 4 };
+
+private:
+  struct CachedFramePlan
+  {
+    encoding::websocket::Header::OpCode opCode;
+    size_t maxFrameSize;
+    FramePlan plan;
+  };
+
+  // Filled in order and never emptied, so a null slot ends the search.
+  mutable std::array< std::atomic<const CachedFramePlan*>, numCachedFramePlans > framePlans{};
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_MESSAGEIMPL_H
@@ -0,0 +1,582 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/Reactor.h>
+#include "ReactorImpl.h"
+
+#include "../LoggingImpl.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+// Set for the duration of each pass on the thread making it.
+static thread_local bool passInProgress{ false };
+
+
+Reactor::Reactor( unsigned int numThreads )
+{
+  if ( numThreads == 0 )
+  {
+    throw std::runtime_error{ "A Reactor needs at least one thread" };
+  }
+
+  d = std::make_unique<Impl>( Scaling{ numThreads, numThreads }, true );
+}
+
+Reactor::Reactor( Scaling scaling )
+{
+  if ( scaling.maxThreads == 0 )
+  {
+    throw std::runtime_error{ "A Reactor needs at least one thread" };
+  }
+  if ( scaling.minThreads > scaling.maxThreads )
+  {
+    throw std::runtime_error{ "Reactor minimum threads above maximum" };
+  }
+  if ( ( scaling.shrinkUtilisation < 0.0 )
+    || ( scaling.shrinkUtilisation >= scaling.growUtilisation )
+    || ( scaling.growUtilisation > 1.0 ) )
+  {
+    throw std::runtime_error{ "Reactor utilisations must be ordered 0 <= shrink < grow <= 1" };
+  }
+  if ( scaling.interval.count() <= 0 )
+  {
+    throw std::runtime_error{ "Reactor scaling interval must be positive" };
+  }
+
+  d = std::make_unique<Impl>( scaling, true );
+}
+
+Reactor::Reactor( std::unique_ptr<Impl> impl )
+  : d{ std::move( impl ) }
+{
+}
+
+Reactor::~Reactor() = default;
+
+unsigned int Reactor::numThreads() const
+{
+  return d->numActiveLoops();
+}
+
+
+Reactor::Impl::Impl( Scaling s, bool threaded )
+  : scaling{ s }
+  , lastScaleTime{ std::chrono::steady_clock::now() }
+{
+  if ( !threaded )
+  {
+    loops.push_back( std::make_unique<Loop>( nextLoopID++ ) );
+    loops.front()->active = true;
+    return;
+  }
+
+  std::scoped_lock l{ scaleMutex };
+  for ( unsigned int i = 0; i < scaling.minThreads; ++i )
+  {
+    startLoop();
+  }
+}
+
+Reactor::Impl::~Impl()
+{
+  {
+    // No loop starts another after this.
+    std::scoped_lock l{ scaleMutex };
+    running = false;
+  }
+
+  for ( auto& loop : loops )
+  {
+    if ( loop->thread.joinable() )
+    {
+      loop->poller.wake();
+      loop->thread.join();
+    }
+  }
+}
+
+Reactor::Impl::ClientID Reactor::Impl::attach( Client client, int pollTimeout )
+{
+  std::unique_lock l{ passMutex };
+
+  const ClientID id{ nextClientID++ };
+  clients.push_back( { id, std::move( client ), pollTimeout } );
+  updateTimeout();
+
+  return id;
+}
+
+void Reactor::Impl::detach( ClientID id )
+{
+  std::unique_lock l{ passMutex };
+
+  clients.erase( std::remove_if( clients.begin()
+                               , clients.end()
+                               , [id]( const ClientEntry& entry ){ return entry.id == id; } )
+               , clients.end() );
+  updateTimeout();
+}
+
+void Reactor::Impl::updateTimeout()
+{
+  int newTimeout{ defaultPollTimeout };
+  for ( const auto& entry : clients )
+  {
+    newTimeout = std::min( newTimeout, entry.pollTimeout );
+  }
+  timeout = newTimeout;
+}
+
+uint64_t Reactor::Impl::reserve( int fd )
+{
+  std::scoped_lock l{ fdsMutex };
+
+  const auto I{ fds.find( fd ) };
+  if ( ( I != fds.end() ) && I->second.loop )
+  {
+    unpoll( fd, I->second );
+  }
+
+  const uint64_t ticket{ nextTicket++ };
+  fds[ fd ] = FD{ nullptr, ticket, {}, false };
+  return ticket;
+}
+
+bool Reactor::Impl::add( int fd, uint64_t ticket, Poller::Callback callback )
+{
+  while ( true )
+  {
+    {
+      std::scoped_lock l{ fdsMutex };
+
+      const auto I{ fds.find( fd ) };
+      if ( ( I == fds.end() ) || ( I->second.ticket != ticket ) || I->second.loop )
+      {
+        // Removed, and maybe the descriptor reused, since it was reserved.
+        return false;
+      }
+
+      if ( Loop*const loop{ leastLoaded() } )
+      {
+        I->second.callback = std::move( callback );
+        I->second.polling = true;
+        pollOn( *loop, fd, I->second );
+        return true;
+      }
+    }
+
+    // Nothing running yet, or any more, so start the first loop.
+    std::scoped_lock l{ scaleMutex };
+    if ( !running )
+    {
+      return false;
+    }
+    if ( numActiveLoops() == 0 )
+    {
+      startLoop();
+    }
+  }
+}
+
+void Reactor::Impl::remove( int fd )
+{
+  std::scoped_lock l{ fdsMutex };
+
+  const auto I{ fds.find( fd ) };
+  if ( I == fds.end() )
+  {
+    return;
+  }
+
+  if ( I->second.loop )
+  {
+    unpoll( fd, I->second );
+  }
+  fds.erase( I );
+}
+
+bool Reactor::Impl::polledBy( size_t loop, int fd ) const
+{
+  std::scoped_lock l{ fdsMutex };
+
+  const auto I{ fds.find( fd ) };
+  return ( I == fds.end() ) || ( I->second.loop && ( I->second.loop->id == loop ) );
+}
+
+unsigned int Reactor::Impl::numActiveLoops() const
+{
+  std::scoped_lock l{ fdsMutex };
+
+  return std::count_if( loops.begin()
+                      , loops.end()
+                      , []( const auto& loop ){ return loop->active; } );
+}
+
+Reactor::Impl::Loop* Reactor::Impl::leastLoaded() const
+{
+  Loop* least{ nullptr };
+  for ( const auto& loop : loops )
+  {
+    if ( loop->active && ( !least || ( loop->numFDs < least->numFDs ) ) )
+    {
+      least = loop.get();
+    }
+  }
+  return least;
+}
+
+void Reactor::Impl::pollOn( Loop& loop, int fd, FD& entry )
+{
+  entry.loop = &loop;
+  ++loop.numFDs;
+
+  if ( !entry.polling )
+  {
+    return;
+  }
+
+  loop.poller.add( fd, [this, fd, callback = entry.callback]
+  {
+    if ( callback() )
+    {
+      return true;
+    }
+
+    std::scoped_lock l{ fdsMutex };
+    const auto I{ fds.find( fd ) };
+    if ( I != fds.end() )
+    {
+      I->second.polling = false;
+    }
+    return false;
+  } );
+}
+
+void Reactor::Impl::unpoll( int fd, FD& entry )
+{
+  --entry.loop->numFDs;
+  entry.loop->poller.remove( fd );
+}
+
+// static
+bool Reactor::Impl::inPass()
+{
+  return passInProgress;
+}
+
+int Reactor::Impl::runPass( Loop& loop, int pollTimeout )
+{
+  Pass pass;
+  pass.timeout = pollTimeout;
+  pass.pollStart = std::chrono::steady_clock::now();
+  pass.numReady = loop.poller.wait( pollTimeout );
+  if ( pass.numReady < 0 )
+  {
+    return pass.numReady;
+  }
+  pass.wakeTime = loop.poller.lastWakeTime();
+  pass.timedOut = loop.poller.lastTimedOut();
+
+  {
+    std::shared_lock l{ passMutex };
+    passInProgress = true;
+
+    loop.poller.dispatch();
+
+    for ( const auto& entry : clients )
+    {
+      entry.client( loop.id, pass );
+    }
+
+    passInProgress = false;
+  }
+
+  loop.busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - pass.wakeTime ).count();
+
+  return pass.numReady;
+}
+
+void Reactor::Impl::run( Loop& loop )
+{
+  while ( running && loop.running )
+  {
+    if ( runPass( loop, timeout ) < 0 )
+    {
+      LB_HTTPD_LOG( eError, "Error while polling" );
+      std::this_thread::sleep_for( std::chrono::seconds( 2 ) ); // Keep trying every 2 seconds
+    }
+
+    maybeScale( loop );
+  }
+
+  loop.exited = true;
+}
+
+void Reactor::Impl::maybeScale( Loop& caller )
+{
+  if ( scaling.minThreads == scaling.maxThreads )
+  {
+    return;
+  }
+
+  std::unique_lock s{ scaleMutex, std::try_to_lock };
+  if ( !s || !running || !caller.running )
+  {
+    // A retired loop is on its way out and must not start itself again.
+    return;
+  }
+
+  const auto now{ std::chrono::steady_clock::now() };
+  const auto elapsed{ now - lastScaleTime };
+  if ( elapsed < scaling.interval )
+  {
+    return;
+  }
+  lastScaleTime = now;
+
+  reapLoops();
+
+  const double elapsedNanoseconds( std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() );
+
+  unsigned int numActive{ 0 };
+  size_t numFDs{ 0 };
+  size_t fewestFDs{ SIZE_MAX };
+  size_t mostFDs{ 0 };
+  double utilisation{ 0.0 }; // Summed over the active loops
+  Loop* lastActive{ nullptr };
+  {
+    std::scoped_lock l{ fdsMutex };
+
+    for ( auto& loop : loops )
+    {
+      const int64_t busy{ loop->busyNanoseconds.exchange( 0 ) };
+      if ( !loop->active )
+      {
+        continue;
+      }
+
+      ++numActive;
+      numFDs += loop->numFDs;
+      fewestFDs = std::min( fewestFDs, loop->numFDs );
+      mostFDs = std::max( mostFDs, loop->numFDs );
+      utilisation += busy / elapsedNanoseconds;
+      lastActive = loop.get();
+    }
+  }
+
+  if ( numActive == 0 )
+  {
+    return;
+  }
+
+  const auto tooManyFDs = [this, numFDs]( unsigned int numLoops )
+  {
+    return ( scaling.connectionsPerThread > 0 )
+        && ( numFDs > scaling.connectionsPerThread * numLoops );
+  };
+
+  if ( ( numActive < scaling.maxThreads )
+    && ( ( utilisation / numActive > scaling.growUtilisation ) || tooManyFDs( numActive ) ) )
+  {
+    startLoop();
+    rebalance();
+    LB_HTTPD_LOG( eInfo, "WebSocket loops grown to " << numActive + 1
+                         << " for " << numFDs << " connections" );
+    return;
+  }
+
+  if ( numActive > scaling.minThreads )
+  {
+    const bool shrink
+    {
+      ( numActive == 1 )
+        ? ( numFDs == 0 )
+        : ( ( utilisation / ( numActive - 1 ) < scaling.shrinkUtilisation ) && !tooManyFDs( numActive - 1 ) )
+    };
+    if ( shrink && retireLoop( *lastActive ) )
+    {
+      LB_HTTPD_LOG( eInfo, "WebSocket loops shrunk to " << numActive - 1
+                           << " for " << numFDs << " connections" );
+      return;
+    }
+  }
+
+  // Connections only ever join the least loaded loop, but leave any loop, so
+  // the loops drift apart as long lived connections outlast the rest.
+  if ( mostFDs - fewestFDs > std::max<size_t>( 2, numFDs / numActive / 4 ) )
+  {
+    rebalance();
+  }
+}
+
+void Reactor::Impl::startLoop()
+{
+  if ( numActiveLoops() >= scaling.maxThreads )
+  {
+    return;
+  }
+
+  // Always a fresh loop: a retired thread may still be finishing its last
+  // pass, and our caller may hold locks that pass needs.
+  auto loop{ std::make_unique<Loop>( nextLoopID++ ) };
+  loop->running = true;
+  loop->thread = std::thread{ &Impl::run, this, std::ref( *loop ) };
+
+  std::scoped_lock l{ fdsMutex };
+  loop->active = true;
+  loops.push_back( std::move( loop ) );
+}
+
+void Reactor::Impl::reapLoops()
+{
+  std::vector< std::unique_ptr<Loop> > exited;
+  {
+    std::scoped_lock l{ fdsMutex };
+
+    for ( auto I = loops.begin(); I != loops.end(); )
+    {
+      if ( !(*I)->active && (*I)->exited )
+      {
+        exited.push_back( std::move( *I ) );
+        I = loops.erase( I );
+      }
+      else
+      {
+        ++I;
+      }
+    }
+  }
+
+  // Their threads have left run(), so these joins are immediate.
+  for ( auto& loop : exited )
+  {
+    loop->thread.join();
+  }
+}
+
+bool Reactor::Impl::retireLoop( Loop& loop )
+{
+  bool retired{ false };
+
+  exclusive( [this, &loop, &retired]
+  {
+    std::scoped_lock l{ fdsMutex };
+
+    loop.active = false;
+
+    Loop*const target{ leastLoaded() };
+    if ( !target && ( loop.numFDs > 0 ) )
+    {
+      // A connection arrived since we looked. Keep going.
+      loop.active = true;
+      return;
+    }
+
+    for ( auto&[ fd, entry ] : fds )
+    {
+      if ( entry.loop == &loop )
+      {
+        unpoll( fd, entry );
+        pollOn( *leastLoaded(), fd, entry );
+      }
+    }
+
+    retired = true;
+  } );
+
+  if ( retired )
+  {
+    loop.running = false;
+    loop.poller.wake();
+  }
+
+  return retired;
+}
+
+void Reactor::Impl::rebalance()
+{
+  exclusive( [this]
+  {
+    std::scoped_lock l{ fdsMutex };
+
+    std::vector<Loop*> active;
+    for ( const auto& loop : loops )
+    {
+      if ( loop->active )
+      {
+        active.push_back( loop.get() );
+      }
+    }
+    if ( active.size() < 2 )
+    {
+      return;
+    }
+
+    // Only those still polled are worth moving, the rest are on their way out.
+    std::unordered_map< Loop*, std::vector<int> > movable;
+    for ( const auto&[ fd, entry ] : fds )
+    {
+      if ( entry.polling )
+      {
+        movable[ entry.loop ].push_back( fd );
+      }
+    }
+
+    const auto byNumFDs = []( const Loop* lhs, const Loop* rhs ){ return lhs->numFDs < rhs->numFDs; };
+
+    while ( true )
+    {
+      const auto[ fewest, most ]{ std::minmax_element( active.begin(), active.end(), byNumFDs ) };
+      auto& candidates{ movable[ *most ] };
+      if ( ( (*most)->numFDs <= (*fewest)->numFDs + 1 ) || candidates.empty() )
+      {
+        break;
+      }
+
+      const int fd{ candidates.back() };
+      candidates.pop_back();
+
+      FD& entry{ fds.at( fd ) };
+      unpoll( fd, entry );
+      pollOn( **fewest, fd, entry );
+    }
+  } );
+}
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
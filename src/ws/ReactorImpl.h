@@ -0,0 +1,262 @@
+#ifndef LIB_LB_HTTPD_WS_REACTORIMPL_H
+#define LIB_LB_HTTPD_WS_REACTORIMPL_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/Reactor.h>
+
+#include "../Poller.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+/** \brief A set of loops, each a \a Poller and usually a thread to drive it.
+
+    Servers attach themselves as clients and are called back on each loop after
+    every poll to do their own housekeeping. Each loop holds \a passMutex shared
+    while it dispatches and calls its clients, so \a exclusive can briefly stop
+    them all, e.g. to detach a client or to move connections elsewhere.
+
+    Loops are started, stopped and rebalanced within the Reactor::Scaling
+    limits by whichever loop thread next finds the interval has passed, see
+    \a maybeScale. Their number only changes with \a scaleMutex held.
+ */
+struct Reactor::Impl
+{
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  /** \brief What a loop saw in one poll, passed on to each client. */
+  struct Pass
+  {
+    int timeout;          //!< Milliseconds
+    TimePoint pollStart;
+    TimePoint wakeTime;
+    int numReady;
+    bool timedOut;
+  };
+
+  /** \brief Called on a loop after each poll, with the ID of the loop. */
+  using Client = std::function< void( size_t, const Pass& ) >;
+  using ClientID = size_t;
+
+  static Impl& get( Reactor& reactor )
+  {
+    return *reactor.d;
+  }
+
+  /** \brief Whether the calling thread is in the middle of a loop pass,
+             dispatching or calling clients, and so must never block.
+   */
+  static bool inPass();
+
+  /** \brief A Reactor with one loop and no thread, driven by calls to \a runOnce. */
+  static std::shared_ptr<Reactor> createUnthreaded()
+  {
+    return std::shared_ptr<Reactor>{ new Reactor{ std::make_unique<Impl>( Scaling{ 1, 1 }, false ) } };
+  }
+
+  /** \brief Start Scaling::minThreads loops, or with no \a threaded one
+             loop driven by \a runOnce.
+   */
+  Impl( Scaling, bool threaded );
+  ~Impl();
+
+  /** \brief Start calling \a client after each poll, which happens at least
+             every \a pollTimeout milliseconds.
+   */
+  ClientID attach( Client client, int pollTimeout );
+
+  /** \brief On return \a client is no longer being called and never will be. */
+  void detach( ClientID );
+
+  /**
+      \brief Claim \a fd for polling, to be followed by \a add.
+      \return The ticket to pass to \a add.
+
+      Never blocks, so may be called with locks held that a pass needs. Until
+      added \a fd is polled by no loop, see \a polledBy, and a \a remove
+      cancels the \a add.
+   */
+  uint64_t reserve( int fd );
+
+  /**
+      \brief Poll \a fd on the loop with the fewest file descriptors,
+             starting one if none is running.
+      \return False if \a fd was removed since it was reserved.
+
+      May wait for loop passes to finish so must not be called with any lock
+      held that a client takes.
+   */
+  bool add( int fd, uint64_t ticket, Poller::Callback );
+
+  /** \brief Stop polling \a fd. Its callback may still be running on its loop
+             until the end of the current pass.
+   */
+  void remove( int fd );
+
+  /** \brief Whether \a fd is polled by \a loop, or has never been added.
+
+      A reserved \a fd is polled by no loop until it is added.
+   */
+  bool polledBy( size_t loop, int fd ) const;
+
+  /** \brief Run \a f while no loop is dispatching or calling its clients. */
+  template< typename Function >
+  void exclusive( Function f )
+  {
+    std::unique_lock l{ passMutex };
+    f();
+  }
+
+  /** \brief One pass of an unthreaded Reactor's loop, polling for up to
+             \a timeout milliseconds.
+      \return The number of ready file descriptors, negative on error.
+   */
+  int runOnce( int timeout )
+  {
+    return runPass( *loops.front(), timeout );
+  }
+
+  /** \brief The file descriptor that is readable when an unthreaded Reactor's
+             loop has work to do.
+   */
+  int fd() const
+  {
+    return loops.front()->poller.fd();
+  }
+
+  /** \brief The longest any client lets a loop sleep for, in milliseconds. */
+  int pollTimeout() const
+  {
+    return timeout;
+  }
+
+  unsigned int numActiveLoops() const;
+
+private:
+  struct Loop
+  {
+    explicit Loop( size_t i ) : id{ i } {}
+
+    const size_t id;        //!< Never reused, unlike the memory
+    Poller poller;
+    size_t numFDs{ 0 };     //!< Guarded by fdsMutex
+    bool active{ false };   //!< Taking file descriptors. Guarded by fdsMutex
+    std::atomic<bool> running{ false };
+    std::atomic<bool> exited{ false };
+    std::atomic<int64_t> busyNanoseconds{ 0 }; //!< Since the last \a maybeScale
+    std::thread thread;
+  };
+
+  struct FD
+  {
+    Loop* loop;               //!< Null while only reserved
+    uint64_t ticket;
+    Poller::Callback callback;
+    bool polling;             //!< False once the callback has asked to be removed
+  };
+
+  struct ClientEntry
+  {
+    ClientID id;
+    Client client;
+    int pollTimeout;
+  };
+
+  void run( Loop& );
+  int runPass( Loop&, int timeout );
+
+  /** \brief Call with \a passMutex held exclusively. */
+  void updateTimeout();
+
+  // Call with fdsMutex held.
+  Loop* leastLoaded() const;
+  void pollOn( Loop&, int fd, FD& );
+  void unpoll( int fd, FD& );
+
+  /** \brief Called on the thread of \a caller between its passes. */
+  void maybeScale( Loop& caller );
+
+  // Call with scaleMutex held, and not passMutex or fdsMutex.
+  void startLoop();
+  bool retireLoop( Loop& );
+  void reapLoops();
+  void rebalance();
+
+  const Scaling scaling;
+
+  /** \brief The active loops, and retired ones whose threads are finishing
+             their last pass or have yet to be joined.
+
+      A retired loop is never restarted: a new one takes its place, so that
+      nothing has to wait for the old thread. Changed with both scaleMutex and
+      fdsMutex held, so either is enough to read it.
+   */
+  std::vector< std::unique_ptr<Loop> > loops;
+  size_t nextLoopID{ 0 }; //!< Guarded by scaleMutex
+
+  std::atomic<bool> running{ true };
+
+  std::shared_mutex passMutex;
+  std::vector<ClientEntry> clients;  //!< Guarded by passMutex
+  ClientID nextClientID{ 0 };        //!< Guarded by passMutex
+
+  // Default when there are no clients, as for a Server without stats sampling.
+  static constexpr int defaultPollTimeout{ 500 };
+  std::atomic<int> timeout{ defaultPollTimeout };
+
+  std::mutex scaleMutex;
+  TimePoint lastScaleTime; //!< Guarded by scaleMutex
+
+  mutable std::mutex fdsMutex;
+  std::unordered_map< int, FD > fds; //!< Guarded by fdsMutex
+  uint64_t nextTicket{ 0 };          //!< Guarded by fdsMutex
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_REACTORIMPL_H
@@ -16,6 +16,7 @@
 */
 
 #include <lb/httpd/ws/Receivers.h>
+#include <lb/httpd/ws/Senders.h>
 #include "ReceiversImpl.h"
 
 #include <unordered_map>
@@ -38,13 +39,21 @@ Receivers::Receivers( DataReceiver dr, ControlReceiver cr )
 {
 }
 
+Receivers::Receivers( std::shared_ptr<void> context
+                    , ContextDataReceiver dr
+                    , ContextControlReceiver cr )
+  : d{ std::make_shared<Impl>( std::move( context ), std::move( dr), std::move( cr ) ) }
+{
+}
+
 bool Receivers::receiveData( ConnectionID id
                            , DataOpCode dataOpCode
-                           , std::string message )
+                           , std::string message
+                           , Senders& senders )
 {
   if ( d )
   {
-    d->receiveData( id, dataOpCode, message );
+    d->receiveData( id, dataOpCode, std::move( message ), senders );
     return true;
   }
 
@@ -53,11 +62,12 @@ bool Receivers::receiveData( ConnectionID id
 
 bool Receivers::receiveControl( ConnectionID id
                               , ControlOpCode opCode
-                              , std::string payload )
+                              , std::string payload
+                              , Senders& senders )
 {
   if ( d )
   {
-    d->receiveControl( id, opCode, payload );
+    d->receiveControl( id, opCode, std::move( payload ), senders );
     return true;
   }
 
@@ -43,30 +43,49 @@ struct Receivers::Impl
   {
   }
 
+  Impl( std::shared_ptr<void> c, ContextDataReceiver ds, ContextControlReceiver cs )
+    : context{ std::move( c ) }
+    , contextDataReceiver{ std::move( ds ) }
+    , contextControlReceiver{ std::move( cs ) }
+  {
+  }
+
   void receiveData( ConnectionID id
                   , DataOpCode dataOpCode
-                  , std::string message ) const
+                  , std::string message
+                  , Senders& senders ) const
   {
     std::scoped_lock l{ mutex };
-    if ( dataReceiver )
+    if ( contextDataReceiver )
     {
-      dataReceiver( id, dataOpCode, message );
+      contextDataReceiver( context.get(), senders, dataOpCode, std::move( message ) );
+    }
+    else if ( dataReceiver )
+    {
+      dataReceiver( id, dataOpCode, std::move( message ) );
     }
   }
 
   void receiveControl( ConnectionID id
                      , ControlOpCode controlOpCode
-                     , std::string message ) const
+                     , std::string message
+                     , Senders& senders ) const
   {
     std::scoped_lock l{ mutex };
-    if ( controlReceiver )
+    if ( contextControlReceiver )
     {
-      controlReceiver( id, controlOpCode, message );
+      contextControlReceiver( context.get(), senders, controlOpCode, std::move( message ) );
+    }
+    else if ( controlReceiver )
+    {
+      controlReceiver( id, controlOpCode, std::move( message ) );
     }
   }
   /**
       \brief Should be called when the connection close handshake is initiated
              by either end.
+
+      Note that the context is retained until this object is destroyed.
    */
   void close()
   {
@@ -74,6 +93,8 @@ struct Receivers::Impl
 
     dataReceiver = {};
     controlReceiver = {};
+    contextDataReceiver = {};
+    contextControlReceiver = {};
   }
 
 private:
@@ -94,6 +115,15 @@ private:
       called to reset this back to an invalid function.
    */
   ControlReceiver controlReceiver;
+
+  /** \brief Opaque per-connection user context, possibly null. */
+  std::shared_ptr<void> context;
+
+  /** \brief As \a dataReceiver but for receivers constructed with a context. */
+  ContextDataReceiver contextDataReceiver;
+
+  /** \brief As \a controlReceiver but for receivers constructed with a context. */
+  ContextControlReceiver contextControlReceiver;
 };
 
 
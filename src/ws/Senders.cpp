@@ -17,6 +17,13 @@
 
 #include <lb/httpd/ws/Senders.h>
 #include "SendersImpl.h"
+#include "StreamSenderImpl.h"
+
+#include "../LoggingImpl.h"
+#include "../WebSocket.h"
+
+#include <algorithm>
+#include <unistd.h>
 
 
 namespace lb
@@ -31,7 +38,135 @@ namespace ws
 {
 
 
-SendResult Senders::sendData( std::string message, size_t maxFrameSize )
+SendResult Senders::Impl::sendData( std::string_view message
+                                  , size_t maxFrameSize ) const
+{
+  std::unique_lock l{ mutex };
+  if ( const auto result{ waitForDataChannel( l ) }; result != SendResult::eSuccess )
+  {
+    if ( result == SendResult::eFailure )
+    {
+      LB_HTTPD_LOG( eError, "Cannot send a data message while streaming one" );
+    }
+    return result;
+  }
+  if ( webSocket && ( maxFrameSize == adaptiveFrameSize ) )
+  {
+    return sendAdaptive( l, message, Receivers::DataOpCode::eText );
+  }
+  else if ( webSocket )
+  {
+    return webSocket->sendMessage( message, maxFrameSize );
+  }
+
+  return SendResult::eClosed;
+}
+
+SendResult Senders::Impl::sendData( const Message& message
+                                  , size_t maxFrameSize
+                                  , Receivers::DataOpCode dataOpCode ) const
+{
+  std::unique_lock l{ mutex };
+  if ( const auto result{ waitForDataChannel( l ) }; result != SendResult::eSuccess )
+  {
+    if ( result == SendResult::eFailure )
+    {
+      LB_HTTPD_LOG( eError, "Cannot send a data message while streaming one" );
+    }
+    return result;
+  }
+  if ( webSocket && ( maxFrameSize == adaptiveFrameSize ) )
+  {
+    return sendAdaptive( l, message.payload(), dataOpCode );
+  }
+  else if ( webSocket )
+  {
+    return webSocket->sendMessage( message, maxFrameSize, dataOpCode );
+  }
+
+  return SendResult::eClosed;
+}
+
+SendResult Senders::Impl::sendAdaptive( std::unique_lock<std::mutex>& l
+                                      , std::string_view message
+                                      , Receivers::DataOpCode dataOpCode ) const
+{
+  // Hold the data channel, just as a stream does, so that the mutex can be
+  // released between frames without another data message getting in.
+  acquireDataChannel();
+
+  SendResult result{ SendResult::eSuccess };
+  bool first{ true };
+  bool fin{ false };
+  while ( ( result == SendResult::eSuccess ) && !fin )
+  {
+    if ( !webSocket )
+    {
+      result = SendResult::eClosed;
+      break;
+    }
+
+    const size_t frameSize
+    {
+      std::min( message.size(), webSocket->adaptiveFramePayloadSize() )
+    };
+    fin = ( frameSize == message.size() );
+
+    result = webSocket->sendStreamFrame( dataOpCode
+                                       , first
+                                       , fin
+                                       , message.substr( 0, frameSize ) );
+    first = false;
+    message.remove_prefix( frameSize );
+
+    if ( !fin )
+    {
+      l.unlock();
+      l.lock();
+    }
+  }
+
+  releaseDataChannel();
+
+  return result;
+}
+
+SendResult Senders::Impl::sendClose( encoding::websocket::closestatus::PayloadCode code
+                                   , std::string_view reason ) const
+{
+  std::scoped_lock l{ mutex };
+  if ( webSocket )
+  {
+    return webSocket->sendClose( code, reason );
+  }
+
+  return SendResult::eClosed;
+}
+
+SendResult Senders::Impl::sendPing( std::string_view payload ) const
+{
+  std::scoped_lock l{ mutex };
+  if ( webSocket )
+  {
+    return webSocket->sendPing( payload );
+  }
+
+  return SendResult::eClosed;
+}
+
+SendResult Senders::Impl::sendPong( std::string_view payload ) const
+{
+  std::scoped_lock l{ mutex };
+  if ( webSocket )
+  {
+    return webSocket->sendPong( payload );
+  }
+
+  return SendResult::eClosed;
+}
+
+
+SendResult Senders::sendData( std::string_view message, size_t maxFrameSize )
 {
   if ( d )
   {
@@ -41,8 +176,97 @@ SendResult Senders::sendData( std::string message, size_t maxFrameSize )
   return SendResult::eNoImplementation;
 }
 
+SendResult Senders::sendData( const Message& message
+                            , size_t maxFrameSize
+                            , Receivers::DataOpCode dataOpCode )
+{
+  if ( d )
+  {
+    return d->sendData( message, maxFrameSize, dataOpCode );
+  }
+
+  return SendResult::eNoImplementation;
+}
+
+StreamSender Senders::openStream( size_t maxFrameSize
+                               , Receivers::DataOpCode dataOpCode )
+{
+  if ( d )
+  {
+    return StreamSender::Impl::create( d, maxFrameSize, dataOpCode );
+  }
+
+  return {};
+}
+
+SendResult Senders::sendStream( const Producer& producer
+                              , size_t maxFrameSize
+                              , Receivers::DataOpCode dataOpCode )
+{
+  if ( !d )
+  {
+    return SendResult::eNoImplementation;
+  }
+
+  StreamSender stream{ openStream( maxFrameSize, dataOpCode ) };
+
+  // Read at most one frame's worth at a time so memory use is bounded by the
+  // frame size rather than the message size.
+  const size_t bufferSize
+  {
+    ( ( maxFrameSize > 0 ) && ( maxFrameSize != adaptiveFrameSize ) )
+      ? StreamSender::Impl::maxChunkSize( maxFrameSize )
+      : defaultStreamBufferSize
+  };
+  if ( bufferSize == 0 )
+  {
+    LB_HTTPD_LOG( eError, "Max frame size is too low" );
+    return SendResult::eFailure;
+  }
+  std::unique_ptr<char[]> buffer{ std::make_unique<char[]>( bufferSize ) };
+
+  while ( true )
+  {
+    const auto numBytes{ producer( buffer.get(), bufferSize ) };
+    if ( numBytes < 0 )
+    {
+      // The message cannot be completed so destroying the stream fails the
+      // connection rather than sending what we have as if it were all.
+      return SendResult::eFailure;
+    }
+    else if ( numBytes == 0 )
+    {
+      return stream.finish();
+    }
+
+    const auto result{ stream.send( { buffer.get(), static_cast<size_t>( numBytes ) } ) };
+    if ( result != SendResult::eSuccess )
+    {
+      return result;
+    }
+  }
+}
+
+SendResult Senders::sendStream( int fd
+                              , size_t maxFrameSize
+                              , Receivers::DataOpCode dataOpCode )
+{
+  return sendStream( [fd]( char* buffer, size_t bufferSize ) -> ssize_t
+                     {
+                       ssize_t numBytes;
+                       do
+                       {
+                         numBytes = ::read( fd, buffer, bufferSize );
+                       }
+                       while ( ( numBytes < 0 ) && ( errno == EINTR ) );
+                       return numBytes;
+                     }
+                   , maxFrameSize
+                   , dataOpCode );
+}
+
 SendResult Senders::sendClose( encoding::websocket::closestatus::PayloadCode code
-                             , std::string reason )
+                             , std::string_view reason )
 {
   if ( d )
   {
@@ -51,7 +275,7 @@ SendResult Senders::sendClose( encoding::websocket::closestatus::PayloadCode cod
   return SendResult::eNoImplementation;
 }
 
-SendResult Senders::sendPing( std::string payload ) const
+SendResult Senders::sendPing( std::string_view payload ) const
 {
   if ( d )
   {
@@ -60,7 +284,7 @@ SendResult Senders::sendPing( std::string payload ) const
   return SendResult::eNoImplementation;
 }
 
-SendResult Senders::sendPong( std::string payload ) const
+SendResult Senders::sendPong( std::string_view payload ) const
 {
   if ( d )
   {
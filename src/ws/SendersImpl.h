@@ -20,9 +20,13 @@
 
 #include <lb/httpd/ws/SendResult.h>
 #include <lb/httpd/ws/Senders.h>
+#include "ReactorImpl.h"
 
-#include <functional>
+#include <condition_variable>
 #include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
 
 
 namespace lb
@@ -33,26 +37,24 @@ namespace httpd
 {
 
 
+struct WebSocket;
+
+
 namespace ws
 {
 
 
+/** \brief Links the public \a Senders handle directly to its \a WebSocket.
+
+    Calls go straight through to the WebSocket's send methods and the payload
+    is borrowed, not copied, all the way down to the socket write.
+ */
 struct Senders::Impl
 {
-  using DataSender  = std::function<SendResult( const std::string&, size_t maxFrameSize )>;
-  using CloseSender = std::function<SendResult( encoding::websocket::closestatus::PayloadCode
-                                              , const std::string& )>;
-  using PingSender  = std::function<SendResult( const std::string& )>;
-  using PongSender  = PingSender;
-
-  static Senders create( DataSender ds, CloseSender cs
-                       , PingSender pis, PongSender pos )
+  static Senders create( WebSocket& webSocket )
   {
     Senders senders;
-    senders.d = std::make_shared<Senders::Impl>( std::move( ds )
-                                               , std::move( cs )
-                                               , std::move( pis )
-                                               , std::move( pos ) );
+    senders.d = std::make_shared<Senders::Impl>( webSocket );
     return senders;
   }
 
@@ -61,94 +63,130 @@ struct Senders::Impl
     senders.d->close();
   }
 
-  Impl( DataSender ds, CloseSender cs, PingSender pis, PongSender pos )
-    : dataSender{ ds }
-    , closeSender{ cs }
-    , pingSender{ pis }
-    , pongSender{ pos }
+  /** \brief As \a close but not while a \a StreamSender is part way through a message.
+      \return True if closed.
+   */
+  static bool closeUnlessStreaming( Senders senders )
   {
-  }
+    std::scoped_lock l{ senders.d->mutex };
 
-  SendResult sendData( const std::string& message, size_t maxFrameSize ) const
-  {
-    std::scoped_lock l{ mutex };
-    if ( dataSender )
+    if ( senders.d->streamOwner )
     {
-      return dataSender( message, maxFrameSize );
+      return false;
     }
 
-    return SendResult::eClosed;
+    senders.d->webSocket = nullptr;
+    senders.d->dataChannelReleased.notify_all();
+    return true;
   }
 
-  SendResult sendClose( encoding::websocket::closestatus::PayloadCode code
-                      , const std::string& reason ) const
+  /** \brief Held by every send made through \a senders. */
+  static std::mutex& sendMutex( const Senders& senders )
   {
-    std::scoped_lock l{ mutex };
-    if ( closeSender )
-    {
-      return closeSender( code, reason );
-    }
+    return senders.d->mutex;
+  }
 
-    return SendResult::eClosed;
+  explicit Impl( WebSocket& ws )
+    : webSocket{ &ws }
+  {
   }
 
-  SendResult sendPing( const std::string& payload ) const
+  SendResult sendData( std::string_view message, size_t maxFrameSize ) const;
+
+  SendResult sendData( const Message& message
+                     , size_t maxFrameSize
+                     , Receivers::DataOpCode ) const;
+
+  /**
+      \brief Send a data message frame by frame, sizing each frame adaptively.
+
+      Called with \a l holding \a mutex and the data channel free. The mutex
+      is released between frames.
+   */
+  SendResult sendAdaptive( std::unique_lock<std::mutex>& l
+                         , std::string_view message
+                         , Receivers::DataOpCode ) const;
+
+  SendResult sendClose( encoding::websocket::closestatus::PayloadCode code
+                      , std::string_view reason ) const;
+
+  SendResult sendPing( std::string_view payload ) const;
+
+  SendResult sendPong( std::string_view payload ) const;
+
+  /** \brief Called when the WebSocket can no longer service sends.
+
+      That is when a close control frame is received or the WebSocket is
+      destroyed. This is not intended to be called by the Request maker
+      (although it would be perfectly safe to do so).
+   */
+  void close()
   {
     std::scoped_lock l{ mutex };
-    if ( pingSender )
-    {
-      return pingSender( payload );
-    }
 
-    return SendResult::eClosed;
+    webSocket = nullptr;
+
+    dataChannelReleased.notify_all();
   }
 
-  SendResult sendPong( const std::string& payload ) const
+  /**
+      \brief Wait, with \a l holding \a mutex, until no other thread has a
+             \a StreamSender in progress on this connection.
+      \return eSuccess once the data channel is free or the connection closed.
+              eFailure if the calling thread has a stream in progress itself,
+              in which case waiting would never end. eBusy without waiting if
+              the calling thread is a WebSocket loop, which would hold up
+              every connection on it and any Reactor::Impl::exclusive caller.
+   */
+  SendResult waitForDataChannel( std::unique_lock<std::mutex>& l ) const
   {
-    std::scoped_lock l{ mutex };
-    if ( pongSender )
+    const auto self{ std::this_thread::get_id() };
+
+    if ( streamOwner && webSocket )
     {
-      return pongSender( payload );
+      if ( *streamOwner == self )
+      {
+        return SendResult::eFailure;
+      }
+      if ( Reactor::Impl::inPass() )
+      {
+        return SendResult::eBusy;
+      }
     }
 
-    return SendResult::eClosed;
-  }
+    dataChannelReleased.wait( l, [this]
+    {
+      return !streamOwner || !webSocket;
+    } );
 
-  /** \brief Called via Manager when WebSocketHandler can no longer service sends.
+    return SendResult::eSuccess;
+  }
 
-      This is not intended to be called by the Request maker (although it would
-      be perfectly safe to do so).
-   */
-  void close()
+  void acquireDataChannel() const
   {
-    std::scoped_lock l{ mutex };
+    streamOwner = std::this_thread::get_id();
+  }
 
-    dataSender  = {};
-    closeSender = {};
-    pingSender  = {};
-    pongSender  = {};
+  void releaseDataChannel() const
+  {
+    streamOwner.reset();
+    dataChannelReleased.notify_all();
   }
 
   mutable std::mutex mutex;
 
-  /** \brief An object for sending WebSocket data messages.
+  /** \brief Signalled whenever a stream finishes or the connection closes. */
+  mutable std::condition_variable dataChannelReleased;
 
-      Valid until a close control frame is either sent or received at which
-      point \a close() should be invoked.
-   */
-  DataSender dataSender;
+  /** \brief The thread with a \a StreamSender in progress, if any. */
+  mutable std::optional<std::thread::id> streamOwner;
 
-  /** \brief An object for sending a WebSocket close connection control frame.
+  /** \brief The connection that sends are made on.
 
-      Sending a close control immediately suspends all sending capabilities.
+      Valid until a close control frame is received or the WebSocket goes away,
+      at which point \a close() should be invoked.
    */
-  CloseSender closeSender;
-
-  /** \brief An object for sending a WebSocket ping control frame. */
-  PingSender pingSender;
-
-  /** \brief An object for sending a WebSocket pong control frame. */
-  PongSender pongSender;
+  WebSocket* webSocket;
 };
 
 
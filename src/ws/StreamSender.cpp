@@ -0,0 +1,206 @@
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/StreamSender.h>
+#include "StreamSenderImpl.h"
+
+#include "SendersImpl.h"
+#include "../LoggingImpl.h"
+#include "../WebSocket.h"
+
+#include <algorithm>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+// static
+size_t StreamSender::Impl::maxChunkSize( size_t maxFrameSize )
+{
+  // Conservatively assume the header needed for a payload of the full frame size.
+  const auto encodedHeaderSize
+  {
+    encoding::websocket::Header::encodedSizeInBytes( maxFrameSize, false )
+  };
+
+  return ( maxFrameSize > encodedHeaderSize ) ? maxFrameSize - encodedHeaderSize : 0;
+}
+
+SendResult StreamSender::Impl::send( std::string_view chunk, bool fin )
+{
+  if ( finished )
+  {
+    return SendResult::eClosed;
+  }
+
+  const bool adaptive{ maxFrameSize == Senders::adaptiveFrameSize };
+  const size_t chunkLimit
+  {
+    ( ( maxFrameSize > 0 ) && !adaptive ) ? maxChunkSize( maxFrameSize ) : chunk.size()
+  };
+  if ( ( maxFrameSize > 0 ) && !adaptive && ( chunkLimit == 0 ) )
+  {
+    LB_HTTPD_LOG( eError, "Max frame size is too low" );
+    return SendResult::eFailure;
+  }
+
+  std::unique_lock l{ senders->mutex };
+
+  if ( !started )
+  {
+    if ( const auto result{ senders->waitForDataChannel( l ) }; result != SendResult::eSuccess )
+    {
+      if ( result == SendResult::eFailure )
+      {
+        LB_HTTPD_LOG( eError, "Cannot stream a data message while streaming another" );
+      }
+      return result;
+    }
+    senders->acquireDataChannel();
+    started = true;
+  }
+
+  if ( fin )
+  {
+    finished = true;
+  }
+
+  SendResult result{ SendResult::eSuccess };
+  do
+  {
+    if ( !senders->webSocket )
+    {
+      result = SendResult::eClosed;
+      break;
+    }
+
+    const size_t frameSize
+    {
+      std::min( chunk.size()
+              , adaptive ? senders->webSocket->adaptiveFramePayloadSize() : chunkLimit )
+    };
+    const bool lastFrame{ frameSize == chunk.size() };
+
+    result = senders->webSocket->sendStreamFrame( dataOpCode
+                                                , !sentFirstFrame
+                                                , fin && lastFrame
+                                                , chunk.substr( 0, frameSize ) );
+    sentFirstFrame = true;
+    chunk.remove_prefix( frameSize );
+
+    // Let control frames in between our frames.
+    if ( !lastFrame )
+    {
+      l.unlock();
+      l.lock();
+    }
+  }
+  while ( ( result == SendResult::eSuccess ) && !chunk.empty() );
+
+  if ( finished )
+  {
+    senders->releaseDataChannel();
+  }
+
+  return result;
+}
+
+void StreamSender::Impl::abandon()
+{
+  std::unique_lock l{ senders->mutex };
+
+  // A fin frame would pass the truncated message off as complete, and there is
+  // no other way to end it, so fail the connection instead.
+  if ( senders->webSocket )
+  {
+    LB_HTTPD_LOG( eWarning, "Streamed message abandoned, closing connection" );
+    senders->webSocket->sendClose( encoding::websocket::closestatus::PayloadCode{ internalErrorCloseCode }
+                                 , "Message abandoned" );
+  }
+
+  finished = true;
+  senders->releaseDataChannel();
+}
+
+
+StreamSender::StreamSender() = default;
+
+StreamSender::StreamSender( StreamSender&& ) = default;
+
+StreamSender& StreamSender::operator=( StreamSender&& other )
+{
+  if ( this != &other )
+  {
+    if ( d && d->started && !d->finished )
+    {
+      d->abandon();
+    }
+    d = std::move( other.d );
+  }
+  return *this;
+}
+
+StreamSender::~StreamSender()
+{
+  // Nothing to do if nothing was ever sent.
+  if ( d && d->started && !d->finished )
+  {
+    d->abandon();
+  }
+}
+
+SendResult StreamSender::send( std::string_view chunk )
+{
+  if ( !d )
+  {
+    return SendResult::eNoImplementation;
+  }
+  if ( chunk.empty() )
+  {
+    return SendResult::eSuccess;
+  }
+
+  return d->send( chunk, false );
+}
+
+SendResult StreamSender::finish( std::string_view lastChunk )
+{
+  if ( !d )
+  {
+    return SendResult::eNoImplementation;
+  }
+
+  return d->send( lastChunk, true );
+}
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
@@ -0,0 +1,92 @@
+#ifndef LIB_LB_HTTPD_WS_STREAMSENDERIMPL_H
+#define LIB_LB_HTTPD_WS_STREAMSENDERIMPL_H
+
+/*
+    Copyright (C) 2023  Paul Fotheringham (LinuxBrickie)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <lb/httpd/ws/Receivers.h>
+#include <lb/httpd/ws/Senders.h>
+#include <lb/httpd/ws/StreamSender.h>
+
+#include <cstdint>
+
+
+namespace lb
+{
+
+
+namespace httpd
+{
+
+
+namespace ws
+{
+
+
+struct StreamSender::Impl
+{
+  static StreamSender create( std::shared_ptr<Senders::Impl> senders
+                            , size_t maxFrameSize
+                            , Receivers::DataOpCode dataOpCode )
+  {
+    StreamSender stream;
+    stream.d = std::make_unique<Impl>( std::move( senders ), maxFrameSize, dataOpCode );
+    return stream;
+  }
+
+  /** \brief The largest frame payload that fits in \a maxFrameSize, zero if none. */
+  static size_t maxChunkSize( size_t maxFrameSize );
+
+  Impl( std::shared_ptr<Senders::Impl> s
+      , size_t maxFrameSize
+      , Receivers::DataOpCode dataOpCode )
+    : senders{ std::move( s ) }
+    , maxFrameSize{ maxFrameSize }
+    , dataOpCode{ dataOpCode }
+  {
+  }
+
+  /** \brief Send \a chunk, split into frames as necessary, the last one \a fin. */
+  SendResult send( std::string_view chunk, bool fin );
+
+  /** \brief Give up on a started message, closing the connection with 1011. */
+  void abandon();
+
+  /** \brief Internal Error, RFC 6455 Section 7.4.1. */
+  static constexpr uint16_t internalErrorCloseCode{ 1011 };
+
+  std::shared_ptr<Senders::Impl> senders;
+
+  const size_t maxFrameSize;
+  const Receivers::DataOpCode dataOpCode;
+
+  bool started{ false };  //!< True once the data channel is ours.
+  bool sentFirstFrame{ false };
+  bool finished{ false }; //!< True once the final frame has been attempted.
+};
+
+
+} // End of namespace ws
+
+
+} // End of namespace httpd
+
+
+} // End of namespace lb
+
+
+#endif // LIB_LB_HTTPD_WS_STREAMSENDERIMPL_H